@@ -25,9 +25,12 @@
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -38,15 +41,74 @@
 #include <sys/sysmacros.h>
 #endif
 
+#if defined(__aarch64__) && defined(__linux__) && defined(__GNUC__) && ! defined(__AARCH64EB__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifdef HWCAP_CRC32
+#define CRC32_ARMV8
+#endif
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define CRC32_PCLMUL
+#endif
+
 #include "cal.h"
 
+/*
+ * Static tracepoints for the cal provider, a nop each unless a tracer is
+ * attached. Durations are taken by the tracer between the start and done
+ * probes, reading the clock here would cost even without one.
+ */
+#ifdef WITH_SDT
+#include <sys/sdt.h>
+#define CAL_PROBE(name, ...) STAP_PROBEV(cal, name, ##__VA_ARGS__)
+#else
+#define CAL_PROBE(name, ...) do { } while ( 0 )
+#endif
+
 #define MAX_SIZE	393216
-#define INDEX_LAST	(0xFF + 1)
 #define HDR_MAGIC	"ConF"
+#define CRC32_POLY	0xEDB88320
+
+struct cal_section {
+	char name[CAL_MAX_NAME_LEN + 1];	/* NUL terminated section name */
+	uint8_t type;		/* Type of latest version */
+	uint8_t index;		/* Latest index number */
+	uint16_t flags;		/* Flags of latest version */
+	int64_t offset;		/* Header offset of latest version */
+	uint32_t length;	/* Payload length of latest version */
+	int crc;		/* Cached CRC32 result, see CRC_*, accessed atomically */
+	void * data;		/* Streaming mode: header and payload, read on demand, published atomically */
+};
+
+#define CRC_UNKNOWN	0
+#define CRC_GOOD	1
+#define CRC_BAD		2
 
+/*
+ * Nothing but the lazily filled crc and data of the sections changes after
+ * scan_sections(), so lookups need no lock. cal_write_block() is the
+ * exception and needs exclusive access.
+ */
 struct cal {
+	char * file;		/* Image path, reopened for writing */
 	ssize_t size;
 	void * mem;
+	int mapped;		/* mem is a read-only mapping of the image */
+	int fd;			/* Streaming mode: open MTD device, mem is NULL */
+	uint32_t erasesize;	/* Streaming mode: erase block size */
+	uint32_t writesize;	/* Minimal write unit, 1 for files */
+	uint8_t * window;	/* Streaming mode: scan window */
+	int64_t window_start;
+	size_t window_len;
+	struct cal_section * sections;	/* Sorted by name */
+	unsigned int count;
+	unsigned int scans;	/* Number of full image scans */
+	uint32_t fingerprint;	/* CRC32 of image size and all headers but hdrsum */
+	int64_t tail;		/* End of the last section, appends go after it */
 };
 
 struct header {
@@ -60,6 +122,151 @@ struct header {
 	uint32_t hdrsum;	/* Header CRC32 checksum */
 } __attribute__((__packed__));
 
+static void crc32_init(void);
+static int scan_sections(struct cal * cal);
+
+#ifdef WITH_STATIC_ARENA
+
+/*
+ * Static early boot builds keep everything a handle owns in a fixed arena
+ * instead of the heap: the image copy, the scan window, the index and the
+ * streamed blocks. Blocks are handed out in order and only the last one can
+ * grow. A freed block is given back once all blocks after it are freed too,
+ * and the arena starts over once all blocks are freed.
+ * The temporary buffers of cal_write_block() and cal_compact() still come
+ * from malloc().
+ */
+#define ARENA_SIZE	(2 * MAX_SIZE)
+#define ARENA_ALIGN	16
+
+struct arena_block {
+	size_t size;		/* Payload size */
+	size_t prev;		/* Offset of the block before */
+	int live;		/* Not freed yet */
+};
+
+#define ARENA_HDR	((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_ROUND(size)	(((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static uint8_t arena[ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+static size_t arena_used;	/* End of the last block */
+static size_t arena_last;	/* Offset of the last block, always a live one */
+static unsigned int arena_live;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void * cal_alloc(unsigned long size) {
+
+	struct arena_block * block;
+	void * ptr = NULL;
+
+	pthread_mutex_lock(&arena_lock);
+
+	if ( size <= ARENA_SIZE && ARENA_HDR + ARENA_ROUND(size) <= ARENA_SIZE - arena_used ) {
+		block = (struct arena_block *)(arena + arena_used);
+		block->size = size;
+		block->prev = arena_last;
+		block->live = 1;
+		arena_last = arena_used;
+		arena_used += ARENA_HDR + ARENA_ROUND(size);
+		arena_live++;
+		ptr = (uint8_t *)block + ARENA_HDR;
+	} else {
+		errno = ENOMEM;
+	}
+
+	pthread_mutex_unlock(&arena_lock);
+	return ptr;
+
+}
+
+void cal_free(void * ptr) {
+
+	size_t offset;
+
+	if ( ! ptr )
+		return;
+
+	pthread_mutex_lock(&arena_lock);
+
+	offset = (uint8_t *)ptr - ARENA_HDR - arena;
+	((struct arena_block *)(arena + offset))->live = 0;
+
+	/* Give back the tail up to the last block still in use */
+	if ( offset == arena_last ) {
+		do {
+			arena_used = arena_last;
+			arena_last = ((struct arena_block *)(arena + arena_last))->prev;
+		} while ( arena_used > 0 && ! ((struct arena_block *)(arena + arena_last))->live );
+	}
+
+	if ( --arena_live == 0 )
+		arena_used = arena_last = 0;
+
+	pthread_mutex_unlock(&arena_lock);
+
+}
+
+static void * arena_realloc(void * ptr, size_t size) {
+
+	struct arena_block * block;
+	size_t offset;
+	size_t old;
+	void * new;
+
+	if ( ! ptr )
+		return cal_alloc(size);
+
+	pthread_mutex_lock(&arena_lock);
+
+	offset = (uint8_t *)ptr - ARENA_HDR - arena;
+	block = (struct arena_block *)(arena + offset);
+
+	/* The last block grows in place */
+	if ( offset == arena_last && size <= ARENA_SIZE && ARENA_HDR + ARENA_ROUND(size) <= ARENA_SIZE - offset ) {
+		block->size = size;
+		arena_used = offset + ARENA_HDR + ARENA_ROUND(size);
+		pthread_mutex_unlock(&arena_lock);
+		return ptr;
+	}
+
+	old = block->size;
+	pthread_mutex_unlock(&arena_lock);
+
+	new = cal_alloc(size);
+	if ( ! new )
+		return NULL;
+
+	memcpy(new, ptr, old < size ? old : size);
+	cal_free(ptr);
+	return new;
+
+}
+
+#define mem_alloc(size)		cal_alloc(size)
+#define mem_realloc(ptr, size)	arena_realloc(ptr, size)
+#define mem_free(ptr)		cal_free(ptr)
+
+#else
+
+#define mem_alloc(size)		malloc(size)
+#define mem_realloc(ptr, size)	realloc(ptr, size)
+#define mem_free(ptr)		free(ptr)
+
+#endif
+
+static char * copy_string(const char * str) {
+
+	size_t len = strlen(str) + 1;
+	char * copy;
+
+	copy = mem_alloc(len);
+	if ( copy )
+		memcpy(copy, str, len);
+
+	return copy;
+
+}
+
 
 int cal_init_file(const char * file, struct cal ** cal_out) {
 
@@ -67,6 +274,10 @@ int cal_init_file(const char * file, struct cal ** cal_out) {
 	uint64_t blksize = 0;
 	ssize_t size = 0;
 	void * mem = NULL;
+	int mapped = 0;
+	int stream = 0;
+	uint32_t erasesize = 0;
+	uint32_t writesize = 0;
 	struct cal * cal = NULL;
 	struct stat st;
 #ifdef __linux__
@@ -75,10 +286,16 @@ int cal_init_file(const char * file, struct cal ** cal_out) {
 	off_t lsize = 0;
 #endif
 
+	CAL_PROBE(init_start, file);
+
+	crc32_init();
+
 	fd = open(file, O_RDONLY);
 
-	if ( fd < 0 )
+	if ( fd < 0 ) {
+		CAL_PROBE(init_done, file, -1, 0, 0);
 		return -1;
+	}
 
 	if ( fstat(fd, &st) != 0 )
 		goto err;
@@ -108,6 +325,9 @@ int cal_init_file(const char * file, struct cal ** cal_out) {
 			if ( ioctl(fd, MEMGETINFO, &mtd_info) != 0 )
 				goto err;
 			size = mtd_info.size;
+			erasesize = mtd_info.erasesize;
+			writesize = mtd_info.writesize;
+			stream = 1;
 		} else {
 			goto err;
 		}
@@ -119,31 +339,74 @@ int cal_init_file(const char * file, struct cal ** cal_out) {
 	if ( size == 0 || size > MAX_SIZE )
 		goto err;
 
-	mem = malloc(size);
+	/* Regular files and block devices can be used in place */
+	if ( S_ISREG(st.st_mode) || S_ISBLK(st.st_mode) ) {
+		mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if ( mem == MAP_FAILED )
+			mem = NULL;
+		else
+			mapped = 1;
+	}
 
-	if ( ! mem )
-		goto err;
+	if ( ! mem && ! stream ) {
 
-	if ( read(fd, mem, size) != size )
-		goto err;
+		mem = mem_alloc(size);
 
-	cal = malloc(sizeof(struct cal));
+		if ( ! mem )
+			goto err;
+
+		if ( read(fd, mem, size) != size )
+			goto err;
+
+	}
+
+	cal = mem_alloc(sizeof(struct cal));
 
 	if ( ! cal )
 		goto err;
 
+	memset(cal, 0, sizeof(*cal));
+
+	cal->file = copy_string(file);
+	if ( ! cal->file )
+		goto err;
+
 	cal->mem = mem;
+	cal->mapped = mapped;
+	cal->fd = stream ? fd : -1;
+	cal->erasesize = erasesize ? erasesize : 4096;
+	cal->writesize = writesize ? writesize : 1;
+	cal->window = NULL;
+	cal->window_start = 0;
+	cal->window_len = 0;
 	cal->size = size;
+	cal->sections = NULL;
+	cal->count = 0;
+	cal->scans = 0;
+	cal->tail = 0;
 
-	close(fd);
+	if ( scan_sections(cal) != 0 )
+		goto err;
+
+	if ( ! stream )
+		close(fd);
 
 	*cal_out = cal;
+	CAL_PROBE(init_done, file, 0, size, cal->count);
 	return 0;
 
 err:
+	if ( cal ) {
+		mem_free(cal->window);
+		mem_free(cal->file);
+	}
 	close(fd);
-	free(mem);
-	free(cal);
+	if ( mapped )
+		munmap(mem, size);
+	else
+		mem_free(mem);
+	mem_free(cal);
+	CAL_PROBE(init_done, file, -1, size, 0);
 	return -1;
 
 }
@@ -156,26 +419,37 @@ int cal_init(struct cal ** cal_out) {
 
 void cal_finish(struct cal * cal) {
 
+	unsigned int i;
+
 	if ( cal ) {
-		free(cal->mem);
-		free(cal);
+		for ( i = 0; i < cal->count; i++ )
+			mem_free(cal->sections[i].data);
+		mem_free(cal->sections);
+		if ( cal->fd >= 0 )
+			close(cal->fd);
+		if ( cal->mapped )
+			munmap(cal->mem, cal->size);
+		else
+			mem_free(cal->mem);
+		mem_free(cal->file);
+		mem_free(cal);
 	}
 
 }
 
-static uint32_t crc32(uint32_t crc, const void * _data, size_t size) {
+/* Reference implementation, one bit at a time */
+static uint32_t crc32_bitwise(uint32_t crc, const void * _data, size_t size) {
 
 	const uint8_t * data = _data;
 	uint8_t value;
 	unsigned int bit;
 	size_t i;
-	const uint32_t poly = 0xEDB88320;
 
 	for ( i = 0; i < size; i++ ) {
 		value = data[i];
 		for ( bit = 8; bit; bit-- ) {
 			if ( (crc & 1) != (value & 1) )
-				crc = (crc >> 1) ^ poly;
+				crc = (crc >> 1) ^ CRC32_POLY;
 			else
 				crc >>= 1;
 			value >>= 1;
@@ -186,9 +460,233 @@ static uint32_t crc32(uint32_t crc, const void * _data, size_t size) {
 
 }
 
-static int is_header(void *data, size_t size) {
+static uint32_t crc32_table[8][256];
+
+static void crc32_init_table(void) {
+
+	uint32_t crc;
+	unsigned int i, j;
+
+	for ( i = 0; i < 256; i++ ) {
+		crc = i;
+		for ( j = 0; j < 8; j++ )
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+		crc32_table[0][i] = crc;
+	}
+
+	for ( i = 0; i < 256; i++ )
+		for ( j = 1; j < 8; j++ )
+			crc32_table[j][i] = (crc32_table[j-1][i] >> 8) ^ crc32_table[0][crc32_table[j-1][i] & 0xFF];
+
+}
+
+/* Slicing-by-8, eight table lookups per 8 bytes */
+static uint32_t crc32_slice8(uint32_t crc, const void * _data, size_t size) {
+
+	const uint8_t * data = _data;
+	uint32_t a, b;
+
+	while ( size >= 8 ) {
+		a = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+		b = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+		crc = crc32_table[7][a & 0xFF] ^ crc32_table[6][(a >> 8) & 0xFF] ^
+		      crc32_table[5][(a >> 16) & 0xFF] ^ crc32_table[4][a >> 24] ^
+		      crc32_table[3][b & 0xFF] ^ crc32_table[2][(b >> 8) & 0xFF] ^
+		      crc32_table[1][(b >> 16) & 0xFF] ^ crc32_table[0][b >> 24];
+		data += 8;
+		size -= 8;
+	}
+
+	while ( size-- )
+		crc = crc32_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+
+}
+
+#ifdef CRC32_ARMV8
 
-	struct header * hdr = data;
+/* ARMv8 CRC32 instructions use the same (non-Castagnoli) polynomial */
+static uint32_t __attribute__((target("+crc"))) crc32_armv8(uint32_t crc, const void * _data, size_t size) {
+
+	const uint8_t * data = _data;
+	uint64_t value;
+
+	while ( size >= 8 ) {
+		memcpy(&value, data, 8);
+		crc = __crc32d(crc, value);
+		data += 8;
+		size -= 8;
+	}
+
+	while ( size-- )
+		crc = __crc32b(crc, *data++);
+
+	return crc;
+
+}
+
+#endif
+
+#ifdef CRC32_PCLMUL
+
+/*
+ * Carry-less multiplication folding (Intel, "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ"), four 128-bit lanes at a time. The constants
+ * are x^n mod P for the bit reflected polynomial. Inputs shorter than 64
+ * bytes and the tail after the last 16 byte block go through slicing-by-8.
+ */
+static uint32_t __attribute__((target("sse2,pclmul"))) crc32_pclmul(uint32_t crc, const void * _data, size_t size) {
+
+	const uint8_t * data = _data;
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	if ( size < 64 )
+		return crc32_slice8(crc, data, size);
+
+	x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	data += 64;
+	size -= 64;
+
+	while ( size >= 64 ) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(data + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 0x30)));
+		data += 64;
+		size -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while ( size >= 16 ) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)data)), x5);
+		data += 16;
+		size -= 16;
+	}
+
+	/* 128 to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_set_epi32(0, ~0, 0, ~0);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_set_epi64x(0, 0x0163cd6124);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	crc = _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+	return crc32_slice8(crc, data, size);
+
+}
+
+#endif
+
+static const struct {
+	const char * name;
+	uint32_t (*func)(uint32_t crc, const void * data, size_t size);
+} crc32_backends[] = {
+#ifdef CRC32_ARMV8
+	{ "armv8", crc32_armv8 },
+#endif
+#ifdef CRC32_PCLMUL
+	{ "pclmul", crc32_pclmul },
+#endif
+	{ "slice8", crc32_slice8 },
+	{ "bitwise", crc32_bitwise },
+};
+
+static uint32_t (*crc32_func)(uint32_t crc, const void * data, size_t size);
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+/* Whether the CPU has what crc32_backends[i] needs */
+static int crc32_available(size_t i) {
+
+#ifdef CRC32_ARMV8
+	if ( crc32_backends[i].func == crc32_armv8 )
+		return !! (getauxval(AT_HWCAP) & HWCAP_CRC32);
+#endif
+#ifdef CRC32_PCLMUL
+	if ( crc32_backends[i].func == crc32_pclmul ) {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+	}
+#endif
+	(void)i;
+	return 1;
+
+}
+
+/* Pick the fastest backend, CAL_CRC32=<name> forces a specific one */
+static void crc32_select(void) {
+
+	const char * force;
+	size_t i;
+
+	crc32_init_table();
+
+	force = getenv("CAL_CRC32");
+	for ( i = 0; i < sizeof(crc32_backends)/sizeof(crc32_backends[0]); i++ ) {
+		if ( force && *force && strcmp(force, crc32_backends[i].name) != 0 )
+			continue;
+		if ( ! crc32_available(i) )
+			continue;
+		crc32_func = crc32_backends[i].func;
+		return;
+	}
+
+	crc32_func = crc32_slice8;
+
+}
+
+static void crc32_init(void) {
+
+	pthread_once(&crc32_once, crc32_select);
+
+}
+
+static uint32_t crc32(uint32_t crc, const void * data, size_t size) {
+
+	return crc32_func(crc, data, size);
+
+}
+
+static int is_header(const void *data, size_t size) {
+
+	const struct header * hdr = data;
 
 	if ( size < sizeof(struct header) )
 		return 0;
@@ -200,14 +698,211 @@ static int is_header(void *data, size_t size) {
 
 }
 
-static int64_t find_section(void *start, uint64_t count, int want_index, const char *want_name) {
+/*
+ * Position of the magic in data up to end, or end if there is none. Used
+ * where its first byte is frequent, a memchr() call per byte costs more than
+ * it skips there.
+ */
+static const uint8_t * find_magic_dense(const uint8_t * ptr, const uint8_t * end) {
+
+	uint32_t magic, want;
+
+	memcpy(&want, HDR_MAGIC, sizeof(want));
+
+	for ( ; ptr < end; ptr++ ) {
+		memcpy(&magic, ptr, sizeof(magic));
+		if ( magic == want )
+			return ptr;
+	}
+
+	return end;
+
+}
+
+/*
+ * Number of bytes before the next possible header in data, or count if there
+ * is none. Erased flash (0xFF) is skipped a word at a time and the magic is
+ * located with memchr(), which libc implements with SSE2/NEON.
+ */
+static uint64_t skip_to_header(const uint8_t * data, uint64_t count) {
+
+	const uint8_t * ptr = data;
+	const uint8_t * end = data + count;
+	const uint8_t * found;
+	uint64_t word;
+
+	if ( count < sizeof(struct header) )
+		return count;
+
+	/* Last position where a whole header still fits */
+	end -= sizeof(struct header) - 1;
+
+	/* Current byte is not a header start */
+	ptr++;
+
+	while ( ptr < end ) {
+
+		while ( (size_t)(end - ptr) >= sizeof(word) ) {
+			memcpy(&word, ptr, sizeof(word));
+			if ( word != UINT64_MAX )
+				break;
+			ptr += sizeof(word);
+		}
+
+		found = memchr(ptr, HDR_MAGIC[0], end - ptr);
+		if ( ! found )
+			break;
+
+		if ( memcmp(found, HDR_MAGIC, 4) == 0 )
+			return found - data;
+
+		/* A miss close to the last one, check the next bytes directly */
+		if ( found - ptr < 16 ) {
+			ptr = found + 64 < end ? found + 64 : end;
+			found = find_magic_dense(found + 1, ptr);
+			if ( found < ptr )
+				return found - data;
+		} else {
+			ptr = found + 1;
+		}
+
+	}
+
+	return count;
+
+}
+
+static int compare_section_names(const void * a, const void * b) {
+
+	const struct cal_section * sa = a;
+	const struct cal_section * sb = b;
+
+	return strcmp(sa->name, sb->name);
+
+}
+
+static int compare_sections(const void * a, const void * b) {
+
+	const struct cal_section * sa = a;
+	const struct cal_section * sb = b;
+	int ret;
+
+	ret = compare_section_names(a, b);
+	if ( ret != 0 )
+		return ret;
+
+	/* Keep image order for versions of the same section */
+	if ( sa->offset < sb->offset )
+		return -1;
+	if ( sa->offset > sb->offset )
+		return 1;
+	return 0;
+
+}
+
+/*
+ * Read len bytes at offset from a streamed MTD device. Bad erase blocks are
+ * never read and look like erased flash.
+ */
+static int stream_read(struct cal * cal, void * buf, size_t len, int64_t offset) {
+
+	uint8_t * ptr = buf;
+	size_t chunk;
+	ssize_t ret;
+#ifdef __linux__
+	loff_t block;
+#endif
+
+	while ( len > 0 ) {
+
+		chunk = cal->erasesize - offset % cal->erasesize;
+		if ( chunk > len )
+			chunk = len;
 
-	int64_t offset = 0, found_offset = -1;
-	uint8_t * data = start;
-	struct header *hdr;
-	char sectname[sizeof(hdr->name) + 1] = { 0, };
+#ifdef __linux__
+		block = offset - offset % cal->erasesize;
+		if ( ioctl(cal->fd, MEMGETBADBLOCK, &block) > 0 ) {
+			memset(ptr, 0xFF, chunk);
+			ret = chunk;
+		} else
+#endif
+		{
+			ret = pread(cal->fd, ptr, chunk, offset);
+			if ( ret < 0 && errno == EINTR )
+				continue;
+			if ( ret <= 0 )
+				return -1;
+		}
+
+		ptr += ret;
+		len -= ret;
+		offset += ret;
+
+	}
+
+	return 0;
+
+}
+
+/*
+ * Pointer to image data at offset, *avail is set to the number of bytes
+ * readable from it. In streaming mode this is at least one header unless
+ * the image ends sooner.
+ */
+static const uint8_t * image_at(struct cal * cal, int64_t offset, uint64_t * avail) {
+
+	int64_t start;
+	size_t len;
+
+	if ( cal->mem ) {
+		*avail = cal->size - offset;
+		return (const uint8_t *)cal->mem + offset;
+	}
+
+	if ( ! cal->window || offset < cal->window_start || offset + sizeof(struct header) > cal->window_start + cal->window_len ) {
+
+		if ( ! cal->window ) {
+			cal->window = mem_alloc(cal->erasesize + sizeof(struct header) - 1);
+			if ( ! cal->window )
+				return NULL;
+		}
+
+		/* One erase block plus enough to finish a header crossing its end */
+		start = offset - offset % cal->erasesize;
+		len = cal->erasesize + sizeof(struct header) - 1;
+		if ( len > (uint64_t)(cal->size - start) )
+			len = cal->size - start;
+
+		cal->window_len = 0;
+		if ( stream_read(cal, cal->window, len, start) != 0 )
+			return NULL;
+
+		cal->window_start = start;
+		cal->window_len = len;
+
+	}
+
+	*avail = cal->window_start + cal->window_len - offset;
+	return cal->window + (offset - cal->window_start);
+
+}
+
+/* Walk the whole image once and index the latest version of every section */
+static int scan_sections(struct cal * cal) {
+
+	int64_t offset = 0;
+	uint64_t count = cal->size;
+	uint64_t avail;
+	const uint8_t * data;
+	struct header hdr;
+	struct cal_section * sections = NULL;
+	struct cal_section * tmp;
+	unsigned int alloc = 0, num = 0, i, j;
 	uint32_t payload_len;
-	int previous_index = -1;
+	uint64_t skip;
+
+	cal->scans++;
+	cal->fingerprint = crc32(0, &cal->size, sizeof(cal->size));
 
 	while ( 1 ) {
 
@@ -215,80 +910,589 @@ static int64_t find_section(void *start, uint64_t count, int want_index, const c
 		if ( count < sizeof(struct header) )
 			break;
 
-		if ( ! is_header(data + offset, count) ) {
-			count--;
-			offset++;
+		data = image_at(cal, offset, &avail);
+		if ( ! data )
+			goto err;
+
+		if ( ! is_header(data, avail) ) {
+			skip = skip_to_header(data, avail);
+			/* Window ended, the last positions were not checked yet */
+			if ( skip == avail && avail < count )
+				skip = avail - sizeof(struct header) + 1;
+			count -= skip;
+			offset += skip;
 			continue;
 		}
 
-		hdr = (struct header *)(data + offset);
-		payload_len = hdr->length;
+		memcpy(&hdr, data, sizeof(hdr));
+		payload_len = hdr.length;
 
-		if ( count - sizeof(struct header) < payload_len )
-			return -1;
+		/*
+		 * Without hdrsum: a CRC over data followed by its own CRC no
+		 * longer depends on the data, every valid header would count
+		 * the same.
+		 */
+		cal->fingerprint = crc32(cal->fingerprint, &hdr, sizeof(hdr) - 4);
 
-		memcpy(sectname, hdr->name, sizeof(hdr->name));
+		if ( count - sizeof(struct header) < payload_len )
+			goto err;
 
-		if ( want_index == INDEX_LAST ) {
-			if ( (int)hdr->index <= previous_index )
-				goto next;
-		} else {
-			if ( want_index >= 0 && want_index != hdr->index )
-				goto next;
+		if ( num == alloc ) {
+			alloc = alloc ? alloc * 2 : 32;
+			tmp = mem_realloc(sections, alloc * sizeof(*sections));
+			if ( ! tmp )
+				goto err;
+			sections = tmp;
 		}
 
-		if ( want_name && strcmp(sectname, want_name) != 0 )
-			goto next;
-
-		/* Found it */
-		found_offset = offset;
-		if ( want_index == INDEX_LAST )
-			previous_index = hdr->index;
-		else
-			break;
+		memset(&sections[num], 0, sizeof(sections[num]));
+		memcpy(sections[num].name, hdr.name, sizeof(hdr.name));
+		sections[num].type = hdr.type;
+		sections[num].index = hdr.index;
+		sections[num].flags = hdr.flags;
+		sections[num].offset = offset;
+		sections[num].length = payload_len;
+		sections[num].crc = CRC_UNKNOWN;
+		sections[num].data = NULL;
+		num++;
 
-next:
 		count -= sizeof(struct header) + payload_len;
 		offset += sizeof(struct header) + payload_len;
+		cal->tail = offset;
+
+	}
 
+	/* Payloads are read on demand, the window is no longer needed */
+	mem_free(cal->window);
+	cal->window = NULL;
+	cal->window_len = 0;
+
+	if ( num )
+		qsort(sections, num, sizeof(*sections), compare_sections);
+
+	/* Collapse versions, the first one with the highest index wins */
+	for ( i = 0, j = 0; i < num; i++ ) {
+		if ( j > 0 && strcmp(sections[j-1].name, sections[i].name) == 0 ) {
+			if ( sections[i].index > sections[j-1].index )
+				sections[j-1] = sections[i];
+			continue;
+		}
+		sections[j++] = sections[i];
 	}
 
-	return found_offset;
+	cal->sections = sections;
+	cal->count = j;
+	return 0;
+
+err:
+	mem_free(sections);
+	return -1;
 
 }
 
-int cal_read_block(struct cal * cal, const char * name, void ** ptr, unsigned long * len, unsigned long flags) {
+static struct cal_section * find_section(struct cal * cal, const char * want_name) {
+
+	struct cal_section key;
+	struct cal_section * sect;
+
+	CAL_PROBE(find_start, want_name);
+
+	if ( ! cal->count || strlen(want_name) > CAL_MAX_NAME_LEN ) {
+		CAL_PROBE(find_done, want_name, -1, 0);
+		return NULL;
+	}
 
-	int64_t find_offset;
-	uint64_t filelen = cal->size;
-	uint8_t * data = cal->mem;
-	struct header * hdr;
-	void * offset;
+	strcpy(key.name, want_name);
+	sect = bsearch(&key, cal->sections, cal->count, sizeof(key), compare_section_names);
 
-	find_offset = find_section(data, filelen, INDEX_LAST, name);
-	if ( find_offset < 0 )
+	CAL_PROBE(find_done, want_name, sect ? sect->offset : -1, sect ? sect->length : 0);
+	return sect;
+
+}
+
+int cal_get_block_ref(struct cal * cal, const char * name, const void ** ptr, unsigned long * len, unsigned long flags) {
+
+	struct cal_section * sect;
+	const uint8_t * data;
+	const struct header * hdr;
+	const void * offset;
+	void * buf;
+	void * expected;
+	int crc;
+
+	sect = find_section(cal, name);
+	if ( ! sect )
 		return -1;
 
-	hdr = (struct header *)(data + find_offset);
+	if ( cal->mem ) {
+		data = (const uint8_t *)cal->mem + sect->offset;
+	} else {
+		data = __atomic_load_n(&sect->data, __ATOMIC_ACQUIRE);
+		if ( ! data ) {
+			buf = mem_alloc(sizeof(struct header) + sect->length);
+			if ( ! buf )
+				return -1;
+			if ( stream_read(cal, buf, sizeof(struct header) + sect->length, sect->offset) != 0 ) {
+				mem_free(buf);
+				return -1;
+			}
+			/* Another thread may have read it meanwhile, keep the first copy */
+			expected = NULL;
+			if ( __atomic_compare_exchange_n(&sect->data, &expected, buf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+				data = buf;
+			} else {
+				mem_free(buf);
+				data = expected;
+			}
+		}
+	}
+
+	hdr = (const struct header *)data;
 
 	if ( flags && hdr->flags != flags )
 		return -1;
 
-	if ( crc32(0, hdr, sizeof(*hdr) - 4) != hdr->hdrsum )
+	offset = data + sizeof(struct header);
+
+	/* Concurrent first lookups may both verify, they store the same result */
+	crc = __atomic_load_n(&sect->crc, __ATOMIC_RELAXED);
+	if ( crc == CRC_UNKNOWN ) {
+		CAL_PROBE(crc_start, sect->name, sect->offset, hdr->length);
+		if ( crc32(0, hdr, sizeof(*hdr) - 4) == hdr->hdrsum && crc32(0, offset, hdr->length) == hdr->datasum )
+			crc = CRC_GOOD;
+		else
+			crc = CRC_BAD;
+		__atomic_store_n(&sect->crc, crc, __ATOMIC_RELAXED);
+		CAL_PROBE(crc_done, sect->name, sect->offset, hdr->length, crc == CRC_GOOD ? 0 : -1);
+	}
+
+	if ( crc != CRC_GOOD )
 		return -1;
 
-	offset = data + find_offset + sizeof(struct header);
+	*ptr = offset;
+	*len = hdr->length;
+
+	return 0;
+
+}
+
+int cal_read_block(struct cal * cal, const char * name, void ** ptr, unsigned long * len, unsigned long flags) {
 
-	if ( crc32(0, offset, hdr->length) != hdr->datasum )
+	const void * data;
+	unsigned long length;
+
+	if ( cal_get_block_ref(cal, name, &data, &length, flags) != 0 )
 		return -1;
 
-	*ptr = malloc(hdr->length);
+	*ptr = mem_alloc(length);
 	if (!*ptr)
 		return -1;
 
-	memcpy(*ptr, offset, hdr->length);
-	*len = hdr->length;
+	memcpy(*ptr, data, length);
+	*len = length;
+
+	return 0;
+
+}
+
+unsigned long cal_fingerprint(struct cal * cal) {
+
+	return cal->fingerprint;
+
+}
+
+unsigned int cal_scan_count(struct cal * cal) {
+
+	return cal->scans;
+
+}
+
+/* Copy len bytes of the image at offset, whatever mode it is in */
+static int image_read(struct cal * cal, void * buf, size_t len, int64_t offset) {
+
+	if ( cal->mem ) {
+		memcpy(buf, (const uint8_t *)cal->mem + offset, len);
+		return 0;
+	}
+
+	return stream_read(cal, buf, len, offset);
+
+}
+
+/* Writable descriptor of the image, /dev/mtdNro falls back to /dev/mtdN */
+static int open_writable(struct cal * cal) {
+
+	size_t len = strlen(cal->file);
+	char * file;
+	int fd;
+
+	fd = open(cal->file, O_RDWR);
+	if ( fd >= 0 || errno != EACCES || len < 3 || strcmp(cal->file + len - 2, "ro") != 0 )
+		return fd;
+
+	file = strdup(cal->file);
+	if ( ! file )
+		return -1;
+	file[len - 2] = 0;
+	fd = open(file, O_RDWR);
+	free(file);
+	return fd;
+
+}
+
+static int pwrite_all(int fd, const void * buf, size_t len, int64_t offset) {
+
+	const uint8_t * ptr = buf;
+	ssize_t ret;
+
+	while ( len > 0 ) {
+		ret = pwrite(fd, ptr, len, offset);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return -1;
+		ptr += ret;
+		len -= ret;
+		offset += ret;
+	}
 
 	return 0;
 
 }
+
+static int pread_all(int fd, void * buf, size_t len, int64_t offset) {
+
+	uint8_t * ptr = buf;
+	ssize_t ret;
+
+	while ( len > 0 ) {
+		ret = pread(fd, ptr, len, offset);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return -1;
+		ptr += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+
+}
+
+/*
+ * Read back what was written through fd from the device, not from a private
+ * copy of the image, which only holds what was meant to be written
+ */
+static int read_back(struct cal * cal, int fd, void * buf, size_t len, int64_t offset) {
+
+	if ( cal->fd >= 0 )
+		return stream_read(cal, buf, len, offset);
+
+	return pread_all(fd, buf, len, offset);
+
+}
+
+int cal_write_block(struct cal * cal, const char * name, const void * ptr, unsigned long len, unsigned long flags) {
+
+	struct cal_section * sect;
+	struct cal_section * tmp;
+	struct header hdr;
+	uint8_t * buf = NULL;
+	uint8_t * check = NULL;
+	int64_t start;
+	size_t total, size, i;
+	int fd = -1;
+	int ret = -1;
+#ifdef __linux__
+	loff_t block;
+#endif
+
+	if ( strlen(name) > CAL_MAX_NAME_LEN || len > UINT32_MAX || flags > UINT16_MAX )
+		return -1;
+
+	sect = find_section(cal, name);
+	if ( sect && sect->index == UINT8_MAX )
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HDR_MAGIC, sizeof(hdr.magic));
+	hdr.type = sect ? sect->type : 0;
+	hdr.index = sect ? sect->index + 1 : 0;
+	hdr.flags = flags;
+	strncpy(hdr.name, name, sizeof(hdr.name));
+	hdr.length = len;
+	hdr.datasum = crc32(0, ptr, len);
+	hdr.hdrsum = crc32(0, &hdr, sizeof(hdr) - 4);
+
+	/* Whole write units only, so no page is programmed twice */
+	start = (cal->tail + cal->writesize - 1) / cal->writesize * cal->writesize;
+	total = sizeof(hdr) + len;
+	size = (total + cal->writesize - 1) / cal->writesize * cal->writesize;
+	if ( start + (int64_t)size > cal->size )
+		return -1;
+
+#ifdef __linux__
+	/* Bad blocks read back as erased, but cannot be written */
+	if ( cal->fd >= 0 ) {
+		for ( block = start - start % cal->erasesize; block < start + (int64_t)size; block += cal->erasesize )
+			if ( ioctl(cal->fd, MEMGETBADBLOCK, &block) > 0 )
+				return -1;
+	}
+#endif
+
+	buf = malloc(size);
+	check = malloc(size);
+	if ( ! buf || ! check )
+		goto out;
+
+	/* Flash can only be written where it is erased */
+	if ( image_read(cal, buf, size, start) != 0 )
+		goto out;
+	for ( i = 0; i < size; i++ )
+		if ( buf[i] != 0xFF )
+			goto out;
+
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), ptr, len);
+
+	fd = open_writable(cal);
+	if ( fd < 0 )
+		goto out;
+
+	if ( pwrite_all(fd, buf, size, start) != 0 || fsync(fd) != 0 )
+		goto out;
+
+	if ( read_back(cal, fd, check, size, start) != 0 || memcmp(buf, check, size) != 0 )
+		goto out;
+
+	/* A shared mapping already sees the new data, a private copy does not */
+	if ( cal->mem && ! cal->mapped )
+		memcpy((uint8_t *)cal->mem + start, buf, size);
+
+	if ( sect ) {
+		mem_free(sect->data);
+		sect->data = NULL;
+	} else {
+		tmp = mem_realloc(cal->sections, (cal->count + 1) * sizeof(*tmp));
+		if ( ! tmp )
+			goto out;
+		cal->sections = tmp;
+		sect = &cal->sections[cal->count++];
+		memset(sect, 0, sizeof(*sect));
+		strcpy(sect->name, name);
+	}
+
+	sect->type = hdr.type;
+	sect->index = hdr.index;
+	sect->flags = hdr.flags;
+	sect->offset = start;
+	sect->length = hdr.length;
+	sect->crc = CRC_UNKNOWN;
+
+	qsort(cal->sections, cal->count, sizeof(*cal->sections), compare_section_names);
+
+	cal->tail = start + total;
+	cal->fingerprint = crc32(cal->fingerprint, &hdr, sizeof(hdr) - 4);
+	ret = 0;
+
+out:
+	if ( fd >= 0 )
+		close(fd);
+	free(check);
+	free(buf);
+	return ret;
+
+}
+
+static int compare_offsets(const void * a, const void * b) {
+
+	const struct cal_section * sa = a;
+	const struct cal_section * sb = b;
+
+	if ( sa->offset < sb->offset )
+		return -1;
+	return sa->offset > sb->offset;
+
+}
+
+/* Index an in-memory image into out, *ns is set to the time the scan took */
+static int scan_buffer(struct cal * cal, uint8_t * buf, struct cal * out, unsigned long * ns) {
+
+	struct timespec start, end;
+	int ret;
+
+	memset(out, 0, sizeof(*out));
+	out->size = cal->size;
+	out->mem = buf;
+	out->fd = -1;
+	out->erasesize = cal->erasesize;
+	out->writesize = cal->writesize;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = scan_sections(out);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*ns = (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec;
+	return ret;
+
+}
+
+#ifdef __linux__
+static int is_bad_block(struct cal * cal, int64_t offset) {
+
+	loff_t block = offset - offset % cal->erasesize;
+
+	return cal->fd >= 0 && ioctl(cal->fd, MEMGETBADBLOCK, &block) > 0;
+
+}
+#else
+#define is_bad_block(cal, offset) 0
+#endif
+
+/* First offset from pos where len bytes fit without touching a bad block */
+static int64_t next_good(struct cal * cal, int64_t pos, size_t len) {
+
+	int64_t block;
+
+	for ( block = pos - pos % cal->erasesize; block < pos + (int64_t)len && block < cal->size; block += cal->erasesize ) {
+		if ( is_bad_block(cal, block) )
+			pos = block + cal->erasesize;
+	}
+
+	return pos;
+
+}
+
+int cal_compact(struct cal * cal, struct cal_compact_stats * stats) {
+
+	struct cal_section * order = NULL;
+	struct cal scratch;
+	uint8_t * old = NULL;
+	uint8_t * new = NULL;
+	uint8_t * check = NULL;
+	int64_t pos = 0;
+	int64_t block;
+	size_t len, used;
+	unsigned int i;
+	int fd = -1;
+	int ret = -1;
+#ifdef __linux__
+	struct erase_info_user erase;
+#endif
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&scratch, 0, sizeof(scratch));
+
+	old = malloc(cal->size);
+	new = malloc(cal->size);
+	check = malloc(cal->size);
+	order = malloc((cal->count ? cal->count : 1) * sizeof(*order));
+	if ( ! old || ! new || ! check || ! order )
+		goto out;
+
+	if ( image_read(cal, old, cal->size, 0) != 0 )
+		goto out;
+
+	if ( scan_buffer(cal, old, &scratch, &stats->scan_ns_before) != 0 )
+		goto out;
+	mem_free(scratch.sections);
+	scratch.sections = NULL;
+
+	/* Latest versions only, in image order, packed from the start */
+	memcpy(order, cal->sections, cal->count * sizeof(*order));
+	qsort(order, cal->count, sizeof(*order), compare_offsets);
+
+	memset(new, 0xFF, cal->size);
+	for ( i = 0; i < cal->count; i++ ) {
+		len = sizeof(struct header) + order[i].length;
+		pos = next_good(cal, pos, len);
+		if ( pos + (int64_t)len > cal->size )
+			goto out;
+		memcpy(new + pos, old + order[i].offset, len);
+		pos += len;
+	}
+
+	/* The new image must index to exactly the same sections */
+	if ( scan_buffer(cal, new, &scratch, &stats->scan_ns_after) != 0 || scratch.count != cal->count )
+		goto out;
+	for ( i = 0; i < cal->count; i++ ) {
+		if ( strcmp(scratch.sections[i].name, cal->sections[i].name) != 0 ||
+		     scratch.sections[i].index != cal->sections[i].index ||
+		     scratch.sections[i].flags != cal->sections[i].flags ||
+		     scratch.sections[i].length != cal->sections[i].length ||
+		     memcmp(new + scratch.sections[i].offset, old + cal->sections[i].offset, sizeof(struct header) + cal->sections[i].length) != 0 )
+			goto out;
+	}
+
+	stats->bytes_before = cal->tail;
+	stats->bytes_after = scratch.tail;
+
+	fd = open_writable(cal);
+	if ( fd < 0 )
+		goto out;
+
+	for ( block = 0; block < cal->size; block += cal->erasesize ) {
+
+		len = cal->erasesize;
+		if ( block + (int64_t)len > cal->size )
+			len = cal->size - block;
+
+		if ( memcmp(old + block, new + block, len) == 0 || is_bad_block(cal, block) )
+			continue;
+
+		used = len;
+#ifdef __linux__
+		if ( cal->fd >= 0 ) {
+			erase.start = block;
+			erase.length = cal->erasesize;
+			if ( ioctl(fd, MEMERASE, &erase) != 0 )
+				goto out;
+			stats->blocks_erased++;
+			/* Erased pages stay unprogrammed so later appends can use them */
+			while ( used > 0 && new[block + used - 1] == 0xFF )
+				used--;
+			used = (used + cal->writesize - 1) / cal->writesize * cal->writesize;
+		}
+#endif
+
+		/* A block that becomes empty is only erased */
+		if ( used ) {
+			if ( pwrite_all(fd, new + block, used, block) != 0 )
+				goto out;
+			stats->blocks_written++;
+		}
+
+	}
+
+	if ( fsync(fd) != 0 )
+		goto out;
+
+	if ( read_back(cal, fd, check, cal->size, 0) != 0 || memcmp(check, new, cal->size) != 0 )
+		goto out;
+
+	if ( cal->mem && ! cal->mapped )
+		memcpy(cal->mem, new, cal->size);
+
+	for ( i = 0; i < cal->count; i++ )
+		mem_free(cal->sections[i].data);
+	mem_free(cal->sections);
+	cal->sections = scratch.sections;
+	cal->count = scratch.count;
+	cal->tail = scratch.tail;
+	cal->fingerprint = scratch.fingerprint;
+	cal->scans++;
+	scratch.sections = NULL;
+	ret = 0;
+
+out:
+	if ( fd >= 0 )
+		close(fd);
+	mem_free(scratch.sections);
+	free(order);
+	free(check);
+	free(new);
+	free(old);
+	return ret;
+
+}
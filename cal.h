@@ -24,6 +24,12 @@
 #define CAL_FLAG_USER		0x0001
 #define CAL_FLAG_WRITE_ONCE	0x0002
 
+/*
+ * A handle does not change after cal_init_file() returns, so any number of
+ * threads may look up blocks on it concurrently. Only cal_write_block(),
+ * cal_compact() and cal_finish() must not run alongside other calls on the
+ * same handle.
+ */
 struct cal;
 
 int cal_init(struct cal ** cal_out);
@@ -31,4 +37,48 @@ int cal_init_file(const char * file, struct cal ** cal_out);
 void cal_finish(struct cal * cal);
 int cal_read_block(struct cal * cal, const char * name, void ** ptr, unsigned long * len, unsigned long flags);
 
+/* Like cal_read_block() but without a copy, *ptr is valid until cal_finish() */
+int cal_get_block_ref(struct cal * cal, const char * name, const void ** ptr, unsigned long * len, unsigned long flags);
+
+/*
+ * Append a new version of the section to the erased tail of the image, it
+ * gets the next index and replaces the current one for lookups. Must not run
+ * alongside other calls on the same handle, and references to the replaced
+ * version from cal_get_block_ref() are no longer valid afterwards.
+ */
+int cal_write_block(struct cal * cal, const char * name, const void * ptr, unsigned long len, unsigned long flags);
+
+struct cal_compact_stats {
+	unsigned long bytes_before;	/* End of the last section before */
+	unsigned long bytes_after;	/* and after compaction */
+	unsigned int blocks_erased;
+	unsigned int blocks_written;
+	unsigned long scan_ns_before;	/* Time to index the image before */
+	unsigned long scan_ns_after;	/* and after compaction */
+};
+
+/*
+ * Rewrite the image with only the latest version of every section, packed at
+ * the start. Only erase blocks whose content changes are erased and written,
+ * and the new layout is verified before and after writing. An interrupted
+ * compaction can lose sections. Must not run alongside other calls on the
+ * same handle, references from cal_get_block_ref() are invalid afterwards.
+ */
+int cal_compact(struct cal * cal, struct cal_compact_stats * stats);
+
+/* Cheap identity of the image content, changes whenever any header does */
+unsigned long cal_fingerprint(struct cal * cal);
+
+/* Full scans of the image since cal_init_file(), lookups never add one */
+unsigned int cal_scan_count(struct cal * cal);
+
+#ifdef WITH_STATIC_ARENA
+/*
+ * Static builds take handle memory from a fixed arena instead of the heap,
+ * blocks from cal_read_block() are released with cal_free() there.
+ */
+void * cal_alloc(unsigned long size);
+void cal_free(void * ptr);
+#endif
+
 #endif
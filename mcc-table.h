@@ -0,0 +1,240 @@
+/* Generated by mcc-table.sh, do not edit */
+
+#define MCC_MIN 200
+#define MCC_MAX 799
+
+struct mcc_domain {
+	char regdomain[3];
+	unsigned char fcc;
+};
+
+static const struct mcc_domain mcc_domains[MCC_MAX - MCC_MIN + 1] = {
+	[202 - MCC_MIN] = { "GR", 0 },
+	[204 - MCC_MIN] = { "NL", 0 },
+	[206 - MCC_MIN] = { "BE", 0 },
+	[208 - MCC_MIN] = { "FR", 0 },
+	[212 - MCC_MIN] = { "MC", 0 },
+	[213 - MCC_MIN] = { "AD", 0 },
+	[214 - MCC_MIN] = { "ES", 0 },
+	[216 - MCC_MIN] = { "HU", 0 },
+	[218 - MCC_MIN] = { "BA", 0 },
+	[219 - MCC_MIN] = { "HR", 0 },
+	[220 - MCC_MIN] = { "RS", 0 },
+	[222 - MCC_MIN] = { "IT", 0 },
+	[225 - MCC_MIN] = { "VA", 0 },
+	[226 - MCC_MIN] = { "RO", 0 },
+	[228 - MCC_MIN] = { "CH", 0 },
+	[230 - MCC_MIN] = { "CZ", 0 },
+	[231 - MCC_MIN] = { "SK", 0 },
+	[232 - MCC_MIN] = { "AT", 0 },
+	[234 - MCC_MIN] = { "GB", 0 },
+	[235 - MCC_MIN] = { "GB", 0 },
+	[238 - MCC_MIN] = { "DK", 0 },
+	[240 - MCC_MIN] = { "SE", 0 },
+	[242 - MCC_MIN] = { "NO", 0 },
+	[244 - MCC_MIN] = { "FI", 0 },
+	[246 - MCC_MIN] = { "LT", 0 },
+	[247 - MCC_MIN] = { "LV", 0 },
+	[248 - MCC_MIN] = { "EE", 0 },
+	[250 - MCC_MIN] = { "RU", 0 },
+	[255 - MCC_MIN] = { "UA", 0 },
+	[257 - MCC_MIN] = { "BY", 0 },
+	[259 - MCC_MIN] = { "MD", 0 },
+	[260 - MCC_MIN] = { "PL", 0 },
+	[262 - MCC_MIN] = { "DE", 0 },
+	[266 - MCC_MIN] = { "GI", 0 },
+	[268 - MCC_MIN] = { "PT", 0 },
+	[270 - MCC_MIN] = { "LU", 0 },
+	[272 - MCC_MIN] = { "IE", 0 },
+	[274 - MCC_MIN] = { "IS", 0 },
+	[276 - MCC_MIN] = { "AL", 0 },
+	[278 - MCC_MIN] = { "MT", 0 },
+	[280 - MCC_MIN] = { "CY", 0 },
+	[282 - MCC_MIN] = { "GE", 0 },
+	[283 - MCC_MIN] = { "AM", 0 },
+	[284 - MCC_MIN] = { "BG", 0 },
+	[286 - MCC_MIN] = { "TR", 0 },
+	[288 - MCC_MIN] = { "FO", 0 },
+	[290 - MCC_MIN] = { "GL", 0 },
+	[292 - MCC_MIN] = { "SM", 0 },
+	[293 - MCC_MIN] = { "SI", 0 },
+	[294 - MCC_MIN] = { "MK", 0 },
+	[295 - MCC_MIN] = { "LI", 0 },
+	[297 - MCC_MIN] = { "ME", 0 },
+	[302 - MCC_MIN] = { "CA", 1 },
+	[308 - MCC_MIN] = { "FR", 0 },
+	[310 - MCC_MIN] = { "US", 1 },
+	[311 - MCC_MIN] = { "US", 1 },
+	[312 - MCC_MIN] = { "US", 1 },
+	[313 - MCC_MIN] = { "US", 1 },
+	[314 - MCC_MIN] = { "US", 1 },
+	[315 - MCC_MIN] = { "US", 1 },
+	[316 - MCC_MIN] = { "US", 1 },
+	[330 - MCC_MIN] = { "PR", 0 },
+	[332 - MCC_MIN] = { "US", 1 },
+	[334 - MCC_MIN] = { "MX", 1 },
+	[338 - MCC_MIN] = { "JM", 0 },
+	[340 - MCC_MIN] = { "FR", 0 },
+	[342 - MCC_MIN] = { "BB", 0 },
+	[344 - MCC_MIN] = { "AG", 0 },
+	[346 - MCC_MIN] = { "KY", 0 },
+	[348 - MCC_MIN] = { "VG", 0 },
+	[350 - MCC_MIN] = { "BM", 0 },
+	[352 - MCC_MIN] = { "GD", 0 },
+	[354 - MCC_MIN] = { "MS", 0 },
+	[356 - MCC_MIN] = { "KN", 0 },
+	[358 - MCC_MIN] = { "LC", 0 },
+	[360 - MCC_MIN] = { "VC", 0 },
+	[362 - MCC_MIN] = { "NL", 0 },
+	[363 - MCC_MIN] = { "AW", 0 },
+	[364 - MCC_MIN] = { "BS", 0 },
+	[365 - MCC_MIN] = { "AI", 0 },
+	[366 - MCC_MIN] = { "DM", 0 },
+	[368 - MCC_MIN] = { "CU", 0 },
+	[370 - MCC_MIN] = { "DO", 0 },
+	[372 - MCC_MIN] = { "HT", 0 },
+	[374 - MCC_MIN] = { "TT", 0 },
+	[376 - MCC_MIN] = { "TC", 0 },
+	[400 - MCC_MIN] = { "AZ", 0 },
+	[401 - MCC_MIN] = { "KZ", 0 },
+	[402 - MCC_MIN] = { "BT", 0 },
+	[404 - MCC_MIN] = { "IN", 0 },
+	[405 - MCC_MIN] = { "IN", 0 },
+	[410 - MCC_MIN] = { "PK", 0 },
+	[412 - MCC_MIN] = { "AF", 0 },
+	[413 - MCC_MIN] = { "LK", 0 },
+	[414 - MCC_MIN] = { "MM", 0 },
+	[415 - MCC_MIN] = { "LB", 0 },
+	[416 - MCC_MIN] = { "JO", 0 },
+	[417 - MCC_MIN] = { "SY", 0 },
+	[418 - MCC_MIN] = { "IQ", 0 },
+	[419 - MCC_MIN] = { "KW", 0 },
+	[420 - MCC_MIN] = { "SA", 0 },
+	[421 - MCC_MIN] = { "YE", 0 },
+	[422 - MCC_MIN] = { "OM", 0 },
+	[424 - MCC_MIN] = { "AE", 0 },
+	[425 - MCC_MIN] = { "IL", 0 },
+	[426 - MCC_MIN] = { "BH", 0 },
+	[427 - MCC_MIN] = { "QA", 0 },
+	[428 - MCC_MIN] = { "MN", 0 },
+	[429 - MCC_MIN] = { "NP", 0 },
+	[430 - MCC_MIN] = { "AE", 0 },
+	[431 - MCC_MIN] = { "AE", 0 },
+	[432 - MCC_MIN] = { "IR", 0 },
+	[434 - MCC_MIN] = { "UZ", 0 },
+	[436 - MCC_MIN] = { "TJ", 0 },
+	[437 - MCC_MIN] = { "KG", 0 },
+	[438 - MCC_MIN] = { "TM", 0 },
+	[440 - MCC_MIN] = { "JP", 0 },
+	[441 - MCC_MIN] = { "JP", 0 },
+	[450 - MCC_MIN] = { "KR", 0 },
+	[452 - MCC_MIN] = { "VN", 0 },
+	[455 - MCC_MIN] = { "MO", 0 },
+	[456 - MCC_MIN] = { "KH", 0 },
+	[457 - MCC_MIN] = { "LA", 0 },
+	[460 - MCC_MIN] = { "CN", 0 },
+	[466 - MCC_MIN] = { "TW", 1 },
+	[467 - MCC_MIN] = { "KP", 0 },
+	[470 - MCC_MIN] = { "BD", 0 },
+	[472 - MCC_MIN] = { "MV", 0 },
+	[502 - MCC_MIN] = { "MY", 0 },
+	[505 - MCC_MIN] = { "AU", 0 },
+	[510 - MCC_MIN] = { "ID", 0 },
+	[514 - MCC_MIN] = { "TL", 0 },
+	[515 - MCC_MIN] = { "PH", 0 },
+	[520 - MCC_MIN] = { "TH", 0 },
+	[525 - MCC_MIN] = { "SG", 0 },
+	[528 - MCC_MIN] = { "BN", 0 },
+	[530 - MCC_MIN] = { "NZ", 0 },
+	[535 - MCC_MIN] = { "GU", 0 },
+	[536 - MCC_MIN] = { "NR", 0 },
+	[537 - MCC_MIN] = { "PG", 0 },
+	[539 - MCC_MIN] = { "TO", 0 },
+	[540 - MCC_MIN] = { "SB", 0 },
+	[541 - MCC_MIN] = { "VU", 0 },
+	[542 - MCC_MIN] = { "FJ", 0 },
+	[543 - MCC_MIN] = { "WF", 0 },
+	[544 - MCC_MIN] = { "WS", 0 },
+	[545 - MCC_MIN] = { "KI", 0 },
+	[546 - MCC_MIN] = { "FR", 0 },
+	[547 - MCC_MIN] = { "PF", 0 },
+	[548 - MCC_MIN] = { "CK", 0 },
+	[549 - MCC_MIN] = { "WS", 0 },
+	[550 - MCC_MIN] = { "FM", 0 },
+	[551 - MCC_MIN] = { "MH", 0 },
+	[552 - MCC_MIN] = { "PW", 0 },
+	[602 - MCC_MIN] = { "EG", 0 },
+	[603 - MCC_MIN] = { "DZ", 0 },
+	[604 - MCC_MIN] = { "MA", 0 },
+	[605 - MCC_MIN] = { "TN", 0 },
+	[606 - MCC_MIN] = { "LY", 0 },
+	[607 - MCC_MIN] = { "GM", 0 },
+	[608 - MCC_MIN] = { "SN", 0 },
+	[609 - MCC_MIN] = { "MR", 0 },
+	[610 - MCC_MIN] = { "ML", 0 },
+	[611 - MCC_MIN] = { "GN", 0 },
+	[612 - MCC_MIN] = { "CI", 0 },
+	[613 - MCC_MIN] = { "BF", 0 },
+	[614 - MCC_MIN] = { "NE", 0 },
+	[615 - MCC_MIN] = { "TG", 0 },
+	[616 - MCC_MIN] = { "BJ", 0 },
+	[617 - MCC_MIN] = { "MU", 0 },
+	[618 - MCC_MIN] = { "LR", 0 },
+	[619 - MCC_MIN] = { "SL", 0 },
+	[620 - MCC_MIN] = { "GH", 0 },
+	[621 - MCC_MIN] = { "NG", 0 },
+	[622 - MCC_MIN] = { "TD", 0 },
+	[623 - MCC_MIN] = { "CF", 0 },
+	[624 - MCC_MIN] = { "CM", 0 },
+	[625 - MCC_MIN] = { "CV", 0 },
+	[626 - MCC_MIN] = { "ST", 0 },
+	[627 - MCC_MIN] = { "GQ", 0 },
+	[628 - MCC_MIN] = { "GA", 0 },
+	[629 - MCC_MIN] = { "CG", 0 },
+	[630 - MCC_MIN] = { "CD", 0 },
+	[631 - MCC_MIN] = { "AO", 0 },
+	[632 - MCC_MIN] = { "GW", 0 },
+	[633 - MCC_MIN] = { "SC", 0 },
+	[634 - MCC_MIN] = { "SD", 0 },
+	[635 - MCC_MIN] = { "RW", 0 },
+	[636 - MCC_MIN] = { "ET", 0 },
+	[637 - MCC_MIN] = { "SO", 0 },
+	[638 - MCC_MIN] = { "DJ", 0 },
+	[639 - MCC_MIN] = { "KE", 0 },
+	[640 - MCC_MIN] = { "TZ", 0 },
+	[641 - MCC_MIN] = { "UG", 0 },
+	[642 - MCC_MIN] = { "BI", 0 },
+	[643 - MCC_MIN] = { "MZ", 0 },
+	[645 - MCC_MIN] = { "ZM", 0 },
+	[646 - MCC_MIN] = { "MG", 0 },
+	[647 - MCC_MIN] = { "FR", 0 },
+	[648 - MCC_MIN] = { "ZW", 0 },
+	[649 - MCC_MIN] = { "NA", 0 },
+	[650 - MCC_MIN] = { "MW", 0 },
+	[651 - MCC_MIN] = { "LS", 0 },
+	[652 - MCC_MIN] = { "BW", 0 },
+	[653 - MCC_MIN] = { "SZ", 0 },
+	[654 - MCC_MIN] = { "KM", 0 },
+	[655 - MCC_MIN] = { "ZA", 0 },
+	[657 - MCC_MIN] = { "ER", 0 },
+	[702 - MCC_MIN] = { "BZ", 0 },
+	[704 - MCC_MIN] = { "GT", 0 },
+	[706 - MCC_MIN] = { "SV", 0 },
+	[708 - MCC_MIN] = { "HN", 0 },
+	[710 - MCC_MIN] = { "NI", 0 },
+	[712 - MCC_MIN] = { "CR", 0 },
+	[714 - MCC_MIN] = { "PA", 0 },
+	[716 - MCC_MIN] = { "PE", 0 },
+	[722 - MCC_MIN] = { "AR", 1 },
+	[724 - MCC_MIN] = { "BR", 1 },
+	[730 - MCC_MIN] = { "CL", 0 },
+	[732 - MCC_MIN] = { "CO", 1 },
+	[734 - MCC_MIN] = { "VE", 0 },
+	[736 - MCC_MIN] = { "BO", 0 },
+	[738 - MCC_MIN] = { "GY", 0 },
+	[740 - MCC_MIN] = { "EC", 0 },
+	[742 - MCC_MIN] = { "FR", 0 },
+	[744 - MCC_MIN] = { "PY", 0 },
+	[746 - MCC_MIN] = { "SR", 0 },
+	[748 - MCC_MIN] = { "UY", 0 },
+};
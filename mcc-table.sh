@@ -0,0 +1,99 @@
+#!/bin/sh
+# Generate mcc-table.h, the MCC -> regulatory domain table used by wl1251-cal
+#
+# Usage: mcc-table.sh mcc_mapping wdb > mcc-table.h
+#
+# mcc_mapping is /usr/share/operator-wizard/mcc_mapping ("MCC \tCountry" lines)
+# and wdb is /usr/share/clock/wdb ('|' separated, alpha2 in field 3 and country
+# name in field 4). Countries are joined by name like the old sed/join pipeline.
+
+# MCCs which join to more than one country, resolved to the country that
+# owns the MCC
+DUPLICATES="460=CN 550=FM"
+
+# MCCs for which the FCC calibration is used, these get the US regdomain
+FCC="302 310 311 312 313 314 315 316 332 334 466 722 724 732"
+
+if [ $# -ne 2 ]; then
+	echo "Usage: $0 mcc_mapping wdb" >&2
+	exit 1
+fi
+
+exec awk -v duplicates="$DUPLICATES" -v fcc="$FCC" '
+BEGIN {
+	n = split(duplicates, list, " ")
+	for (i = 1; i <= n; i++) {
+		split(list[i], pair, "=")
+		resolved[pair[1]] = pair[2]
+	}
+	n = split(fcc, list, " ")
+	for (i = 1; i <= n; i++)
+		fcccode[list[i]] = 1
+}
+
+FILENAME == ARGV[1] {
+	if (!match($0, /^[0-9]+[ \t]+/))
+		next
+	mcc = $0
+	sub(/[ \t].*/, "", mcc)
+	name = substr($0, RLENGTH + 1)
+	mccs[name] = mccs[name] " " mcc
+	next
+}
+
+{
+	split($0, field, "|")
+	if (!(field[4] in mccs) || length(field[3]) != 2)
+		next
+	n = split(mccs[field[4]], list, " ")
+	for (i = 1; i <= n; i++) {
+		mcc = list[i] + 0
+		if (mcc < 200 || mcc > 799) {
+			printf("mcc-table.sh: MCC %d out of range\n", mcc) > "/dev/stderr"
+			failed = 1
+			continue
+		}
+		if (!(mcc in alpha2))
+			alpha2[mcc] = field[3]
+		else if (index(alpha2[mcc], field[3]) == 0)
+			alpha2[mcc] = alpha2[mcc] "," field[3]
+	}
+}
+
+END {
+	for (mcc in alpha2) {
+		if (length(alpha2[mcc]) == 2)
+			continue
+		if (!(mcc in resolved) || index(alpha2[mcc], resolved[mcc]) == 0) {
+			printf("mcc-table.sh: MCC %d is ambiguous (%s), add it to DUPLICATES\n", mcc, alpha2[mcc]) > "/dev/stderr"
+			failed = 1
+			continue
+		}
+		alpha2[mcc] = resolved[mcc]
+	}
+	for (mcc in fcccode) {
+		if (!(mcc in alpha2)) {
+			printf("mcc-table.sh: FCC MCC %d has no country\n", mcc) > "/dev/stderr"
+			failed = 1
+		}
+	}
+	if (failed)
+		exit 1
+
+	print "/* Generated by mcc-table.sh, do not edit */"
+	print ""
+	print "#define MCC_MIN 200"
+	print "#define MCC_MAX 799"
+	print ""
+	print "struct mcc_domain {"
+	print "\tchar regdomain[3];"
+	print "\tunsigned char fcc;"
+	print "};"
+	print ""
+	print "static const struct mcc_domain mcc_domains[MCC_MAX - MCC_MIN + 1] = {"
+	for (mcc = 200; mcc <= 799; mcc++)
+		if (mcc in alpha2)
+			printf("\t[%d - MCC_MIN] = { \"%s\", %d },\n", mcc, alpha2[mcc], (mcc in fcccode) ? 1 : 0)
+	print "};"
+}
+' "$1" "$2"
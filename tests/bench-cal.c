@@ -0,0 +1,273 @@
+/*
+ * Lookup path of cal.c on the images given as arguments: cal_init_file(), a
+ * find_section() of every section, the first verified read of every section
+ * and a cached cal_read_block(), one JSON object per line. Times are medians.
+ *
+ * With --threads[=N], 1, 2, 4 ... N reader threads share one handle per image
+ * instead, alternating cal_get_block_ref() and cal_read_block() over all
+ * sections for READ_MS each, and the lookups per second are printed for
+ * every thread count. N defaults to the number of online CPUs.
+ */
+
+#include <time.h>
+
+#include "../cal.c"
+
+#define RUNS 101
+#define READ_MS 200
+
+static double now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+
+}
+
+static int compare_doubles(const void * a, const void * b) {
+
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+
+}
+
+static double median(double * samples, int count) {
+
+	qsort(samples, count, sizeof(*samples), compare_doubles);
+	return samples[count / 2];
+
+}
+
+static int bench_image(const char * file) {
+
+	static double samples[RUNS];
+	volatile uintptr_t sink = 0;
+	const char * label;
+	struct cal * cal;
+	const void * ref;
+	void * ptr;
+	unsigned long len;
+	unsigned long bytes = 0;
+	unsigned int i, count, bad = 0;
+	double start;
+	int run;
+
+	label = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
+
+	for ( run = 0; run < RUNS; run++ ) {
+		start = now_ns();
+		if ( cal_init_file(file, &cal) < 0 ) {
+			printf("{\"bench\":\"cal_init_file\",\"image\":\"%s\",\"ok\":false}\n", label);
+			return 0;
+		}
+		samples[run] = now_ns() - start;
+		count = cal->count;
+		cal_finish(cal);
+	}
+	printf("{\"bench\":\"cal_init_file\",\"image\":\"%s\",\"ok\":true,\"sections\":%u,\"ns\":%.0f}\n", label, count, median(samples, RUNS));
+
+	if ( cal_init_file(file, &cal) < 0 )
+		return -1;
+
+	for ( run = 0; run < RUNS; run++ ) {
+		start = now_ns();
+		for ( i = 0; i < cal->count; i++ )
+			sink += (uintptr_t)find_section(cal, cal->sections[i].name);
+		samples[run] = (now_ns() - start) / cal->count;
+	}
+	printf("{\"bench\":\"find_section\",\"image\":\"%s\",\"sections\":%u,\"ns_per_call\":%.1f}\n", label, cal->count, median(samples, RUNS));
+
+	cal_finish(cal);
+
+	/* The first read of a section checks its CRC, so it needs a fresh handle */
+	for ( run = 0; run < RUNS; run++ ) {
+		if ( cal_init_file(file, &cal) < 0 )
+			return -1;
+		bytes = 0;
+		bad = 0;
+		start = now_ns();
+		for ( i = 0; i < cal->count; i++ ) {
+			if ( cal_get_block_ref(cal, cal->sections[i].name, &ref, &len, 0) < 0 )
+				bad++;
+			else
+				bytes += len;
+		}
+		samples[run] = now_ns() - start;
+		cal_finish(cal);
+	}
+	printf("{\"bench\":\"first_read\",\"image\":\"%s\",\"sections\":%u,\"bad\":%u,\"bytes\":%lu,\"ns\":%.0f}\n", label, count, bad, bytes, median(samples, RUNS));
+
+	if ( cal_init_file(file, &cal) < 0 )
+		return -1;
+
+	for ( run = 0; run < RUNS; run++ ) {
+		start = now_ns();
+		for ( i = 0; i < cal->count; i++ ) {
+			if ( cal_read_block(cal, cal->sections[i].name, &ptr, &len, 0) == 0 ) {
+				sink += len;
+				free(ptr);
+			}
+		}
+		samples[run] = (now_ns() - start) / cal->count;
+	}
+	printf("{\"bench\":\"cal_read_block\",\"image\":\"%s\",\"sections\":%u,\"ns_per_call\":%.1f}\n", label, cal->count, median(samples, RUNS));
+
+	cal_finish(cal);
+	return 0;
+
+}
+
+struct reader {
+	pthread_t thread;
+	unsigned int id;
+	struct cal * cal;
+	pthread_barrier_t * start;
+	unsigned long lookups;
+};
+
+static int stop;
+
+static void * reader_run(void * arg) {
+
+	struct reader * reader = arg;
+	struct cal * cal = reader->cal;
+	const char * name;
+	const void * ref;
+	void * ptr;
+	unsigned long len;
+	unsigned int i;
+
+	pthread_barrier_wait(reader->start);
+
+	/* Each thread starts at another section so they do not run in lockstep */
+	while ( ! __atomic_load_n(&stop, __ATOMIC_RELAXED) ) {
+		for ( i = 0; i < cal->count; i++ ) {
+			name = cal->sections[(i + reader->id * 7) % cal->count].name;
+			if ( i % 2 ) {
+				if ( cal_read_block(cal, name, &ptr, &len, 0) == 0 )
+					free(ptr);
+			} else {
+				cal_get_block_ref(cal, name, &ref, &len, 0);
+			}
+		}
+		reader->lookups += cal->count;
+	}
+
+	return NULL;
+
+}
+
+static int bench_threads(const char * file, unsigned int max) {
+
+	struct reader * readers;
+	pthread_barrier_t start;
+	const char * label;
+	struct cal * cal;
+	struct timespec wait;
+	unsigned long lookups;
+	unsigned int threads, t;
+	double begin, ns;
+
+	label = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
+
+	readers = calloc(max, sizeof(*readers));
+	if ( ! readers ) {
+		perror("calloc");
+		return -1;
+	}
+
+	/* Powers of two, then max itself if it is not one */
+	for ( threads = 1; ; threads = threads * 2 < max ? threads * 2 : max ) {
+
+		/* A fresh handle, so the first lookups of every section race too */
+		if ( cal_init_file(file, &cal) < 0 ) {
+			printf("{\"bench\":\"threads\",\"image\":\"%s\",\"ok\":false}\n", label);
+			break;
+		}
+		if ( cal->count == 0 ) {
+			cal_finish(cal);
+			break;
+		}
+
+		__atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+		pthread_barrier_init(&start, NULL, threads + 1);
+
+		for ( t = 0; t < threads; t++ ) {
+			memset(&readers[t], 0, sizeof(readers[t]));
+			readers[t].id = t;
+			readers[t].cal = cal;
+			readers[t].start = &start;
+			if ( pthread_create(&readers[t].thread, NULL, reader_run, &readers[t]) != 0 ) {
+				perror("pthread_create");
+				exit(1);
+			}
+		}
+
+		pthread_barrier_wait(&start);
+		begin = now_ns();
+		wait.tv_sec = READ_MS / 1000;
+		wait.tv_nsec = READ_MS % 1000 * 1000000L;
+		nanosleep(&wait, NULL);
+		__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+		lookups = 0;
+		for ( t = 0; t < threads; t++ ) {
+			pthread_join(readers[t].thread, NULL);
+			lookups += readers[t].lookups;
+		}
+		ns = now_ns() - begin;
+
+		pthread_barrier_destroy(&start);
+		cal_finish(cal);
+
+		printf("{\"bench\":\"threads\",\"image\":\"%s\",\"ok\":true,\"threads\":%u,\"lookups_per_s\":%.0f}\n", label, threads, lookups / (ns / 1e9));
+
+		if ( threads == max )
+			break;
+
+	}
+
+	free(readers);
+	return 0;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int threads = 0;
+	long cpus;
+	int i, first = 1;
+
+	if ( argc > 1 && strncmp(argv[1], "--threads", 9) == 0 ) {
+		if ( argv[1][9] == '=' )
+			threads = strtoul(argv[1] + 10, NULL, 10);
+		else if ( argv[1][9] == 0 )
+			threads = (cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? cpus : 1;
+		if ( threads == 0 ) {
+			fprintf(stderr, "bench-cal: bad thread count %s\n", argv[1]);
+			return 1;
+		}
+		first = 2;
+	}
+
+	if ( argc <= first ) {
+		fprintf(stderr, "Usage: %s [--threads[=N]] IMAGE...\n", argv[0]);
+		return 1;
+	}
+
+	for ( i = first; i < argc; i++ ) {
+		if ( threads ) {
+			if ( bench_threads(argv[i], threads) < 0 )
+				return 1;
+		} else if ( bench_image(argv[i]) < 0 ) {
+			fprintf(stderr, "bench-cal: %s changed while running\n", argv[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+
+}
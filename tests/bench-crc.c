@@ -0,0 +1,50 @@
+/*
+ * Throughput of every CRC32 backend of cal.c on 32 byte header checksums and
+ * on payload sized inputs, one JSON object per line.
+ */
+
+#include <time.h>
+
+#include "../cal.c"
+
+static double now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+
+}
+
+int main(void) {
+
+	static const size_t sizes[] = { sizeof(struct header) - 4, 752, 4096, 65536 };
+	static uint8_t buf[65536];
+	volatile uint32_t sink = 0;
+	double start, elapsed;
+	unsigned long iterations, n;
+	size_t i, j;
+
+	crc32_init();
+
+	for ( i = 0; i < sizeof(buf); i++ )
+		buf[i] = i * 131 + (i >> 8);
+
+	for ( i = 0; i < sizeof(crc32_backends)/sizeof(crc32_backends[0]); i++ ) {
+		if ( ! crc32_available(i) )
+			continue;
+		for ( j = 0; j < sizeof(sizes)/sizeof(sizes[0]); j++ ) {
+			/* About 64 MB per measurement, less for the slow reference */
+			iterations = (crc32_backends[i].func == crc32_bitwise ? 8UL : 64UL) * 1024 * 1024 / sizes[j];
+			start = now_ns();
+			for ( n = 0; n < iterations; n++ )
+				sink = crc32_backends[i].func(sink, buf, sizes[j]);
+			elapsed = now_ns() - start;
+			printf("{\"bench\":\"crc32\",\"backend\":\"%s\",\"bytes\":%zu,\"ns_per_call\":%.1f,\"mb_per_s\":%.1f}\n",
+			       crc32_backends[i].name, sizes[j], elapsed / iterations, sizes[j] * iterations / elapsed * 1e3);
+		}
+	}
+
+	return 0;
+
+}
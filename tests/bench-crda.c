@@ -0,0 +1,102 @@
+/*
+ * Reading REGDOMAIN from a Debian style /etc/default/crda natively and
+ * through popen() of a shell, one JSON object per line. Times are medians.
+ */
+
+/* wl1251-cal.c needs it, but cal.c includes the system headers first */
+#define _GNU_SOURCE
+#define WL1251_CRDA_FILE "./crda"
+#define main wl1251_cal_main
+#include "../cal.c"
+#include "../wl1251-cal.c"
+#undef main
+
+#define RUNS 201
+
+static const char crda[] =
+	"# Set REGDOMAIN to a ISO/IEC 3166-1 alpha2 country code so that iw(8) may set\n"
+	"# the initial regulatory domain setting for IEEE 802.11 devices which operate\n"
+	"# on this system.\n"
+	"#\n"
+	"# Governments assert the right to regulate usage of radio spectrum within\n"
+	"# their respective territories so make sure you select a ISO/IEC 3166-1 alpha2\n"
+	"# country code suitable for your location or you may infringe on local\n"
+	"# legislature. See `/usr/share/zoneinfo/zone.tab' for a table of timezone\n"
+	"# descriptions containing ISO/IEC 3166-1 alpha2 country codes.\n"
+	"\n"
+	"REGDOMAIN=FI\n";
+
+static double now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+
+}
+
+static int compare_doubles(const void * a, const void * b) {
+
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+
+}
+
+static double bench(int (*read_regdomain)(char * value, size_t size)) {
+
+	static double samples[RUNS];
+	char value[64];
+	double start;
+	int run;
+
+	for ( run = 0; run < RUNS; run++ ) {
+		start = now_ns();
+		if ( read_regdomain(value, sizeof(value)) != 2 || strcmp(value, "FI") != 0 ) {
+			fprintf(stderr, "bench-crda: read \"%s\" instead of FI\n", value);
+			exit(1);
+		}
+		samples[run] = now_ns() - start;
+	}
+
+	qsort(samples, RUNS, sizeof(*samples), compare_doubles);
+	return samples[RUNS / 2];
+
+}
+
+static int native_read_regdomain(char * value, size_t size) {
+
+	return wl1251_crda_parse(WL1251_CRDA_FILE, value, size);
+
+}
+
+int main(void) {
+
+	char dir[] = "/tmp/bench-crda-XXXXXX";
+	double native, shell;
+	FILE * out;
+
+	if ( ! mkdtemp(dir) || chdir(dir) != 0 ) {
+		perror(dir);
+		return 1;
+	}
+
+	out = fopen(WL1251_CRDA_FILE, "w");
+	if ( ! out || fputs(crda, out) < 0 || fclose(out) != 0 ) {
+		perror(WL1251_CRDA_FILE);
+		return 1;
+	}
+
+	native = bench(native_read_regdomain);
+	shell = bench(wl1251_shell_read_regdomain);
+	printf("{\"bench\":\"crda\",\"native_us\":%.1f,\"popen_us\":%.1f,\"speedup\":%.0f}\n",
+	       native / 1e3, shell / 1e3, shell / native);
+
+	unlink(WL1251_CRDA_FILE);
+	if ( chdir("/") == 0 )
+		rmdir(dir);
+
+	return 0;
+
+}
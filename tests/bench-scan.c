@@ -0,0 +1,131 @@
+/*
+ * scan_sections() on sparse, dense and adversarial images in memory against
+ * the original byte by byte search for the magic, one JSON object per line.
+ */
+
+#include <time.h>
+
+#include "../cal.c"
+#include "image.h"
+
+#define RUNS 51
+
+static double now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+
+}
+
+static int compare_doubles(const void * a, const void * b) {
+
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+
+}
+
+/* Headers found one byte at a time, what scan_sections() replaced */
+static unsigned int naive_scan(const uint8_t * data, size_t size) {
+
+	struct header hdr;
+	size_t offset = 0;
+	unsigned int count = 0;
+
+	while ( offset + sizeof(hdr) <= size ) {
+		if ( ! is_header(data + offset, size - offset) ) {
+			offset++;
+			continue;
+		}
+		memcpy(&hdr, data + offset, sizeof(hdr));
+		offset += sizeof(hdr) + hdr.length;
+		count++;
+	}
+
+	return count;
+
+}
+
+static void bench(const char * label, struct test_image * img) {
+
+	static double fast[RUNS], naive[RUNS];
+	struct cal cal;
+	volatile unsigned int sink = 0;
+	double start;
+	int run;
+
+	for ( run = 0; run < RUNS; run++ ) {
+		memset(&cal, 0, sizeof(cal));
+		cal.mem = img->data;
+		cal.size = img->size;
+		cal.fd = -1;
+		start = now_ns();
+		if ( scan_sections(&cal) != 0 ) {
+			fprintf(stderr, "bench-scan: %s does not scan\n", label);
+			exit(1);
+		}
+		fast[run] = now_ns() - start;
+		sink += cal.count;
+		mem_free(cal.sections);
+
+		start = now_ns();
+		sink += naive_scan(img->data, img->size);
+		naive[run] = now_ns() - start;
+	}
+
+	qsort(fast, RUNS, sizeof(double), compare_doubles);
+	qsort(naive, RUNS, sizeof(double), compare_doubles);
+	printf("{\"bench\":\"scan\",\"image\":\"%s\",\"bytes\":%zu,\"ns\":%.0f,\"naive_ns\":%.0f,\"speedup\":%.1f}\n",
+	       label, img->size, fast[RUNS / 2], naive[RUNS / 2], naive[RUNS / 2] / fast[RUNS / 2]);
+
+	free(img->data);
+
+}
+
+int main(void) {
+
+	struct test_image img;
+	char name[16];
+	unsigned int i, version;
+
+	crc32_init();
+
+	image_start(&img, MAX_SIZE, 1);
+	for ( i = 0; i < 6; i++ ) {
+		snprintf(name, sizeof(name), "sparse-%u", i);
+		image_section(&img, name, 0, 16 + test_rand(&img) % 512);
+		image_gap(&img, 30000 + test_rand(&img) % 20000, 0);
+	}
+	bench("sparse", &img);
+
+	image_start(&img, MAX_SIZE, 2);
+	for ( version = 0; version < 3; version++ ) {
+		for ( i = 0; i < 200; i++ ) {
+			snprintf(name, sizeof(name), "dense-%u", i);
+			image_section(&img, name, version, 1 + test_rand(&img) % 300);
+		}
+	}
+	bench("dense", &img);
+
+	image_start(&img, MAX_SIZE, 3);
+	for ( version = 0; version < 4; version++ ) {
+		for ( i = 0; i < 8; i++ ) {
+			snprintf(name, sizeof(name), "adv-%u", i);
+			image_section(&img, name, version, test_rand(&img) % 700);
+			image_gap(&img, 4096 + test_rand(&img) % 4096, 2000);
+		}
+	}
+	bench("adversarial", &img);
+
+	/* Nothing but magic prefixes, the worst case for memchr() */
+	image_start(&img, MAX_SIZE, 4);
+	for ( i = 0; i + 4 <= img.size; i += 4 )
+		memcpy(img.data + i, "CCCC", 4);
+	bench("all-prefix", &img);
+
+	return 0;
+
+}
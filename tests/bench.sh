@@ -0,0 +1,97 @@
+#!/bin/sh
+# Benchmarks for "make bench", one JSON object per line on stdout. Generates
+# CAL images with tests/gencal, times the lookup path of cal.c on them with
+# tests/bench-cal and the whole NVS derivation of wl1251-cal against files
+# standing in for the sysfs firmware loader. A wl1251-cal built with
+# WITH_FAKE also gets the whole flow timed end to end against the fakes.
+
+runs=${BENCH_RUNS:-51}
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+gen() {
+	name=$1
+	shift
+	tests/gencal "$@" "$dir/$name" || exit 1
+}
+
+# Like the N900 partition: a few sections with some updates
+gen n900 --wl1251 --sections=8 --versions=4 --payload=16-900 --gap=0-2048
+gen n900-fcc --wl1251=fcc --sections=8 --versions=4 --payload=16-900 --gap=0-2048
+gen sparse --wl1251 --sections=6 --payload=16-256 --gap=16384-49152
+gen dense --wl1251 --sections=300 --payload=16-512
+gen versions --wl1251 --sections=4 --versions=200 --payload=16-256
+gen adversarial --wl1251 --sections=8 --versions=4 --gap=2048-8192 --false-magic=20000
+gen bad-crc --wl1251 --sections=40 --versions=2 --bad-crc=5
+gen oversize --wl1251 --size=1048576
+
+./tests/bench-crc || exit 1
+./tests/bench-scan || exit 1
+./tests/bench-crda || exit 1
+./tests/bench-cal "$dir"/n900 "$dir"/n900-fcc "$dir"/sparse "$dir"/dense "$dir"/versions \
+	"$dir"/adversarial "$dir"/bad-crc "$dir"/oversize || exit 1
+
+# Lookups per second with 1, 2, 4 ... nproc readers sharing a handle
+./tests/bench-cal --threads "$dir"/n900 "$dir"/dense || exit 1
+
+median() {
+	sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+for image in n900 sparse dense versions adversarial; do
+	: > "$dir/loading"
+	: > "$dir/data"
+	i=0
+	while [ $i -lt $runs ]; do
+		./wl1251-cal --cal-image="$dir/$image" --no-cache --timings=json \
+			--nvs-loading="$dir/loading" --nvs-push-data="$dir/data" > "$dir/out" 2>&1 || exit 1
+		if ! grep -q 'Got CAL NVS' "$dir/out"; then
+			cat "$dir/out" >&2
+			exit 1
+		fi
+		grep '^{' "$dir/out"
+		i=$((i + 1))
+	done > "$dir/timings"
+	total=$(sed -n 's/.*"total_ms":\([0-9.]*\).*/\1/p' "$dir/timings" | median)
+	cal=$(sed -n 's/.*"name":"cal","ms":\([0-9.]*\).*/\1/p' "$dir/timings" | median)
+	echo "{\"bench\":\"nvs_derivation\",\"image\":\"$image\",\"runs\":$runs,\"total_ms\":$total,\"cal_ms\":$cal}"
+done
+
+if ! ./wl1251-cal --help 2>&1 | grep -q -- '--fake'; then
+	echo "wl1251-cal built without WITH_FAKE, no end to end benchmarks" >&2
+	exit 0
+fi
+
+# e2e NAME FAKE [OPTION]..., the whole flow on the n900 image against the fakes
+e2e() {
+	name=$1
+	spec=$2
+	shift 2
+	i=0
+	while [ $i -lt $runs ]; do
+		./wl1251-cal --cal-image="$dir/n900" --no-cache --timings=json --fake="$spec" "$@" > "$dir/out" 2>&1 || exit 1
+		grep '^{' "$dir/out"
+		i=$((i + 1))
+	done > "$dir/timings"
+	total=$(sed -n 's/.*"total_ms":\([0-9.]*\).*/\1/p' "$dir/timings" | median)
+	query=$(sed -n 's/.*"name":"query","ms":\([0-9.]*\).*/\1/p' "$dir/timings" | median)
+	netlink=$(sed -n 's/.*"name":"netlink","ms":\([0-9.]*\).*/\1/p' "$dir/timings" | median)
+	echo "{\"bench\":\"e2e\",\"case\":\"$name\",\"runs\":$runs,\"total_ms\":$total,\"query_ms\":$query,\"netlink_ms\":$netlink}"
+}
+
+e2e sysfs mcc=244 --nvs-loading="$dir/loading" --nvs-push-data="$dir/data"
+e2e netlink mcc=244
+e2e netlink-slow mcc=244,nl-delay=20
+e2e netlink-failing mcc=244,nl=fail
+e2e phone-net-slow mcc=244,mcc-delay=50
+
+# Requests answered by --uevent and registration changes followed by --daemon
+start=$(date +%s%N)
+./wl1251-cal --cal-image="$dir/n900" --no-cache --fake=mcc=244,uevents=1000 --uevent > "$dir/out" 2>&1 || exit 1
+end=$(date +%s%N)
+[ "$(grep -c 'Answered firmware request' "$dir/out")" -eq 1000 ] || { cat "$dir/out" >&2; exit 1; }
+echo "{\"bench\":\"e2e\",\"case\":\"uevent\",\"requests\":1000,\"total_ms\":$(((end - start) / 1000000))}"
+
+./wl1251-cal --cal-image="$dir/n900" --no-cache --fake=mcc=244,signals=1000 --daemon > "$dir/out" 2>&1 || exit 1
+sed -n 's/.*: \([0-9]*\) registration signals, \([0-9]*\) regdomain pushes, signal to send min \([0-9.]*\) avg \([0-9.]*\) max \([0-9.]*\) ms/{"bench":"e2e","case":"daemon","signals":\1,"pushes":\2,"min_ms":\3,"avg_ms":\4,"max_ms":\5}/p' "$dir/out"
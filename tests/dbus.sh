@@ -0,0 +1,80 @@
+# Private system bus with mock csd and oFono services for the DBus tests,
+# sourced by them from the top of the tree. The test is skipped when DBus
+# support or dbus-daemon is missing.
+
+if [ ! -x tests/mock-dbus ] || ! grep -q com.nokia.phone.net wl1251-cal; then
+	echo "wl1251-cal built without WITH_DBUS=1"
+	exit 77
+fi
+if ! command -v dbus-daemon > /dev/null; then
+	echo "no dbus-daemon"
+	exit 77
+fi
+
+dir=$(mktemp -d) || exit 1
+mocks=
+
+cleanup() {
+	[ -n "$mocks" ] && kill $mocks 2> /dev/null
+	[ -s "$dir/bus.pid" ] && kill "$(cat "$dir/bus.pid")" 2> /dev/null
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+cat > "$dir/bus.conf" << EOF
+<!DOCTYPE busconfig PUBLIC "-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN"
+ "http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd">
+<busconfig>
+  <type>session</type>
+  <listen>unix:path=$dir/bus</listen>
+  <policy context="default">
+    <!-- Like session.conf, everything is allowed -->
+    <allow send_destination="*" eavesdrop="true"/>
+    <allow eavesdrop="true"/>
+    <allow own="*"/>
+  </policy>
+</busconfig>
+EOF
+
+dbus-daemon --config-file="$dir/bus.conf" --fork --print-pid > "$dir/bus.pid" || exit 1
+export DBUS_SYSTEM_BUS_ADDRESS="unix:path=$dir/bus"
+
+tests/gencal --wl1251 "$dir/cal.img" || exit 1
+
+# start_mock csd|ofono DELAY_MS MCC, returns once it owns its name
+start_mock() {
+	tests/mock-dbus "$@" > "$dir/$1.out" &
+	mocks="$mocks $!"
+	i=0
+	while ! grep -q ready "$dir/$1.out"; do
+		i=$((i + 1))
+		if [ $i -gt 100 ] || ! kill -0 $! 2> /dev/null; then
+			echo "mock $1 did not start"
+			exit 1
+		fi
+		sleep 0.05
+	done
+}
+
+stop_mocks() {
+	[ -n "$mocks" ] && kill $mocks 2> /dev/null
+	wait 2> /dev/null
+	mocks=
+}
+
+# One run against the generated image, output in $dir/out
+run_wl1251() {
+	: > "$dir/loading"
+	: > "$dir/data"
+	./wl1251-cal --cal-image="$dir/cal.img" --no-cache --timings=json \
+		--nvs-loading="$dir/loading" --nvs-push-data="$dir/data" > "$dir/out" 2>&1
+}
+
+# phase_ms NAME, from the --timings=json line of the last run
+phase_ms() {
+	sed -n "s/.*\"name\":\"$1\",\"ms\":\([0-9.]*\).*/\1/p" "$dir/out"
+}
+
+total_ms() {
+	sed -n 's/.*"total_ms":\([0-9.]*\).*/\1/p' "$dir/out"
+}
@@ -0,0 +1,266 @@
+/*
+ * Write a synthetic CAL image in the struct header format of cal.c, for the
+ * tests and benchmarks.
+ *
+ * Usage: gencal [options] FILE
+ *
+ *   --sections=N         distinct sections (default 6)
+ *   --versions=N         versions of every section, index 0 to N-1 (default 1)
+ *   --payload=MIN[-MAX]  payload bytes of generic sections (default 16-900)
+ *   --gap=MIN[-MAX]      erased 0xFF bytes after every section (default 0)
+ *   --size=BYTES         image size, padded with 0xFF (default 393216, the
+ *                        size of the N900 partition and MAX_SIZE of cal.c)
+ *   --false-magic=N      near misses of the "ConF" magic in the gaps ("C",
+ *                        "Co" or "Con" and another byte), cal.c takes every
+ *                        real magic for a header
+ *   --bad-crc=N          every Nth section written gets a wrong data CRC
+ *   --wl1251[=fcc]       the first three sections are cert-npc with the MAC
+ *                        address 00:1f:df:12:34:56, cert-ccc (with the FCC
+ *                        flag for =fcc) and a wlan-tx-cost3_0 NVS
+ *   --seed=N             random seed (default 1)
+ *
+ * Sections are written version by version, like CAL appends them. The image
+ * layout only depends on the options, so the same command gives the same file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HDR_MAGIC "ConF"
+#define HDR_SIZE 36
+#define CRC32_POLY 0xEDB88320
+
+/* wl1251 NVS: prefix, MAC register burst, terminator, radio tables */
+#define NVS_PREFIX 4
+#define NVS_TABLES_SKIP 7
+#define NVS_TABLES_LEN 688
+
+static const unsigned char mac[6] = { 0x56, 0x34, 0x12, 0xdf, 0x1f, 0x00 };
+
+static uint32_t rng_state;
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+}
+
+static unsigned long rng_range(unsigned long min, unsigned long max)
+{
+	return max > min ? min + rng() % (max - min + 1) : min;
+}
+
+/* Raw CRC32 as CAL uses it: reflected, init 0, no final xor */
+static uint32_t crc32(uint32_t crc, const unsigned char *data, size_t len)
+{
+	unsigned int bit;
+
+	while (len--) {
+		crc ^= *data++;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32_POLY : 0);
+	}
+
+	return crc;
+}
+
+static void put32(unsigned char *p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static void emit_false_magic(unsigned char *p)
+{
+	unsigned int len = 1 + rng() % 3;
+
+	memcpy(p, HDR_MAGIC, len);
+	p[len] = 'x';
+}
+
+static unsigned char *image;
+static unsigned long image_size;
+static unsigned long image_pos;
+
+static int emit(const void *data, unsigned long len)
+{
+	if (image_pos + len > image_size) {
+		fprintf(stderr, "gencal: content does not fit in %lu bytes\n", image_size);
+		return -1;
+	}
+	memcpy(image + image_pos, data, len);
+	image_pos += len;
+	return 0;
+}
+
+static int emit_section(const char *name, unsigned int index, const unsigned char *payload, unsigned long len, int bad_crc)
+{
+	unsigned char hdr[HDR_SIZE];
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, HDR_MAGIC, 4);
+	hdr[5] = index;
+	memcpy(hdr + 8, name, strnlen(name, 16));
+	put32(hdr + 24, len);
+	put32(hdr + 28, crc32(0, payload, len) ^ (bad_crc ? 1 : 0));
+	put32(hdr + 32, crc32(0, hdr, HDR_SIZE - 4));
+
+	if (emit(hdr, sizeof(hdr)) < 0)
+		return -1;
+	return emit(payload, len);
+}
+
+static unsigned long wl1251_payload(unsigned int section, int fcc, unsigned char *buf)
+{
+	unsigned long len;
+	unsigned long i;
+
+	switch (section) {
+	case 0:		/* cert-npc: entry count at 0x94, then 40 byte entries */
+		len = 0x94 + 4 + 2 * 40;
+		memset(buf, 0, len);
+		put32(buf + 0x94, 2);
+		memcpy(buf + 0x98, "BT_ID", 6);
+		memcpy(buf + 0x98 + 40, "WLAN_ID", 8);
+		memcpy(buf + 0x98 + 40 + 8, mac, 6);
+		return len;
+	case 1:		/* cert-ccc: byte count at 368, then 4 byte codes */
+		len = 368 + 4 + 8;
+		memset(buf, 0, len);
+		put32(buf + 368, 8);
+		buf[372 + 2] = 1;
+		buf[376 + 2] = fcc ? 2 : 1;
+		return len;
+	default:	/* wlan-tx-cost3_0 */
+		len = NVS_PREFIX;
+		memset(buf, 0, len);
+		buf[len++] = 2;
+		buf[len++] = 0x6d;
+		buf[len++] = 0x54;
+		for (i = 0; i < 8; i++)
+			buf[len++] = i < 6 ? mac[i] : 0;
+		buf[len] = 0;
+		len += NVS_TABLES_SKIP;
+		for (i = 0; i < NVS_TABLES_LEN; i++)
+			buf[len++] = rng();
+		return len;
+	}
+}
+
+static int parse_range(const char *arg, unsigned long *min, unsigned long *max)
+{
+	char *end;
+
+	*min = strtoul(arg, &end, 0);
+	*max = *min;
+	if (*end == '-')
+		*max = strtoul(end + 1, &end, 0);
+	return *end || *max < *min ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *wl1251_names[] = { "cert-npc", "cert-ccc", "wlan-tx-cost3_0" };
+	unsigned long sections = 6, versions = 1, false_magic = 0, bad_crc = 0;
+	unsigned long payload_min = 16, payload_max = 900;
+	unsigned long gap_min = 0, gap_max = 0;
+	unsigned long section, version, len, gap, magic_left, written = 0;
+	unsigned char payload[65536];
+	char name[32];
+	const char *file = NULL;
+	int wl1251 = 0, fcc = 0;
+	FILE *out;
+	int i;
+
+	rng_state = 1;
+	image_size = 393216;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--sections=", 11) == 0)
+			sections = strtoul(argv[i] + 11, NULL, 0);
+		else if (strncmp(argv[i], "--versions=", 11) == 0)
+			versions = strtoul(argv[i] + 11, NULL, 0);
+		else if (strncmp(argv[i], "--payload=", 10) == 0 && parse_range(argv[i] + 10, &payload_min, &payload_max) == 0 && payload_max <= sizeof(payload))
+			;
+		else if (strncmp(argv[i], "--gap=", 6) == 0 && parse_range(argv[i] + 6, &gap_min, &gap_max) == 0)
+			;
+		else if (strncmp(argv[i], "--size=", 7) == 0)
+			image_size = strtoul(argv[i] + 7, NULL, 0);
+		else if (strncmp(argv[i], "--false-magic=", 14) == 0)
+			false_magic = strtoul(argv[i] + 14, NULL, 0);
+		else if (strncmp(argv[i], "--bad-crc=", 10) == 0)
+			bad_crc = strtoul(argv[i] + 10, NULL, 0);
+		else if (strcmp(argv[i], "--wl1251") == 0)
+			wl1251 = 1;
+		else if (strcmp(argv[i], "--wl1251=fcc") == 0)
+			wl1251 = fcc = 1;
+		else if (strncmp(argv[i], "--seed=", 7) == 0)
+			rng_state = strtoul(argv[i] + 7, NULL, 0);
+		else if (argv[i][0] != '-' && !file)
+			file = argv[i];
+		else
+			file = NULL, i = argc;
+	}
+
+	if (!file || !image_size || versions > 256 || (wl1251 && sections < 3)) {
+		fprintf(stderr, "Usage: %s [--sections=N] [--versions=N] [--payload=MIN[-MAX]] [--gap=MIN[-MAX]] [--size=BYTES]\n"
+				"       [--false-magic=N] [--bad-crc=N] [--wl1251[=fcc]] [--seed=N] FILE\n", argv[0]);
+		return 1;
+	}
+
+	image = malloc(image_size);
+	if (!image) {
+		perror("gencal: malloc");
+		return 1;
+	}
+	memset(image, 0xFF, image_size);
+
+	magic_left = false_magic;
+	for (version = 0; version < versions; version++) {
+		for (section = 0; section < sections; section++) {
+			if (wl1251 && section < 3) {
+				snprintf(name, sizeof(name), "%s", wl1251_names[section]);
+				len = wl1251_payload(section, fcc, payload);
+			} else {
+				snprintf(name, sizeof(name), "sect-%lu", section);
+				len = rng_range(payload_min, payload_max);
+				for (i = 0; i < (int)len; i++)
+					payload[i] = rng();
+			}
+
+			written++;
+			if (emit_section(name, version, payload, len, bad_crc && written % bad_crc == 0) < 0)
+				return 1;
+
+			/* Erased gap, with a share of the false magics spread into it */
+			gap = rng_range(gap_min, gap_max);
+			if (image_pos + gap > image_size)
+				gap = image_size - image_pos;
+			image_pos += gap;
+			len = magic_left / (sections * versions - written + 1);
+			while (len-- && magic_left && gap >= 4) {
+				emit_false_magic(image + image_pos - gap + rng() % (gap - 3));
+				magic_left--;
+			}
+		}
+	}
+
+	/* Whatever is left goes after the last section */
+	while (magic_left && image_pos + 4 <= image_size) {
+		emit_false_magic(image + image_pos + rng() % (image_size - image_pos - 3));
+		magic_left--;
+	}
+
+	out = fopen(file, "wb");
+	if (!out || fwrite(image, 1, image_size, out) != image_size || fclose(out) != 0) {
+		perror("gencal: cannot write image");
+		return 1;
+	}
+
+	free(image);
+	return 0;
+}
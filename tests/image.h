@@ -0,0 +1,203 @@
+/*
+ * In-memory CAL images for the tests that include cal.c, a byte by byte
+ * reference scan to check the indexed sections of a handle against and
+ * streaming handles over image files. Inline so a test does not have to use
+ * all of them.
+ */
+
+struct test_image {
+	uint8_t * data;
+	size_t size;
+	size_t pos;		/* Where the next section or gap goes */
+	uint32_t seed;
+};
+
+static inline uint32_t test_rand(struct test_image * img) {
+
+	img->seed = img->seed * 1103515245 + 12345;
+	return img->seed >> 8;
+
+}
+
+static inline void image_start(struct test_image * img, size_t size, uint32_t seed) {
+
+	crc32_init();
+
+	img->data = malloc(size);
+	if ( ! img->data ) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(img->data, 0xFF, size);
+	img->size = size;
+	img->pos = 0;
+	img->seed = seed;
+
+}
+
+/* Append a section with a random payload, returns its header offset or -1 */
+static inline int64_t image_section(struct test_image * img, const char * name, uint8_t index, uint32_t len) {
+
+	struct header hdr;
+	size_t offset = img->pos;
+	uint32_t i;
+
+	if ( img->pos + sizeof(hdr) + len > img->size )
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HDR_MAGIC, sizeof(hdr.magic));
+	hdr.index = index;
+	memcpy(hdr.name, name, strnlen(name, sizeof(hdr.name)));
+	hdr.length = len;
+
+	/* Random bytes, without a 0xFF word to keep the erased run check honest */
+	for ( i = 0; i < len; i++ )
+		img->data[img->pos + sizeof(hdr) + i] = test_rand(img) % 255;
+
+	hdr.datasum = crc32(0, img->data + img->pos + sizeof(hdr), len);
+	hdr.hdrsum = crc32(0, &hdr, sizeof(hdr) - 4);
+	memcpy(img->data + img->pos, &hdr, sizeof(hdr));
+
+	img->pos += sizeof(hdr) + len;
+	return offset;
+
+}
+
+/*
+ * Skip len erased bytes, near_misses of them are replaced by prefixes of the
+ * magic ("C", "Co", "Con") followed by another byte, or by lone 0x00 bytes
+ * that break the erased words.
+ */
+static inline void image_gap(struct test_image * img, size_t len, unsigned int near_misses) {
+
+	size_t at;
+	unsigned int prefix;
+
+	if ( len > img->size - img->pos )
+		len = img->size - img->pos;
+
+	while ( near_misses-- && len >= 4 ) {
+		at = img->pos + test_rand(img) % (len - 3);
+		prefix = test_rand(img) % 4;
+		if ( prefix == 0 ) {
+			img->data[at] = 0x00;
+		} else {
+			memcpy(img->data + at, HDR_MAGIC, prefix);
+			img->data[at + prefix] = 'x';
+		}
+	}
+
+	img->pos += len;
+
+}
+
+static inline int image_write(struct test_image * img, const char * file) {
+
+	FILE * out = fopen(file, "wb");
+
+	if ( ! out )
+		return -1;
+	if ( fwrite(img->data, 1, img->size, out) != img->size ) {
+		fclose(out);
+		return -1;
+	}
+	return fclose(out);
+
+}
+
+/*
+ * Index the image one byte at a time like the original CAL parser did and
+ * compare the latest version of every section with what the handle found.
+ * Returns the number of mismatches, printed to stderr.
+ */
+static inline int check_sections(struct cal * cal, const uint8_t * data, size_t size) {
+
+	struct cal_section * ref = NULL;
+	struct cal_section * sect;
+	struct header hdr;
+	size_t offset = 0;
+	unsigned int count = 0, i;
+	int errors = 0;
+
+	while ( offset + sizeof(hdr) <= size ) {
+
+		if ( memcmp(data + offset, HDR_MAGIC, 4) != 0 ) {
+			offset++;
+			continue;
+		}
+
+		memcpy(&hdr, data + offset, sizeof(hdr));
+		if ( size - offset - sizeof(hdr) < hdr.length ) {
+			fprintf(stderr, "reference: truncated section at %zu\n", offset);
+			free(ref);
+			return 1;
+		}
+
+		for ( i = 0; i < count; i++ )
+			if ( strncmp(ref[i].name, hdr.name, sizeof(hdr.name)) == 0 )
+				break;
+		if ( i == count ) {
+			ref = realloc(ref, ++count * sizeof(*ref));
+			if ( ! ref ) {
+				perror("realloc");
+				exit(1);
+			}
+			memset(&ref[i], 0, sizeof(*ref));
+			memcpy(ref[i].name, hdr.name, sizeof(hdr.name));
+			ref[i].index = hdr.index;
+			ref[i].offset = offset;
+			ref[i].length = hdr.length;
+		} else if ( hdr.index > ref[i].index ) {
+			/* The first version with the highest index wins */
+			ref[i].index = hdr.index;
+			ref[i].offset = offset;
+			ref[i].length = hdr.length;
+		}
+
+		offset += sizeof(hdr) + hdr.length;
+
+	}
+
+	if ( cal->count != count ) {
+		fprintf(stderr, "%u sections indexed, reference has %u\n", cal->count, count);
+		errors++;
+	}
+
+	for ( i = 0; i < count; i++ ) {
+		sect = find_section(cal, ref[i].name);
+		if ( ! sect || sect->offset != ref[i].offset || sect->index != ref[i].index || sect->length != ref[i].length ) {
+			fprintf(stderr, "section %s: found at %lld index %d, reference at %lld index %u\n", ref[i].name,
+				sect ? (long long)sect->offset : -1LL, sect ? sect->index : -1, (long long)ref[i].offset, ref[i].index);
+			errors++;
+		}
+	}
+
+	free(ref);
+	return errors;
+
+}
+
+/* A handle like cal_init_file() sets up for an MTD character device */
+static inline struct cal * stream_open(const char * file, size_t size, uint32_t erasesize) {
+
+	struct cal * cal;
+
+	cal = mem_alloc(sizeof(*cal));
+	if ( ! cal )
+		return NULL;
+	memset(cal, 0, sizeof(*cal));
+
+	cal->file = copy_string(file);
+	cal->fd = open(file, O_RDONLY);
+	cal->size = size;
+	cal->erasesize = erasesize;
+	cal->writesize = 1;
+	if ( cal->fd < 0 || scan_sections(cal) != 0 ) {
+		cal_finish(cal);
+		return NULL;
+	}
+
+	return cal;
+
+}
@@ -0,0 +1,152 @@
+/*
+ * Stand-in for csd or oFono on a private bus, answering the country code
+ * queries of wl1251-cal after a delay.
+ *
+ * Usage: mock-dbus csd|ofono DELAY_MS MCC
+ *
+ * csd answers get_registration_status, oFono GetModems with one modem that
+ * has network registration and GetProperties with the MCC. An MCC of "-"
+ * answers with an error instead. "ready" is printed once the name is owned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <dbus/dbus.h>
+
+static void append_property(DBusMessageIter *dict, const char *key, int type, const char *signature, const void *value)
+{
+	DBusMessageIter entry, variant;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, signature, &variant);
+	dbus_message_iter_append_basic(&variant, type, value);
+	dbus_message_iter_close_container(&entry, &variant);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static DBusMessage *ofono_modems(DBusMessage *call)
+{
+	static const char *path = "/mock_0";
+	static const char *interfaces[] = { "org.ofono.SimManager", "org.ofono.NetworkRegistration" };
+	DBusMessageIter iter, array, modem, dict, entry, variant, list;
+	const char *key = "Interfaces";
+	dbus_bool_t powered = 1;
+	DBusMessage *reply;
+	unsigned int i;
+
+	reply = dbus_message_new_method_return(call);
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(oa{sv})", &array);
+	dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &modem);
+	dbus_message_iter_append_basic(&modem, DBUS_TYPE_OBJECT_PATH, &path);
+	dbus_message_iter_open_container(&modem, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	append_property(&dict, "Powered", DBUS_TYPE_BOOLEAN, "b", &powered);
+	dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "as", &variant);
+	dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "s", &list);
+	for (i = 0; i < sizeof(interfaces)/sizeof(interfaces[0]); i++)
+		dbus_message_iter_append_basic(&list, DBUS_TYPE_STRING, &interfaces[i]);
+	dbus_message_iter_close_container(&variant, &list);
+	dbus_message_iter_close_container(&entry, &variant);
+	dbus_message_iter_close_container(&dict, &entry);
+	dbus_message_iter_close_container(&modem, &dict);
+	dbus_message_iter_close_container(&array, &modem);
+	dbus_message_iter_close_container(&iter, &array);
+	return reply;
+}
+
+static DBusMessage *ofono_netreg(DBusMessage *call, const char *mcc)
+{
+	DBusMessageIter iter, dict;
+	const char *status = "registered";
+	DBusMessage *reply;
+
+	reply = dbus_message_new_method_return(call);
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	append_property(&dict, "Status", DBUS_TYPE_STRING, "s", &status);
+	append_property(&dict, "MobileCountryCode", DBUS_TYPE_STRING, "s", &mcc);
+	dbus_message_iter_close_container(&iter, &dict);
+	return reply;
+}
+
+static DBusMessage *csd_registration(DBusMessage *call, const char *mcc)
+{
+	unsigned char status = 0;
+	dbus_uint16_t lac = 1;
+	dbus_uint32_t cell = 2;
+	dbus_uint32_t operator_code = 3;
+	dbus_uint32_t country_code = atoi(mcc);
+	DBusMessage *reply;
+
+	reply = dbus_message_new_method_return(call);
+	dbus_message_append_args(reply, DBUS_TYPE_BYTE, &status, DBUS_TYPE_UINT16, &lac,
+				 DBUS_TYPE_UINT32, &cell, DBUS_TYPE_UINT32, &operator_code,
+				 DBUS_TYPE_UINT32, &country_code, DBUS_TYPE_INVALID);
+	return reply;
+}
+
+int main(int argc, char *argv[])
+{
+	DBusConnection *conn;
+	DBusMessage *call, *reply;
+	DBusError error;
+	const char *mcc;
+	int csd, delay;
+
+	if (argc != 4 || (strcmp(argv[1], "csd") != 0 && strcmp(argv[1], "ofono") != 0)) {
+		fprintf(stderr, "Usage: %s csd|ofono DELAY_MS MCC\n", argv[0]);
+		return 1;
+	}
+
+	csd = strcmp(argv[1], "csd") == 0;
+	delay = atoi(argv[2]);
+	mcc = argv[3];
+
+	dbus_error_init(&error);
+	conn = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
+	if (!conn) {
+		fprintf(stderr, "mock-dbus: %s\n", error.message);
+		return 1;
+	}
+
+	if (dbus_bus_request_name(conn, csd ? "com.nokia.phone.net" : "org.ofono", DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		fprintf(stderr, "mock-dbus: cannot own the %s name\n", argv[1]);
+		return 1;
+	}
+
+	printf("ready\n");
+	fflush(stdout);
+
+	while (dbus_connection_read_write(conn, -1)) {
+		while ((call = dbus_connection_pop_message(conn))) {
+			if (dbus_message_get_type(call) != DBUS_MESSAGE_TYPE_METHOD_CALL) {
+				dbus_message_unref(call);
+				continue;
+			}
+
+			usleep(delay * 1000);
+
+			if (strcmp(mcc, "-") == 0)
+				reply = dbus_message_new_error(call, DBUS_ERROR_FAILED, "mock failure");
+			else if (csd)
+				reply = csd_registration(call, mcc);
+			else if (strcmp(dbus_message_get_member(call), "GetModems") == 0)
+				reply = ofono_modems(call);
+			else
+				reply = ofono_netreg(call, mcc);
+
+			dbus_connection_send(conn, reply, NULL);
+			dbus_connection_flush(conn);
+			dbus_message_unref(reply);
+			dbus_message_unref(call);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Run the tests given as arguments from the top of the tree, a test program
+# or script exits 0 on success, 77 when it cannot run here and anything else
+# on failure. Output of each test goes to tests/<name>.log.
+
+pass=0
+fail=0
+skip=0
+
+for test in "$@"; do
+	name=${test##*/}
+	log=tests/${name%.sh}.log
+	case "$test" in
+		*.sh) sh "$test" > "$log" 2>&1 ;;
+		*) "./$test" > "$log" 2>&1 ;;
+	esac
+	ret=$?
+	if [ $ret -eq 0 ]; then
+		echo "PASS: $name"
+		pass=$((pass + 1))
+	elif [ $ret -eq 77 ]; then
+		echo "SKIP: $name ($(tail -n 1 "$log"))"
+		skip=$((skip + 1))
+	else
+		echo "FAIL: $name (exit $ret, see $log)"
+		tail -n 20 "$log" | sed 's/^/	/'
+		fail=$((fail + 1))
+	fi
+done
+
+echo "$pass passed, $fail failed, $skip skipped"
+[ $fail -eq 0 ]
@@ -0,0 +1,251 @@
+/*
+ * The fixed arena of WITH_STATIC_ARENA builds: blocks must never overlap
+ * through any sequence of allocations, frees and reallocs, a freed tail must
+ * be given back up to the last block in use, and the last block must grow in
+ * place. Opening and reading an image must not touch the heap at all, which
+ * the malloc() family wrapped at link time checks.
+ */
+
+#include "../cal.c"
+#include "image.h"
+
+#ifndef WITH_STATIC_ARENA
+#error "test-arena needs -DWITH_STATIC_ARENA"
+#endif
+
+#define SLOTS 32
+#define STEPS 20000
+
+static int counting;
+static unsigned int heap_calls;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t n, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+
+void * __wrap_malloc(size_t size) {
+
+	if ( counting )
+		heap_calls++;
+	return __real_malloc(size);
+
+}
+
+void * __wrap_calloc(size_t n, size_t size) {
+
+	if ( counting )
+		heap_calls++;
+	return __real_calloc(n, size);
+
+}
+
+void * __wrap_realloc(void * ptr, size_t size) {
+
+	if ( counting )
+		heap_calls++;
+	return __real_realloc(ptr, size);
+
+}
+
+static int errors;
+
+static void fail(const char * what) {
+
+	fprintf(stderr, "%s\n", what);
+	errors++;
+
+}
+
+/* Offset in the arena of the header of a block */
+static size_t start_of(void * ptr) {
+
+	return (uint8_t *)ptr - ARENA_HDR - arena;
+
+}
+
+static void test_sequences(void) {
+
+	uint8_t * a;
+	uint8_t * b;
+	uint8_t * c;
+	uint8_t * d;
+
+	/* Freeing the middle block, then the last one gives back both */
+	a = cal_alloc(100);
+	b = cal_alloc(200);
+	c = cal_alloc(300);
+	cal_free(b);
+	cal_free(c);
+	if ( arena_used != start_of(b) || arena_last != start_of(a) )
+		fail("freed tail behind a freed block not given back");
+
+	/* So the first block is the last one again and grows in place */
+	memset(a, 0xA1, 100);
+	if ( arena_realloc(a, 1000) != a || a[99] != 0xA1 )
+		fail("last block did not grow in place");
+
+	/* A freed block followed by a live one stays taken */
+	b = cal_alloc(50);
+	cal_free(a);
+	if ( arena_used != start_of(b) + ARENA_HDR + ARENA_ROUND(50) )
+		fail("live block given back");
+
+	/* Free then realloc the new last block, then realloc one that is not last */
+	memset(b, 0xB2, 50);
+	if ( arena_realloc(b, 5000) != b || b[49] != 0xB2 )
+		fail("last block after a freed one did not grow in place");
+	c = cal_alloc(10);
+	memset(c, 0xC3, 10);
+	d = arena_realloc(b, 6000);
+	if ( ! d || d == b || d[0] != 0xB2 || d[49] != 0xB2 || c[9] != 0xC3 )
+		fail("block that is not last not moved intact");
+	if ( start_of(d) < start_of(c) + ARENA_HDR + ARENA_ROUND(10) )
+		fail("moved block overlaps a live one");
+
+	cal_free(c);
+	cal_free(d);
+	if ( arena_used != 0 || arena_last != 0 || arena_live != 0 )
+		fail("arena not empty after freeing everything");
+
+}
+
+/* Random allocations, frees and reallocs against a model of the live blocks */
+static void test_random(void) {
+
+	struct test_image img;
+	uint8_t * slots[SLOTS];
+	size_t sizes[SLOTS];
+	unsigned int step, i, j;
+	uint8_t * ptr;
+	size_t size, k;
+
+	memset(slots, 0, sizeof(slots));
+	img.seed = 60;
+
+	for ( step = 0; step < STEPS; step++ ) {
+
+		i = test_rand(&img) % SLOTS;
+		size = test_rand(&img) % 4096;
+
+		if ( ! slots[i] ) {
+			ptr = cal_alloc(size);
+		} else if ( test_rand(&img) % 2 ) {
+			cal_free(slots[i]);
+			slots[i] = NULL;
+			continue;
+		} else {
+			ptr = arena_realloc(slots[i], size);
+			if ( ptr ) {
+				for ( k = 0; k < size && k < sizes[i]; k++ ) {
+					if ( ptr[k] != (uint8_t)i ) {
+						fprintf(stderr, "step %u: slot %u lost its data in a realloc\n", step, i);
+						errors++;
+						return;
+					}
+				}
+			}
+		}
+
+		if ( ! ptr )
+			continue;
+		slots[i] = ptr;
+		sizes[i] = size;
+		memset(ptr, i, size);
+
+		/* Every live block still holds its own pattern, so none overlapped */
+		for ( j = 0; j < SLOTS; j++ ) {
+			for ( k = 0; slots[j] && k < sizes[j]; k++ ) {
+				if ( slots[j][k] != (uint8_t)j ) {
+					fprintf(stderr, "step %u: slot %u overwritten\n", step, j);
+					errors++;
+					return;
+				}
+			}
+		}
+
+	}
+
+	for ( i = 0; i < SLOTS; i++ )
+		cal_free(slots[i]);
+	if ( arena_used != 0 || arena_live != 0 )
+		fail("arena not empty after the random sequence");
+
+}
+
+/* The static path itself: open, look up, read and close without the heap */
+static void test_no_heap(const char * file) {
+
+	struct test_image img;
+	struct cal * cal;
+	const void * ref;
+	void * copy;
+	unsigned long len;
+	char name[16];
+	unsigned int i;
+
+	image_start(&img, 64 * 1024, 61);
+	for ( i = 0; i < 40; i++ ) {
+		snprintf(name, sizeof(name), "arena-%u", i % 20);
+		image_section(&img, name, i / 20, test_rand(&img) % 1000);
+	}
+	if ( image_write(&img, file) != 0 ) {
+		perror(file);
+		exit(1);
+	}
+	free(img.data);
+
+	heap_calls = 0;
+	counting = 1;
+	if ( cal_init_file(file, &cal) != 0 ) {
+		counting = 0;
+		fail("cannot open the image");
+		return;
+	}
+	for ( i = 0; i < 20; i++ ) {
+		snprintf(name, sizeof(name), "arena-%u", i);
+		if ( cal_get_block_ref(cal, name, &ref, &len, 0) != 0 || cal_read_block(cal, name, &copy, &len, 0) != 0 ) {
+			fail("lookup failed");
+			continue;
+		}
+		if ( memcmp(ref, copy, len) != 0 )
+			fail("copy differs");
+		cal_free(copy);
+	}
+	cal_finish(cal);
+	counting = 0;
+
+	if ( heap_calls ) {
+		fprintf(stderr, "%u heap allocations on the static path\n", heap_calls);
+		errors++;
+	}
+	if ( arena_live != 0 )
+		fail("arena not empty after cal_finish()");
+
+}
+
+int main(void) {
+
+	char file[] = "/tmp/test-arena-XXXXXX";
+	int fd;
+
+	fd = mkstemp(file);
+	if ( fd < 0 ) {
+		perror(file);
+		return 1;
+	}
+	close(fd);
+
+	test_sequences();
+	test_random();
+	test_no_heap(file);
+
+	unlink(file);
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+# wl1251-cal --batch over more images than the first allocation holds, from
+# a directory and from a list, must write one NVS and one summary line per
+# image. A list naming two images with the same file name must be refused
+# before anything is written.
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+count=150
+
+mkdir "$dir/images" "$dir/other"
+i=0
+while [ $i -lt $count ]; do
+	if [ $((i % 2)) -eq 0 ]; then
+		tests/gencal --wl1251 --seed=$i "$dir/images/cal-$i.img" || exit 1
+	else
+		tests/gencal --wl1251=fcc --seed=$i "$dir/images/cal-$i.img" || exit 1
+	fi
+	echo "$dir/images/cal-$i.img" >> "$dir/list"
+	i=$((i + 1))
+done
+
+# check OUT, every image has its NVS and a summary line
+check() {
+	lines=$(wc -l < "$1/summary")
+	nvs=$(ls "$1" | grep -c '\.img\.nvs$')
+	if [ "$lines" -ne $count ] || [ "$nvs" -ne $count ]; then
+		echo "$1: $lines summary lines and $nvs NVS files for $count images"
+		exit 1
+	fi
+	if [ "$(grep -c 'fcc=1' "$1/summary")" -ne $((count / 2)) ]; then
+		echo "$1: wrong fcc count"
+		exit 1
+	fi
+}
+
+./wl1251-cal --batch="$dir/images" --batch-out="$dir/out-dir" --jobs=4 || exit 1
+check "$dir/out-dir"
+
+./wl1251-cal --batch="$dir/list" --batch-out="$dir/out-list" --jobs=4 || exit 1
+check "$dir/out-list"
+
+if ! cmp -s "$dir/out-dir/cal-7.img.nvs" "$dir/out-list/cal-7.img.nvs"; then
+	echo "directory and list runs differ"
+	exit 1
+fi
+
+# Same file name in two directories
+cp "$dir/images/cal-3.img" "$dir/other/cal-3.img"
+echo "$dir/other/cal-3.img" >> "$dir/list"
+if ./wl1251-cal --batch="$dir/list" --batch-out="$dir/out-dup" > "$dir/out" 2>&1; then
+	echo "duplicate image names accepted"
+	exit 1
+fi
+cat "$dir/out"
+grep -q "would both be written to cal-3.img.nvs" "$dir/out" || exit 1
+if [ -e "$dir/out-dup" ]; then
+	echo "output written for a refused list"
+	exit 1
+fi
@@ -0,0 +1,134 @@
+/*
+ * The NVS cache of wl1251-cal must miss when the CAL image or the firmware
+ * NVS file changes, including a firmware file installed after a default NVS
+ * was cached. Runs in a temporary directory with the firmware and cache
+ * directories below it.
+ */
+
+/* wl1251-cal.c needs it, but cal.c includes the system headers first */
+#define _GNU_SOURCE
+#define WL1251_FIRMWARE_DIR "fw"
+#define WL1251_CACHE_DIR "cache"
+#define main wl1251_cal_main
+#include "../cal.c"
+#include "image.h"
+#include "../wl1251-cal.c"
+#undef main
+
+static int errors;
+
+static void write_file(const char * file, const char * data) {
+
+	FILE * out = fopen(file, "w");
+
+	if ( ! out || fputs(data, out) < 0 || fclose(out) != 0 ) {
+		perror(file);
+		exit(1);
+	}
+
+}
+
+static struct cal * open_image(uint32_t seed) {
+
+	struct test_image img;
+	struct cal * cal;
+
+	image_start(&img, 4096, seed);
+	image_section(&img, "cert-npc", 0, 100 + seed);
+	if ( image_write(&img, "cal.img") != 0 || cal_init_file("cal.img", &cal) != 0 ) {
+		fprintf(stderr, "cannot create CAL image\n");
+		exit(1);
+	}
+	free(img.data);
+	return cal;
+
+}
+
+static void expect(struct cal * cal, int hit, const char * what) {
+
+	unsigned char address[6];
+	unsigned char * nvs = NULL;
+	unsigned long nvs_len = 0;
+	int fcc;
+	int ret;
+
+	ret = wl1251_cache_load(cal, address, &fcc, &nvs, &nvs_len);
+	wl1251_free(nvs);
+	if ( (ret == 0) != hit ) {
+		fprintf(stderr, "%s: cache %s, expected %s\n", what, ret == 0 ? "hit" : "miss", hit ? "hit" : "miss");
+		errors++;
+	}
+
+}
+
+int main(void) {
+
+	static const unsigned char address[6] = { 0x00, 0x1f, 0xdf, 0x12, 0x34, 0x56 };
+	unsigned char nvs[8] = { 0, 0, 0, 0, 1, 2, 3, 4 };
+	char dir[] = "/tmp/test-cache-XXXXXX";
+	struct timespec times[2];
+	struct cal * cal;
+
+	if ( ! mkdtemp(dir) || chdir(dir) != 0 || mkdir("fw", 0755) != 0 || mkdir("fw/ti-connectivity", 0755) != 0 ) {
+		perror(dir);
+		return 1;
+	}
+
+	cal = open_image(1);
+
+	/* Default NVS, no firmware file */
+	expect(cal, 0, "empty cache");
+	wl1251_cache_store(cal, (unsigned char *)address, 0, NULL, 0, 0);
+	expect(cal, 1, "default NVS");
+
+	write_file(WL1251_FIRMWARE_NVS_OLD, "old firmware NVS");
+	expect(cal, 0, "firmware NVS installed after a cached default");
+
+	/* NVS from the firmware file */
+	wl1251_cache_store(cal, (unsigned char *)address, 1, nvs, sizeof(nvs), 1);
+	expect(cal, 1, "firmware NVS");
+
+	write_file(WL1251_FIRMWARE_NVS_OLD, "old firmware NVS, longer");
+	expect(cal, 0, "firmware NVS size changed");
+
+	wl1251_cache_store(cal, (unsigned char *)address, 1, nvs, sizeof(nvs), 1);
+	times[0].tv_sec = times[1].tv_sec = 1000000;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	if ( utimensat(AT_FDCWD, WL1251_FIRMWARE_NVS_OLD, times, 0) != 0 )
+		perror("utimensat");
+	expect(cal, 0, "firmware NVS mtime changed");
+
+	/* The preferred location takes over */
+	wl1251_cache_store(cal, (unsigned char *)address, 1, nvs, sizeof(nvs), 1);
+	write_file(WL1251_FIRMWARE_NVS, "new firmware NVS");
+	expect(cal, 0, "firmware NVS in ti-connectivity installed");
+
+	wl1251_cache_store(cal, (unsigned char *)address, 1, nvs, sizeof(nvs), 1);
+	unlink(WL1251_FIRMWARE_NVS);
+	unlink(WL1251_FIRMWARE_NVS_OLD);
+	expect(cal, 0, "firmware NVS removed");
+
+	/* NVS from CAL, the image changes */
+	wl1251_cache_store(cal, (unsigned char *)address, 0, nvs, sizeof(nvs), 0);
+	expect(cal, 1, "CAL NVS");
+	cal_finish(cal);
+	cal = open_image(2);
+	expect(cal, 0, "CAL image changed");
+	cal_finish(cal);
+
+	unlink("cal.img");
+	unlink(WL1251_CACHE_FILE);
+	rmdir(WL1251_CACHE_DIR);
+	rmdir("fw/ti-connectivity");
+	rmdir("fw");
+	if ( chdir("/") == 0 )
+		rmdir(dir);
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
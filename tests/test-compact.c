@@ -0,0 +1,162 @@
+/*
+ * cal_compact() on a streamed image, with MEMERASE and MEMGETBADBLOCK
+ * answered on the image file: the latest versions must survive, a bad block
+ * must stay untouched, and the stats must count a block that only ends up
+ * erased as erased but not written.
+ */
+
+#include <stdarg.h>
+
+/* cal.c erases and asks for bad blocks through ioctl(), answered here */
+#define ioctl test_ioctl
+#include "../cal.c"
+#undef ioctl
+#include "image.h"
+
+/* sys/ioctl.h declared it under the other name */
+extern int ioctl(int fd, unsigned long request, ...);
+
+#define ERASESIZE 512
+#define BLOCKS 96
+#define BAD_BLOCK 6
+
+static unsigned int erases;
+
+int test_ioctl(int fd, unsigned long request, ...) {
+
+	struct erase_info_user * erase;
+	uint8_t ff[ERASESIZE];
+	va_list ap;
+	void * arg;
+	loff_t block;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if ( request == MEMGETBADBLOCK ) {
+		memcpy(&block, arg, sizeof(block));
+		return block / ERASESIZE == BAD_BLOCK;
+	}
+
+	if ( request == MEMERASE ) {
+		erase = arg;
+		if ( erase->start % ERASESIZE || erase->length != ERASESIZE || erase->start / ERASESIZE == BAD_BLOCK ) {
+			errno = EINVAL;
+			return -1;
+		}
+		erases++;
+		memset(ff, 0xFF, sizeof(ff));
+		return pwrite(fd, ff, sizeof(ff), erase->start) == sizeof(ff) ? 0 : -1;
+	}
+
+	return ioctl(fd, request, arg);
+
+}
+
+int main(void) {
+
+	char file[] = "/tmp/test-compact-XXXXXX";
+	struct cal_compact_stats stats;
+	struct test_image img;
+	struct cal * cal;
+	uint8_t * before;
+	uint8_t * after;
+	char name[16];
+	unsigned int block, i, version, changed = 0, written = 0;
+	int fd, errors = 0;
+
+	fd = mkstemp(file);
+	if ( fd < 0 ) {
+		perror(file);
+		return 1;
+	}
+	close(fd);
+
+	/* Four versions of every section, so the compacted image leaves blocks empty */
+	image_start(&img, BLOCKS * ERASESIZE, 50);
+	for ( version = 0; version < 4; version++ ) {
+		for ( i = 0; i < 40; i++ ) {
+			snprintf(name, sizeof(name), "compact-%u", i);
+			if ( img.pos / ERASESIZE == BAD_BLOCK || (img.pos + sizeof(struct header) + 200) / ERASESIZE == BAD_BLOCK )
+				img.pos = (BAD_BLOCK + 1) * ERASESIZE;
+			image_section(&img, name, version, 1 + test_rand(&img) % 200);
+		}
+	}
+	/* What the bad block holds, never to be read or written */
+	memset(img.data + BAD_BLOCK * ERASESIZE, 0x5A, ERASESIZE);
+	if ( image_write(&img, file) != 0 ) {
+		perror(file);
+		return 1;
+	}
+
+	before = malloc(img.size);
+	after = malloc(img.size);
+	cal = stream_open(file, img.size, ERASESIZE);
+	if ( ! before || ! after || ! cal || stream_read(cal, before, img.size, 0) != 0 ) {
+		fprintf(stderr, "cannot stream %s\n", file);
+		return 1;
+	}
+
+	if ( cal_compact(cal, &stats) != 0 ) {
+		fprintf(stderr, "compaction failed\n");
+		return 1;
+	}
+
+	if ( stream_read(cal, after, img.size, 0) != 0 || check_sections(cal, after, img.size) != 0 ) {
+		fprintf(stderr, "compacted image does not match the handle\n");
+		errors++;
+	}
+	if ( cal->count != 40 ) {
+		fprintf(stderr, "%u sections after compaction\n", cal->count);
+		errors++;
+	}
+	cal_finish(cal);
+
+	fd = open(file, O_RDONLY);
+	if ( fd < 0 || pread(fd, after + BAD_BLOCK * ERASESIZE, ERASESIZE, BAD_BLOCK * ERASESIZE) != ERASESIZE ||
+	     memcmp(after + BAD_BLOCK * ERASESIZE, img.data + BAD_BLOCK * ERASESIZE, ERASESIZE) != 0 ) {
+		fprintf(stderr, "bad block touched\n");
+		errors++;
+	}
+	if ( fd >= 0 )
+		close(fd);
+	memset(after + BAD_BLOCK * ERASESIZE, 0xFF, ERASESIZE);
+
+	/* Every changed block is erased, only those with data left are written */
+	for ( block = 0; block < BLOCKS; block++ ) {
+		if ( memcmp(before + block * ERASESIZE, after + block * ERASESIZE, ERASESIZE) == 0 )
+			continue;
+		changed++;
+		for ( i = 0; i < ERASESIZE && after[block * ERASESIZE + i] == 0xFF; i++ );
+		if ( i < ERASESIZE )
+			written++;
+	}
+
+	if ( changed == written ) {
+		fprintf(stderr, "no block was left empty, the test image is wrong\n");
+		errors++;
+	}
+	if ( stats.blocks_erased != changed || erases != changed || stats.blocks_written != written ) {
+		fprintf(stderr, "%u blocks changed and %u written, stats say %u erased and %u written\n",
+			changed, written, stats.blocks_erased, stats.blocks_written);
+		errors++;
+	}
+	if ( stats.bytes_after >= stats.bytes_before ) {
+		fprintf(stderr, "compaction went from %lu to %lu bytes\n", stats.bytes_before, stats.bytes_after);
+		errors++;
+	}
+
+	free(before);
+	free(after);
+	free(img.data);
+	unlink(file);
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+# csd and oFono are asked for the country code at the same time: whichever
+# answers first with a country code wins, a provider that errors, answers 0
+# or never answers must not hold up the other, and with neither answering
+# the lookup ends at the 2000 ms deadline. The oFono mock takes its delay
+# for each of its two calls.
+
+. tests/dbus.sh
+
+# expect NAME PATTERN MIN_MS MAX_MS, one run against the mocks started, which are stopped after it
+expect() {
+	run_wl1251 || { cat "$dir/out"; exit 1; }
+	stop_mocks
+	query=$(phase_ms query)
+	echo "$1: $(grep -o 'Regulatory domain: [A-Z]*\|FCC country\|Fallback regulatory domain: [A-Z]*' "$dir/out" | head -n 1), query $query ms"
+	if ! grep -q "$2" "$dir/out"; then
+		cat "$dir/out"
+		echo "$1: expected $2"
+		exit 1
+	fi
+	awk -v query="$query" -v min=$3 -v max=$4 -v name="$1" 'BEGIN {
+		if (query == "") { print name ": no query time"; exit 1 }
+		if (query < min || query > max) { print name ": query outside " min "-" max " ms"; exit 1 }
+	}' || exit 1
+}
+
+start_mock csd 100 244
+start_mock ofono 300 262
+expect "csd first" "Regulatory domain: FI" 100 400
+
+start_mock csd 600 244
+start_mock ofono 100 262
+expect "oFono first" "Regulatory domain: DE" 200 500
+
+start_mock csd 100 310
+start_mock ofono 100 262
+expect "csd first with an FCC country" "FCC country" 100 190
+
+start_mock csd 5000 244
+start_mock ofono 100 262
+expect "csd timing out" "Regulatory domain: DE" 200 500
+
+start_mock csd 100 244
+start_mock ofono 5000 262
+expect "oFono timing out" "Regulatory domain: FI" 100 400
+
+start_mock csd 50 0
+start_mock ofono 100 262
+expect "csd answering 0" "Regulatory domain: DE" 200 500
+
+start_mock csd 50 -
+start_mock ofono 100 262
+expect "csd failing" "Regulatory domain: DE" 200 500
+
+start_mock ofono 100 262
+expect "no csd" "Regulatory domain: DE" 200 500
+
+start_mock csd 5000 244
+start_mock ofono 5000 262
+expect "both timing out" "No country code from csd or oFono within 2000 ms" 1950 2300
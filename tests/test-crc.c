@@ -0,0 +1,76 @@
+/*
+ * Known answers for every CRC32 backend of cal.c and a differential check of
+ * each one against the bitwise reference over random lengths, alignments and
+ * split points.
+ */
+
+#include "../cal.c"
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void) {
+
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+
+}
+
+int main(void) {
+
+	static uint8_t buf[70000];
+	uint32_t want, got;
+	size_t i, len, off, split;
+	int failed = 0;
+	int round;
+
+	crc32_init();
+
+	for ( i = 0; i < sizeof(buf); i++ )
+		buf[i] = rng();
+
+	for ( i = 0; i < sizeof(crc32_backends)/sizeof(crc32_backends[0]); i++ ) {
+
+		if ( ! crc32_available(i) ) {
+			printf("%s: not supported by this CPU\n", crc32_backends[i].name);
+			continue;
+		}
+
+		/* CRC-32/ISO-HDLC check value, CAL itself uses 0 as init and no final xor */
+		got = ~crc32_backends[i].func(~0U, "123456789", 9);
+		if ( got != 0xCBF43926 ) {
+			printf("%s: check value %08x, expected cbf43926\n", crc32_backends[i].name, got);
+			failed = 1;
+		}
+
+		got = crc32_backends[i].func(0, "", 0);
+		if ( got != 0 ) {
+			printf("%s: empty input gives %08x\n", crc32_backends[i].name, got);
+			failed = 1;
+		}
+
+		for ( round = 0; round < 3000; round++ ) {
+			len = round < 300 ? (size_t)round : rng() % (round < 2900 ? 4096 : sizeof(buf) - 16);
+			off = rng() % 16;
+			want = crc32_bitwise(round, buf + off, len);
+			got = crc32_backends[i].func(round, buf + off, len);
+			if ( got != want ) {
+				printf("%s: length %zu at offset %zu gives %08x, expected %08x\n", crc32_backends[i].name, len, off, got, want);
+				failed = 1;
+				break;
+			}
+			split = len ? rng() % len : 0;
+			got = crc32_backends[i].func(crc32_backends[i].func(round, buf + off, split), buf + off + split, len - split);
+			if ( got != want ) {
+				printf("%s: length %zu split at %zu gives %08x, expected %08x\n", crc32_backends[i].name, len, split, got, want);
+				failed = 1;
+				break;
+			}
+		}
+
+		printf("%s: %s\n", crc32_backends[i].name, failed ? "FAILED" : "ok");
+
+	}
+
+	return failed;
+
+}
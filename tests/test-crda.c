@@ -0,0 +1,140 @@
+/*
+ * The native /etc/default/crda parser against the shell on a corpus of
+ * defaults files: where it accepts a file it must find what "sh -c '. file;
+ * echo $REGDOMAIN'" prints, and what it refuses must still come out right
+ * through the shell fallback of wl1251_crda_read().
+ */
+
+/* wl1251-cal.c needs it, but cal.c includes the system headers first */
+#define _GNU_SOURCE
+#define WL1251_CRDA_FILE "./crda"
+#define main wl1251_cal_main
+#include "../cal.c"
+#include "../wl1251-cal.c"
+#undef main
+
+static const struct {
+	const char * text;
+	int native;		/* Parsed without the shell */
+} corpus[] = {
+	{ "REGDOMAIN=FI\n", 1 },
+	{ "REGDOMAIN=US", 1 },
+	{ "# Set REGDOMAIN to a ISO/IEC 3166-1 alpha2 country code\nREGDOMAIN=\n", 1 },
+	{ "REGDOMAIN=DE\nREGDOMAIN=GB\n", 1 },
+	{ "REGDOMAIN='JP'\n", 1 },
+	{ "REGDOMAIN=\"CA\"\n", 1 },
+	{ "REGDOMAIN=\"N\"'Z'\n", 1 },
+	{ "  export REGDOMAIN=AU  # comment\n", 1 },
+	{ "REGDOMAIN=BR\nexport REGDOMAIN\n", 1 },
+	{ "\t\n# only comments\n\n", 1 },
+	{ "OTHER=1\nREGDOMAIN=SE\nMORE='a b'\n", 1 },
+	{ "REGDOMAIN=ESP\n", 1 },
+	{ "REGDOMAIN='# not a comment'\n", 1 },
+	{ "REGDOMAIN=FR#x # a comment needs a blank before it\n", 1 },
+	{ "REGDOMAIN=$(echo US)\n", 0 },
+	{ "REGDOMAIN=`echo GB`\n", 0 },
+	{ "CC=DK\nREGDOMAIN=$CC\n", 0 },
+	{ "REGDOMAIN=\"$CC\"\n", 0 },
+	{ "[ -n \"$X\" ] || REGDOMAIN=NO\n", 0 },
+	{ "REGDOMAIN=IT; OTHER=1\n", 0 },
+	{ "REGDOMAIN=P\\\nL\n", 0 },
+	{ "REGDOMAIN='unterminated\n", 0 },
+	{ "if true; then REGDOMAIN=CH; fi\n", 0 },
+};
+
+static int errors;
+
+static void write_crda(const char * text) {
+
+	FILE * out = fopen(WL1251_CRDA_FILE, "w");
+
+	if ( ! out || fputs(text, out) < 0 || fclose(out) != 0 ) {
+		perror(WL1251_CRDA_FILE);
+		exit(1);
+	}
+
+}
+
+static void check(const char * what, int native) {
+
+	char parsed[64], shell[64], read[64];
+	int parsed_len, shell_len, read_len;
+
+	parsed_len = wl1251_crda_parse(WL1251_CRDA_FILE, parsed, sizeof(parsed));
+	shell_len = wl1251_shell_read_regdomain(shell, sizeof(shell));
+	read_len = wl1251_crda_read(read, sizeof(read));
+
+	/* A file the shell chokes on must fail the same way */
+	if ( shell_len < 0 ) {
+		if ( native || parsed_len != WL1251_CRDA_UNSUPPORTED || read_len >= 0 ) {
+			fprintf(stderr, "%s: parsed %d, read %d, but the shell failed\n", what, parsed_len, read_len);
+			errors++;
+		}
+		return;
+	}
+
+	if ( native && (parsed_len != shell_len || strcmp(parsed, shell) != 0) ) {
+		fprintf(stderr, "%s: parsed \"%s\" (%d), shell \"%s\"\n", what, parsed, parsed_len, shell);
+		errors++;
+	} else if ( ! native && parsed_len != WL1251_CRDA_UNSUPPORTED ) {
+		fprintf(stderr, "%s: parsed \"%s\" (%d), expected a shell fallback\n", what, parsed, parsed_len);
+		errors++;
+	}
+
+	if ( read_len != shell_len || strcmp(read, shell) != 0 ) {
+		fprintf(stderr, "%s: read \"%s\" (%d), shell \"%s\"\n", what, read, read_len, shell);
+		errors++;
+	}
+
+}
+
+int main(void) {
+
+	char dir[] = "/tmp/test-crda-XXXXXX";
+	char long_file[8192];
+	char value[64];
+	size_t i;
+
+	if ( ! mkdtemp(dir) || chdir(dir) != 0 ) {
+		perror(dir);
+		return 1;
+	}
+
+	unsetenv("REGDOMAIN");
+
+	for ( i = 0; i < sizeof(corpus)/sizeof(corpus[0]); i++ ) {
+		write_crda(corpus[i].text);
+		check(corpus[i].text, corpus[i].native);
+	}
+
+	/* Without an assignment the inherited environment counts, like in sh */
+	setenv("REGDOMAIN", "EE", 1);
+	write_crda("# nothing here\n");
+	check("inherited REGDOMAIN", 1);
+	write_crda("REGDOMAIN=LV\n");
+	check("assignment over inherited REGDOMAIN", 1);
+	unsetenv("REGDOMAIN");
+
+	/* Too long to read in one go */
+	memset(long_file, '#', sizeof(long_file) - 16);
+	strcpy(long_file + sizeof(long_file) - 16, "\nREGDOMAIN=LT\n");
+	write_crda(long_file);
+	check("long file", 0);
+
+	unlink(WL1251_CRDA_FILE);
+	if ( wl1251_crda_parse(WL1251_CRDA_FILE, value, sizeof(value)) != -1 ) {
+		fprintf(stderr, "missing file: not an error\n");
+		errors++;
+	}
+
+	if ( chdir("/") == 0 )
+		rmdir(dir);
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
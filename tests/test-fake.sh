@@ -0,0 +1,141 @@
+#!/bin/sh
+# The whole provisioning flow against the fake transport: the NVS reaching
+# the fake firmware loader must be the one a normal run writes, and failing
+# or missing netlink, sysfs and SIOCSIFHWADDR, a slow Phone.Net service, the
+# --uevent responder and the --daemon must each take their fallback. Skipped
+# when wl1251-cal was built without WITH_FAKE.
+
+if ! ./wl1251-cal --help 2>&1 | grep -q -- '--fake'; then
+	echo "wl1251-cal built without WITH_FAKE"
+	exit 77
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+tests/gencal --wl1251 "$dir/cal.img" || exit 1
+
+# What a normal run pushes
+: > "$dir/loading"
+: > "$dir/expected"
+./wl1251-cal --cal-image="$dir/cal.img" --no-cache --nvs-loading="$dir/loading" \
+	--nvs-push-data="$dir/expected" > "$dir/out" 2>&1 || { cat "$dir/out"; exit 1; }
+size=$(wc -c < "$dir/expected")
+[ "$size" -gt 0 ] || { echo "no NVS pushed by a normal run"; exit 1; }
+
+# run NAME STATUS FAKE [OPTION]..., one run that must exit with STATUS
+run() {
+	name=$1
+	status=$2
+	spec=$3
+	shift 3
+	./wl1251-cal --cal-image="$dir/cal.img" --no-cache --fake="$spec" "$@" > "$dir/out" 2>&1
+	ret=$?
+	echo "$name: exit $ret"
+	if [ $ret -ne "$status" ]; then
+		cat "$dir/out"
+		echo "$name: expected exit $status"
+		exit 1
+	fi
+}
+
+# has/lacks PATTERN, on the output of the last run
+has() {
+	if ! grep -q "$1" "$dir/out"; then
+		cat "$dir/out"
+		echo "$name: expected $1"
+		exit 1
+	fi
+}
+
+lacks() {
+	if grep -q "$1" "$dir/out"; then
+		cat "$dir/out"
+		echo "$name: unexpected $1"
+		exit 1
+	fi
+}
+
+sysfs="--nvs-loading=$dir/none/loading --nvs-push-data=$dir/none/data"
+
+run "sysfs push" 0 mcc=244 $sysfs
+has "Regulatory domain: FI"
+has "fake firmware: loaded $size bytes"
+lacks "SIOCSIFHWADDR"
+
+run "sysfs push failing" 0 mcc=244,sysfs=fail $sysfs
+has "Cannot push NVS to file"
+lacks "fake firmware: loaded [1-9]"
+
+run "sysfs missing" 1 mcc=244,sysfs=missing $sysfs
+has "Cannot open file"
+lacks "Got CAL NVS"
+
+run "netlink acked" 0 mcc=262
+has "Regulatory domain: DE"
+has "RTM_SETLINK acked"
+has "WL1251_NL_CMD_NVS_PUSH acked"
+has "NL80211_CMD_REQ_SET_REG acked"
+lacks "SIOCSIFHWADDR"
+
+# RTM_SETLINK queued fine but not acked: the address goes through the ioctl
+run "netlink failing" 0 mcc=262,nl=fail
+has "RTM_SETLINK failed"
+has "falling back to SIOCSIFHWADDR"
+has "fake SIOCSIFHWADDR wlan0 00:1f:df:12:34:56"
+
+run "netlink missing" 0 mcc=262,nl=missing --timings=json
+has "fake SIOCSIFHWADDR wlan0"
+lacks "falling back"
+lacks "acked"
+has '"name":"netlink"'
+
+run "netlink and ioctl failing" 0 mcc=262,nl=missing,mac=fail
+has "ioctl SIOCSIFHWADDR failed"
+
+run "netlink timing out" 0 mcc=262,nl-delay=5000
+has "timeout waiting for 3 netlink acks"
+has "falling back to SIOCSIFHWADDR"
+
+run "FCC country" 0 mcc=310,mcc-delay=100 --timings=json
+has "FCC country"
+query=$(sed -n 's/.*"name":"query","ms":\([0-9.]*\).*/\1/p' "$dir/out")
+awk -v query="$query" 'BEGIN { if (query == "" || query < 100) { print "query of " query " ms"; exit 1 } }' || exit 1
+
+run "Phone.Net timing out" 0 mcc=244,mcc-delay=5000
+has "No country code from csd or oFono within 2000 ms"
+lacks "Country code: 244"
+
+run "uevent" 0 mcc=244,uevents=3 --uevent --sysfs-root="$dir/sys"
+if [ "$(grep -c "Answered firmware request $dir/sys/devices/platform/wl1251/firmware/" "$dir/out")" -ne 3 ] ||
+   [ "$(grep -c "fake firmware: loaded $size bytes" "$dir/out")" -ne 3 ]; then
+	cat "$dir/out"
+	echo "uevent: expected 3 answered requests"
+	exit 1
+fi
+lacks "other.bin"
+
+run "uevent with sysfs failing" 0 mcc=244,uevents=2,sysfs=fail --uevent --sysfs-root="$dir/sys"
+[ "$(grep -c "fake firmware: request aborted" "$dir/out")" -eq 2 ] || { cat "$dir/out"; echo "uevent: expected 2 aborted requests"; exit 1; }
+lacks "Answered"
+
+if ./wl1251-cal --help 2>&1 | grep -q -- '--daemon'; then
+	run "daemon" 0 mcc=244,signals=5,signal-delay=10 --daemon
+	has "Regulatory domain DE pushed"
+	has "Regulatory domain US pushed"
+	has "Regulatory domain FI pushed"
+	has "5 registration signals, 3 regdomain pushes"
+
+	# Registration changes further apart than the daemon waits at once
+	run "daemon with slow changes" 0 mcc=244,signals=1,signal-delay=1500 --daemon
+	has "1 registration signals, 1 regdomain pushes"
+
+	# An unacked push is not counted and the same regdomain is pushed again
+	run "daemon with netlink failing" 0 mcc=244,signals=5,nl=fail --daemon
+	[ "$(grep -c "Regulatory domain DE not acked" "$dir/out")" -eq 2 ] || { cat "$dir/out"; echo "daemon: expected DE to be retried"; exit 1; }
+	has "5 registration signals, 0 regdomain pushes"
+	lacks "Regulatory domain .* pushed"
+
+	run "daemon without netlink" 1 mcc=244,signals=5,nl=missing --daemon
+	lacks "registration signals"
+fi
@@ -0,0 +1,181 @@
+/*
+ * The generated mcc_domains[] against the codes[] and fcc_codes[] tables it
+ * replaced, copied here as they were. Every code from -5 to 1099 must map to
+ * the same regdomain with and without the FCC flag, except the MCCs which
+ * joined to two countries: there mcc-table.sh picks one explicitly and the
+ * other must never be returned.
+ */
+
+/* wl1251-cal.c needs it, but cal.c includes the system headers first */
+#define _GNU_SOURCE
+#define main wl1251_cal_main
+#include "../cal.c"
+#include "../wl1251-cal.c"
+#undef main
+
+static const struct {
+	int country_code;
+	char regdomain[3];
+} codes[] = {
+	{ 202, "GR" }, { 204, "NL" }, { 206, "BE" }, { 208, "FR" }, { 212, "MC" }, { 213, "AD" },
+	{ 214, "ES" }, { 216, "HU" }, { 218, "BA" }, { 219, "HR" }, { 220, "RS" }, { 222, "IT" },
+	{ 225, "VA" }, { 226, "RO" }, { 228, "CH" }, { 230, "CZ" }, { 231, "SK" }, { 232, "AT" },
+	{ 234, "GB" }, { 235, "GB" }, { 238, "DK" }, { 240, "SE" }, { 242, "NO" }, { 244, "FI" },
+	{ 246, "LT" }, { 247, "LV" }, { 248, "EE" }, { 250, "RU" }, { 255, "UA" }, { 257, "BY" },
+	{ 259, "MD" }, { 260, "PL" }, { 262, "DE" }, { 266, "GI" }, { 268, "PT" }, { 270, "LU" },
+	{ 272, "IE" }, { 274, "IS" }, { 276, "AL" }, { 278, "MT" }, { 280, "CY" }, { 282, "GE" },
+	{ 283, "AM" }, { 284, "BG" }, { 286, "TR" }, { 288, "FO" }, { 290, "GL" }, { 292, "SM" },
+	{ 293, "SI" }, { 294, "MK" }, { 295, "LI" }, { 297, "ME" }, { 302, "CA" }, { 308, "FR" },
+	{ 310, "US" }, { 311, "US" }, { 312, "US" }, { 313, "US" }, { 314, "US" }, { 315, "US" },
+	{ 316, "US" }, { 330, "PR" }, { 332, "US" }, { 334, "MX" }, { 338, "JM" }, { 340, "FR" },
+	{ 342, "BB" }, { 344, "AG" }, { 346, "KY" }, { 348, "VG" }, { 350, "BM" }, { 352, "GD" },
+	{ 354, "MS" }, { 356, "KN" }, { 358, "LC" }, { 360, "VC" }, { 362, "NL" }, { 363, "AW" },
+	{ 364, "BS" }, { 365, "AI" }, { 366, "DM" }, { 368, "CU" }, { 370, "DO" }, { 372, "HT" },
+	{ 374, "TT" }, { 376, "TC" }, { 400, "AZ" }, { 401, "KZ" }, { 402, "BT" }, { 404, "IN" },
+	{ 405, "IN" }, { 410, "PK" }, { 412, "AF" }, { 413, "LK" }, { 414, "MM" }, { 415, "LB" },
+	{ 416, "JO" }, { 417, "SY" }, { 418, "IQ" }, { 419, "KW" }, { 420, "SA" }, { 421, "YE" },
+	{ 422, "OM" }, { 424, "AE" }, { 425, "IL" }, { 426, "BH" }, { 427, "QA" }, { 428, "MN" },
+	{ 429, "NP" }, { 430, "AE" }, { 431, "AE" }, { 432, "IR" }, { 434, "UZ" }, { 436, "TJ" },
+	{ 437, "KG" }, { 438, "TM" }, { 440, "JP" }, { 441, "JP" }, { 450, "KR" }, { 452, "VN" },
+	{ 455, "MO" }, { 456, "KH" }, { 457, "LA" }, { 460, "CN" }, { 460, "HK" }, { 466, "TW" },
+	{ 467, "KP" }, { 470, "BD" }, { 472, "MV" }, { 502, "MY" }, { 505, "AU" }, { 510, "ID" },
+	{ 514, "TL" }, { 515, "PH" }, { 520, "TH" }, { 525, "SG" }, { 528, "BN" }, { 530, "NZ" },
+	{ 535, "GU" }, { 536, "NR" }, { 537, "PG" }, { 539, "TO" }, { 540, "SB" }, { 541, "VU" },
+	{ 542, "FJ" }, { 543, "WF" }, { 544, "WS" }, { 545, "KI" }, { 546, "FR" }, { 547, "PF" },
+	{ 548, "CK" }, { 549, "WS" }, { 550, "FM" }, { 550, "MP" }, { 551, "MH" }, { 552, "PW" },
+	{ 602, "EG" }, { 603, "DZ" }, { 604, "MA" }, { 605, "TN" }, { 606, "LY" }, { 607, "GM" },
+	{ 608, "SN" }, { 609, "MR" }, { 610, "ML" }, { 611, "GN" }, { 612, "CI" }, { 613, "BF" },
+	{ 614, "NE" }, { 615, "TG" }, { 616, "BJ" }, { 617, "MU" }, { 618, "LR" }, { 619, "SL" },
+	{ 620, "GH" }, { 621, "NG" }, { 622, "TD" }, { 623, "CF" }, { 624, "CM" }, { 625, "CV" },
+	{ 626, "ST" }, { 627, "GQ" }, { 628, "GA" }, { 629, "CG" }, { 630, "CD" }, { 631, "AO" },
+	{ 632, "GW" }, { 633, "SC" }, { 634, "SD" }, { 635, "RW" }, { 636, "ET" }, { 637, "SO" },
+	{ 638, "DJ" }, { 639, "KE" }, { 640, "TZ" }, { 641, "UG" }, { 642, "BI" }, { 643, "MZ" },
+	{ 645, "ZM" }, { 646, "MG" }, { 647, "FR" }, { 648, "ZW" }, { 649, "NA" }, { 650, "MW" },
+	{ 651, "LS" }, { 652, "BW" }, { 653, "SZ" }, { 654, "KM" }, { 655, "ZA" }, { 657, "ER" },
+	{ 702, "BZ" }, { 704, "GT" }, { 706, "SV" }, { 708, "HN" }, { 710, "NI" }, { 712, "CR" },
+	{ 714, "PA" }, { 716, "PE" }, { 722, "AR" }, { 724, "BR" }, { 730, "CL" }, { 732, "CO" },
+	{ 734, "VE" }, { 736, "BO" }, { 738, "GY" }, { 740, "EC" }, { 742, "FR" }, { 744, "PY" },
+	{ 746, "SR" }, { 748, "UY" }
+};
+
+static const int fcc_codes[] = { 302, 310, 311, 316, 312, 313, 314, 315, 332, 466, 724, 722, 334, 732 };
+
+/* The DUPLICATES of mcc-table.sh */
+static const struct {
+	int country_code;
+	char chosen[3];
+	char dropped[3];
+} duplicates[] = {
+	{ 460, "CN", "HK" },
+	{ 550, "FM", "MP" },
+};
+
+static int errors;
+
+static const char * duplicate(int country_code) {
+
+	size_t i;
+
+	for ( i = 0; i < sizeof(duplicates)/sizeof(duplicates[0]); i++ )
+		if ( duplicates[i].country_code == country_code )
+			return duplicates[i].chosen;
+
+	return NULL;
+
+}
+
+/* The old first match lookup, without the messages */
+static void old_regdomain(int country_code, int fcc, char * regdomain) {
+
+	size_t i;
+
+	memcpy(regdomain, "EU", 3);
+
+	if ( country_code == 0 && fcc ) {
+		memcpy(regdomain, "US", 3);
+		return;
+	}
+
+	for ( i = 0; i < sizeof(fcc_codes)/sizeof(fcc_codes[0]); i++ ) {
+		if ( fcc_codes[i] == country_code ) {
+			memcpy(regdomain, "US", 3);
+			return;
+		}
+	}
+
+	for ( i = 0; i < sizeof(codes)/sizeof(codes[0]); i++ ) {
+		if ( codes[i].country_code == country_code ) {
+			memcpy(regdomain, codes[i].regdomain, 3);
+			return;
+		}
+	}
+
+}
+
+/* Any MCC listed twice in codes[] must be one of the known duplicates */
+static void check_duplicates(void) {
+
+	size_t i, j;
+	int found;
+
+	for ( i = 0; i < sizeof(codes)/sizeof(codes[0]); i++ ) {
+		for ( j = i + 1; j < sizeof(codes)/sizeof(codes[0]); j++ ) {
+			if ( codes[i].country_code == codes[j].country_code && ! duplicate(codes[i].country_code) ) {
+				fprintf(stderr, "MCC %d: %s and %s, not a known duplicate\n", codes[i].country_code, codes[i].regdomain, codes[j].regdomain);
+				errors++;
+			}
+		}
+	}
+
+	for ( i = 0; i < sizeof(duplicates)/sizeof(duplicates[0]); i++ ) {
+		found = 0;
+		for ( j = 0; j < sizeof(codes)/sizeof(codes[0]); j++ )
+			if ( codes[j].country_code == duplicates[i].country_code &&
+			     (strcmp(codes[j].regdomain, duplicates[i].chosen) == 0 || strcmp(codes[j].regdomain, duplicates[i].dropped) == 0) )
+				found++;
+		if ( found != 2 ) {
+			fprintf(stderr, "MCC %d: %s and %s are not both in the old table\n", duplicates[i].country_code, duplicates[i].chosen, duplicates[i].dropped);
+			errors++;
+		}
+	}
+
+}
+
+int main(void) {
+
+	char old[3], new[3];
+	const char * chosen;
+	int country_code;
+	int fcc;
+
+	check_duplicates();
+
+	/* The lookup prints what it picked */
+	if ( ! freopen("/dev/null", "w", stdout) ) {
+		perror("/dev/null");
+		return 1;
+	}
+
+	for ( country_code = -5; country_code < 1100; country_code++ ) {
+		for ( fcc = 0; fcc < 2; fcc++ ) {
+			old_regdomain(country_code, fcc, old);
+			wl1251_country_code_to_regdomain(country_code, fcc, new);
+			chosen = duplicate(country_code);
+			if ( chosen && strcmp(new, chosen) != 0 ) {
+				fprintf(stderr, "MCC %d fcc %d: %s instead of the chosen %s\n", country_code, fcc, new, chosen);
+				errors++;
+			} else if ( ! chosen && strcmp(new, old) != 0 ) {
+				fprintf(stderr, "MCC %d fcc %d: %s, the old table gave %s\n", country_code, fcc, new, old);
+				errors++;
+			}
+		}
+	}
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,197 @@
+/*
+ * wl1251_nvs_parse() on the default NVS against the fixed offsets it
+ * replaced: the MAC address at 32 behind the 0x546c burst signature and the
+ * band edge TX power limits at 337, 340, 377 and 380. Patching through the
+ * parsed layout must give the bytes the old code wrote, and truncated or
+ * malformed NVS must be rejected with the matching diagnostic.
+ */
+
+/* wl1251-cal.c needs it, but cal.c includes the system headers first */
+#define _GNU_SOURCE
+#define main wl1251_cal_main
+#include "../cal.c"
+#include "../wl1251-cal.c"
+#undef main
+
+#define OLD_NVS_LEN	756
+#define OLD_MAC		32
+
+static const unsigned char address[6] = { 0x00, 0x1f, 0xdf, 0x12, 0x34, 0x56 };
+
+static int errors;
+
+/* What the code before wl1251_nvs_parse() did to a loaded NVS */
+static void old_patch(unsigned char * nvs, unsigned long nvs_len, int us, const unsigned char * mac) {
+
+	if ( us && nvs_len == OLD_NVS_LEN ) {
+		nvs[377] = 2;
+		nvs[337] = 2;
+		nvs[380] = 9;
+		nvs[340] = 9;
+	}
+
+	if ( memcmp(mac, "\0\0\0\0\0\0", 6) != 0 && nvs_len == OLD_NVS_LEN && nvs[29] == 2 && nvs[30] == 0x6d && nvs[31] == 0x54 )
+		memcpy(nvs + OLD_MAC, mac, 6);
+
+}
+
+static void check_layout(const char * label, const unsigned char * nvs) {
+
+	struct wl1251_nvs layout;
+
+	if ( wl1251_nvs_parse(nvs, OLD_NVS_LEN, &layout) != 0 ) {
+		fprintf(stderr, "%s: rejected\n", label);
+		errors++;
+		return;
+	}
+
+	if ( layout.mac != OLD_MAC ) {
+		fprintf(stderr, "%s: MAC address at %lu, expected %d\n", label, layout.mac, OLD_MAC);
+		errors++;
+	}
+
+	/* Channel 1 low and high limits, then channel 11 ten channels later */
+	if ( layout.tx_power != 337 || layout.tx_power + 3 != 340 ||
+	     layout.tx_power + 40 != 377 || layout.tx_power + 43 != 380 ) {
+		fprintf(stderr, "%s: TX power limits at %lu, expected 337\n", label, layout.tx_power);
+		errors++;
+	}
+
+}
+
+/* Both regdomains with and without a MAC address, through wl1251_nvs_select() */
+static void check_patch(int us, int set_mac) {
+
+	unsigned char old[OLD_NVS_LEN];
+	unsigned char * nvs;
+	unsigned long nvs_len = OLD_NVS_LEN;
+	static const unsigned char none[6];
+	const unsigned char * mac = set_mac ? address : none;
+	const unsigned char * push;
+	int patched;
+
+	memcpy(old, default_nvs, OLD_NVS_LEN);
+	old_patch(old, OLD_NVS_LEN, us, mac);
+
+	nvs = wl1251_alloc(OLD_NVS_LEN);
+	if ( ! nvs ) {
+		perror("malloc");
+		errors++;
+		return;
+	}
+	memcpy(nvs, default_nvs, OLD_NVS_LEN);
+
+	push = wl1251_nvs_select(&nvs, &nvs_len, us ? "US" : "FI", mac, &patched);
+	if ( nvs_len != OLD_NVS_LEN || memcmp(push, old, OLD_NVS_LEN) != 0 ) {
+		fprintf(stderr, "regdomain %s, %s MAC: differs from the fixed offsets\n", us ? "US" : "FI", set_mac ? "with" : "without");
+		errors++;
+	}
+
+	if ( patched != (us || set_mac) ) {
+		fprintf(stderr, "regdomain %s, %s MAC: patched %d\n", us ? "US" : "FI", set_mac ? "with" : "without", patched);
+		errors++;
+	}
+
+	wl1251_free(nvs);
+
+}
+
+/* Run wl1251_nvs_parse() with stderr captured, it must fail printing diagnostic */
+static void check_reject(const char * label, const unsigned char * nvs, unsigned long nvs_len, const char * diagnostic) {
+
+	struct wl1251_nvs layout;
+	char out[256];
+	FILE * tmp;
+	size_t len;
+	int saved;
+	int ret;
+
+	tmp = tmpfile();
+	if ( ! tmp ) {
+		perror("tmpfile");
+		errors++;
+		return;
+	}
+
+	fflush(stderr);
+	saved = dup(2);
+	dup2(fileno(tmp), 2);
+	ret = wl1251_nvs_parse(nvs, nvs_len, &layout);
+	fflush(stderr);
+	dup2(saved, 2);
+	close(saved);
+
+	rewind(tmp);
+	len = fread(out, 1, sizeof(out) - 1, tmp);
+	out[len] = 0;
+	fclose(tmp);
+
+	if ( ret == 0 ) {
+		fprintf(stderr, "%s: accepted\n", label);
+		errors++;
+	} else if ( ! strstr(out, diagnostic) ) {
+		fprintf(stderr, "%s: printed \"%s\", expected \"%s\"\n", label, out, diagnostic);
+		errors++;
+	}
+
+}
+
+int main(void) {
+
+	unsigned char nvs[OLD_NVS_LEN + 1];
+	struct wl1251_nvs layout;
+	unsigned long end;
+	unsigned int i;
+
+	if ( sizeof(default_nvs) != OLD_NVS_LEN || sizeof(default_nvs_fcc) != OLD_NVS_LEN ) {
+		fprintf(stderr, "default NVS is %lu bytes, expected %d\n", (unsigned long)sizeof(default_nvs), OLD_NVS_LEN);
+		return 1;
+	}
+
+	check_layout("default NVS", default_nvs);
+	check_layout("FCC default NVS", default_nvs_fcc);
+
+	/* The FCC variant is the old US patch of the default one */
+	memcpy(nvs, default_nvs, OLD_NVS_LEN);
+	old_patch(nvs, OLD_NVS_LEN, 1, (const unsigned char *)"\0\0\0\0\0\0");
+	if ( memcmp(nvs, default_nvs_fcc, OLD_NVS_LEN) != 0 ) {
+		fprintf(stderr, "FCC default NVS differs from the patched default one\n");
+		errors++;
+	}
+
+	for ( i = 0; i < 4; i++ )
+		check_patch(i & 1, i >> 1);
+
+	wl1251_nvs_parse(default_nvs, OLD_NVS_LEN, &layout);
+	end = layout.tables - WL1251_NVS_TABLES_SKIP;
+
+	check_reject("truncated in the MAC address burst", default_nvs, OLD_MAC + 4, "register burst at 29 is truncated");
+	check_reject("truncated before the terminator", default_nvs, end, "not terminated");
+	check_reject("truncated tables", default_nvs, OLD_NVS_LEN - 1, "radio tables are 687 bytes");
+
+	memcpy(nvs, default_nvs, OLD_NVS_LEN);
+	nvs[OLD_NVS_LEN] = 0;
+	check_reject("trailing byte", nvs, OLD_NVS_LEN + 1, "radio tables are 689 bytes");
+
+	/* The MAC address burst moved to another register */
+	memcpy(nvs, default_nvs, OLD_NVS_LEN);
+	nvs[31] = 0x55;
+	check_reject("no MAC address burst", nvs, OLD_NVS_LEN, "no MAC address register burst");
+
+	/* A burst count running past the end */
+	memcpy(nvs, default_nvs, OLD_NVS_LEN);
+	nvs[29] = 0xff;
+	check_reject("overlong burst", nvs, OLD_NVS_LEN, "register burst at 29 is truncated");
+
+	/* No zero count anywhere */
+	memset(nvs, 0x01, OLD_NVS_LEN);
+	check_reject("no terminator", nvs, OLD_NVS_LEN, "register burst at");
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
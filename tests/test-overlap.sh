@@ -0,0 +1,24 @@
+#!/bin/sh
+# The country code query runs alongside CAL and NVS loading: with a csd
+# answering after 500 ms the CAL phase must finish long before the answer,
+# and the whole run must take the query time rather than the sum of both.
+
+. tests/dbus.sh
+
+delay=500
+
+start_mock csd $delay 244
+run_wl1251 || { cat "$dir/out"; exit 1; }
+cat "$dir/out"
+
+grep -q "Regulatory domain: FI" "$dir/out" || { echo "country code 244 not used"; exit 1; }
+
+cal=$(phase_ms cal)
+total=$(total_ms)
+echo "csd delay $delay ms: CAL done after $cal ms, total $total ms"
+
+awk -v cal="$cal" -v total="$total" -v delay=$delay 'BEGIN {
+	if (cal == "" || total == "") { print "no timings"; exit 1 }
+	if (cal >= delay / 5) { print "CAL waited for the country code"; exit 1 }
+	if (total < delay || total > delay + 400) { print "total outside the query time"; exit 1 }
+}'
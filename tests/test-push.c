@@ -0,0 +1,140 @@
+/*
+ * An unpatched firmware NVS is pushed with sendfile() from the file it was
+ * read from, but only while that file still holds what was read: changed in
+ * place, even with its mtime restored, the buffer must be pushed instead.
+ * Runs in a temporary directory with the firmware directory below it.
+ */
+
+/* wl1251-cal.c needs it, but cal.c includes the system headers first */
+#define _GNU_SOURCE
+#define WL1251_FIRMWARE_DIR "fw"
+#define main wl1251_cal_main
+#include "../cal.c"
+#include "../wl1251-cal.c"
+#undef main
+
+#define NVS_SIZE 10000
+
+static int errors;
+
+static void write_nvs(const char * file, unsigned char fill) {
+
+	unsigned char data[NVS_SIZE];
+	int fd;
+
+	memset(data, fill, sizeof(data));
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ( fd < 0 || write(fd, data, sizeof(data)) != sizeof(data) || close(fd) != 0 ) {
+		perror(file);
+		exit(1);
+	}
+
+}
+
+/* Push nvs to a fresh data file, which must then hold fill bytes */
+static void expect(const unsigned char * nvs, unsigned long nvs_len, unsigned char fill, const char * what) {
+
+	unsigned char data[NVS_SIZE + 1];
+	ssize_t len, i;
+	int fd;
+
+	fd = open("data", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if ( fd < 0 ) {
+		perror("data");
+		exit(1);
+	}
+
+	if ( wl1251_push_nvs_data(fd, nvs, nvs_len, 1) != 0 ) {
+		fprintf(stderr, "%s: push failed\n", what);
+		errors++;
+		close(fd);
+		return;
+	}
+
+	len = pread(fd, data, sizeof(data), 0);
+	close(fd);
+
+	for ( i = 0; i < len && data[i] == fill; i++ );
+	if ( len != NVS_SIZE || i != len ) {
+		fprintf(stderr, "%s: pushed %zd bytes, byte %zd is %02x instead of %02x\n", what, len, i, i < len ? data[i] : 0, fill);
+		errors++;
+	}
+
+}
+
+/* Read a fresh firmware NVS, then make the buffer differ from the file so the data tells which one was pushed */
+static void read_nvs(unsigned char ** nvs, unsigned long * nvs_len) {
+
+	wl1251_free(*nvs);
+	*nvs = NULL;
+	write_nvs(WL1251_FIRMWARE_NVS, 0xa5);
+	wl1251_vfs_read_nvs(nvs, nvs_len);
+	if ( ! *nvs || *nvs_len != NVS_SIZE + 4 ) {
+		fprintf(stderr, "cannot read the firmware NVS\n");
+		exit(1);
+	}
+	memset(*nvs + 4, 0x11, NVS_SIZE);
+
+}
+
+int main(void) {
+
+	char dir[] = "/tmp/test-push-XXXXXX";
+	struct timespec times[2];
+	unsigned char * nvs = NULL;
+	unsigned long nvs_len = 0;
+	struct stat st;
+	int fd;
+
+	if ( ! mkdtemp(dir) || chdir(dir) != 0 || mkdir("fw", 0755) != 0 || mkdir("fw/ti-connectivity", 0755) != 0 ) {
+		perror(dir);
+		return 1;
+	}
+
+	read_nvs(&nvs, &nvs_len);
+	expect(nvs, nvs_len, 0xa5, "unchanged file");
+
+	/* Rewritten in place with the same size and mtime */
+	if ( stat(WL1251_FIRMWARE_NVS, &st) != 0 ) {
+		perror(WL1251_FIRMWARE_NVS);
+		return 1;
+	}
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	fd = open(WL1251_FIRMWARE_NVS, O_WRONLY);
+	if ( fd < 0 || pwrite(fd, "\x33", 1, 100) != 1 || futimens(fd, times) != 0 || close(fd) != 0 ) {
+		perror(WL1251_FIRMWARE_NVS);
+		return 1;
+	}
+	expect(nvs, nvs_len, 0x11, "rewritten file");
+
+	/* Replaced by a new file, which was not read */
+	read_nvs(&nvs, &nvs_len);
+	write_nvs("fw/new", 0x22);
+	if ( rename("fw/new", WL1251_FIRMWARE_NVS) != 0 ) {
+		perror("rename");
+		return 1;
+	}
+	expect(nvs, nvs_len, 0x11, "replaced file");
+
+	/* Nothing read in this run */
+	close(wl1251_fw_nvs.fd);
+	wl1251_fw_nvs.fd = -1;
+	expect(nvs, nvs_len, 0x11, "no file read");
+
+	wl1251_free(nvs);
+	unlink("data");
+	unlink(WL1251_FIRMWARE_NVS);
+	rmdir("fw/ti-connectivity");
+	rmdir("fw");
+	if ( chdir("/") == 0 )
+		rmdir(dir);
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,180 @@
+/*
+ * skip_to_header() against a byte by byte search on random buffers, and the
+ * sections indexed from sparse, dense and adversarial images against the
+ * original byte by byte parser, which lookups must not scan again.
+ */
+
+#include "../cal.c"
+#include "image.h"
+
+static uint64_t naive_skip(const uint8_t * data, uint64_t count) {
+
+	uint64_t pos;
+
+	for ( pos = 1; pos + sizeof(struct header) <= count; pos++ )
+		if ( memcmp(data + pos, HDR_MAGIC, 4) == 0 )
+			return pos;
+
+	return count;
+
+}
+
+static int test_skip(void) {
+
+	static uint8_t buf[640];
+	struct test_image img;
+	unsigned int round, i, pos, len;
+	uint64_t start, count, got, want;
+	int errors = 0;
+
+	img.seed = 4;
+
+	for ( round = 0; round < 50000; round++ ) {
+
+		/* Mostly erased with near misses, sometimes a real magic */
+		memset(buf, 0xFF, sizeof(buf));
+		for ( i = test_rand(&img) % 24; i > 0; i-- ) {
+			switch ( test_rand(&img) % 7 ) {
+			case 0:
+				buf[test_rand(&img) % sizeof(buf)] = test_rand(&img);
+				break;
+			case 1:
+				memcpy(buf + test_rand(&img) % (sizeof(buf) - 4), HDR_MAGIC, 4);
+				break;
+			case 2:
+				/* A prefix running into a real magic, like "CConF" */
+				pos = test_rand(&img) % (sizeof(buf) - 7);
+				len = 1 + test_rand(&img) % 3;
+				memcpy(buf + pos, HDR_MAGIC, len);
+				memcpy(buf + pos + len, HDR_MAGIC, 4);
+				break;
+			default:
+				memcpy(buf + test_rand(&img) % (sizeof(buf) - 4), HDR_MAGIC, 1 + test_rand(&img) % 3);
+				break;
+			}
+		}
+		if ( round % 8 == 0 )
+			for ( i = 0; i < sizeof(buf); i++ )
+				buf[i] = test_rand(&img);
+
+		start = test_rand(&img) % 64;
+		count = test_rand(&img) % (sizeof(buf) - start + 1);
+
+		got = skip_to_header(buf + start, count);
+		want = naive_skip(buf + start, count);
+		if ( got != want ) {
+			fprintf(stderr, "skip_to_header(+%llu, %llu) = %llu, expected %llu\n",
+				(unsigned long long)start, (unsigned long long)count, (unsigned long long)got, (unsigned long long)want);
+			if ( ++errors > 10 )
+				break;
+		}
+
+	}
+
+	return errors;
+
+}
+
+static int check_image(const char * label, struct test_image * img) {
+
+	char file[] = "/tmp/test-scan-XXXXXX";
+	struct cal * cal;
+	unsigned long len;
+	unsigned int i;
+	void * ptr;
+	int fd, errors;
+
+	fd = mkstemp(file);
+	if ( fd < 0 || image_write(img, file) != 0 ) {
+		perror(file);
+		return 1;
+	}
+	close(fd);
+
+	if ( cal_init_file(file, &cal) != 0 ) {
+		fprintf(stderr, "%s: cal_init_file failed\n", label);
+		unlink(file);
+		return 1;
+	}
+
+	errors = check_sections(cal, img->data, img->size);
+	if ( errors )
+		fprintf(stderr, "%s: %d mismatches\n", label, errors);
+	else
+		printf("%s: %u sections as expected\n", label, cal->count);
+
+	/* Lookups go through the index, the image was scanned once at init */
+	for ( i = 0; i < cal->count && i < 8; i++ ) {
+		if ( cal_read_block(cal, cal->sections[i].name, &ptr, &len, 0) == 0 )
+			mem_free(ptr);
+	}
+	if ( cal_scan_count(cal) != 1 ) {
+		fprintf(stderr, "%s: %u scans after %u lookups, expected 1\n", label, cal_scan_count(cal), i);
+		errors++;
+	}
+
+	cal_finish(cal);
+	unlink(file);
+	free(img->data);
+	return errors;
+
+}
+
+int main(void) {
+
+	struct test_image img;
+	char name[16];
+	unsigned int i, version;
+	int errors = 0;
+
+	crc32_init();
+
+	errors += test_skip();
+
+	/* Sparse: few sections far apart, the last one ending the image */
+	image_start(&img, MAX_SIZE, 1);
+	for ( i = 0; i < 6; i++ ) {
+		snprintf(name, sizeof(name), "sparse-%u", i);
+		image_section(&img, name, 0, 16 + test_rand(&img) % 512);
+		image_gap(&img, 30000 + test_rand(&img) % 20000, 0);
+	}
+	img.pos = img.size - sizeof(struct header) - 100;
+	image_section(&img, "last", 0, 100);
+	errors += check_image("sparse", &img);
+
+	/* Dense: back to back sections in several versions */
+	image_start(&img, MAX_SIZE, 2);
+	for ( version = 0; version < 3; version++ ) {
+		for ( i = 0; i < 200; i++ ) {
+			snprintf(name, sizeof(name), "dense-%u", i);
+			image_section(&img, name, version, 1 + test_rand(&img) % 300);
+		}
+	}
+	errors += check_image("dense", &img);
+
+	/* Adversarial: gaps full of magic prefixes and broken erased words */
+	image_start(&img, MAX_SIZE, 3);
+	for ( version = 0; version < 4; version++ ) {
+		for ( i = 0; i < 8; i++ ) {
+			snprintf(name, sizeof(name), "adv-%u", i);
+			image_section(&img, name, version, test_rand(&img) % 700);
+			image_gap(&img, test_rand(&img) % 8192, test_rand(&img) % 2000);
+		}
+	}
+	errors += check_image("adversarial", &img);
+
+	/* A zero length section whose header is the last thing that fits */
+	image_start(&img, 4096, 4);
+	image_section(&img, "first", 0, 10);
+	img.pos = img.size - sizeof(struct header);
+	image_section(&img, "empty", 0, 0);
+	errors += check_image("tail", &img);
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,215 @@
+/*
+ * Streaming mode on a regular file with small erase blocks, so headers and
+ * payloads straddle the scan window: the indexed sections must match the
+ * mapped image and every payload must read back with a good CRC. Then bad
+ * erase blocks full of false headers, reported through MEMGETBADBLOCK, must
+ * be skipped.
+ */
+
+#include <stdarg.h>
+
+/* cal.c asks for bad blocks through ioctl(), answered here from a table */
+#define ioctl test_ioctl
+#include "../cal.c"
+#undef ioctl
+#include "image.h"
+
+/* sys/ioctl.h declared it under the other name */
+extern int ioctl(int fd, unsigned long request, ...);
+
+#define BLOCKS 128
+
+static uint32_t bad_erasesize;
+static uint8_t bad_blocks[BLOCKS];
+static unsigned int bad_queries;
+
+int test_ioctl(int fd, unsigned long request, ...) {
+
+	va_list ap;
+	void * arg;
+	loff_t block;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if ( request != MEMGETBADBLOCK )
+		return ioctl(fd, request, arg);
+
+	bad_queries++;
+	memcpy(&block, arg, sizeof(block));
+	if ( ! bad_erasesize || block % bad_erasesize != 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+	block /= bad_erasesize;
+	return block < BLOCKS && bad_blocks[block];
+
+}
+
+/* Every section of the handle reads back as in data, with a good CRC */
+static int check_payloads(struct cal * cal, const uint8_t * data) {
+
+	const void * ptr;
+	unsigned long len;
+	unsigned int i;
+	int errors = 0;
+
+	for ( i = 0; i < cal->count; i++ ) {
+		if ( cal_get_block_ref(cal, cal->sections[i].name, &ptr, &len, 0) != 0 ) {
+			fprintf(stderr, "section %s: read failed\n", cal->sections[i].name);
+			errors++;
+		} else if ( len != cal->sections[i].length || memcmp(ptr, data + cal->sections[i].offset + sizeof(struct header), len) != 0 ) {
+			fprintf(stderr, "section %s: payload differs\n", cal->sections[i].name);
+			errors++;
+		}
+	}
+
+	return errors;
+
+}
+
+static int test_windows(const char * file) {
+
+	static const uint32_t erasesizes[] = { 64, 100, 512, 4096, 65536 };
+	struct test_image img;
+	struct cal * cal;
+	char name[16];
+	unsigned int i, version, e;
+	int errors = 0, image;
+
+	for ( image = 0; image < 3; image++ ) {
+
+		image_start(&img, 96 * 1024, 10 + image);
+		for ( version = 0; version < 3; version++ ) {
+			for ( i = 0; i < 40; i++ ) {
+				snprintf(name, sizeof(name), "win-%u", i);
+				/* Payloads shorter and longer than the smallest blocks */
+				if ( image_section(&img, name, version, test_rand(&img) % (image == 0 ? 48 : 700)) < 0 )
+					break;
+				if ( image > 0 )
+					image_gap(&img, test_rand(&img) % 300, image == 2 ? test_rand(&img) % 40 : 0);
+			}
+		}
+		if ( image_write(&img, file) != 0 ) {
+			perror(file);
+			return 1;
+		}
+
+		for ( e = 0; e < sizeof(erasesizes)/sizeof(erasesizes[0]); e++ ) {
+			cal = stream_open(file, img.size, erasesizes[e]);
+			if ( ! cal ) {
+				fprintf(stderr, "image %d, erase size %u: scan failed\n", image, erasesizes[e]);
+				errors++;
+				continue;
+			}
+			if ( check_sections(cal, img.data, img.size) || check_payloads(cal, img.data) ) {
+				fprintf(stderr, "image %d, erase size %u: mismatch\n", image, erasesizes[e]);
+				errors++;
+			}
+			cal_finish(cal);
+		}
+
+		free(img.data);
+
+	}
+
+	return errors;
+
+}
+
+static int test_bad_blocks(const char * file) {
+
+	struct test_image img, expected;
+	struct header hdr;
+	struct cal * cal;
+	char name[16];
+	unsigned int block, i;
+	int errors = 0;
+
+	bad_erasesize = 512;
+	memset(bad_blocks, 0, sizeof(bad_blocks));
+	bad_blocks[0] = bad_blocks[5] = bad_blocks[6] = bad_blocks[40] = bad_blocks[BLOCKS - 1] = 1;
+
+	/* Sections in the good blocks, the bad ones hold false headers */
+	image_start(&img, BLOCKS * bad_erasesize, 20);
+	for ( block = 0; block < BLOCKS; block++ ) {
+		img.pos = block * bad_erasesize;
+		if ( bad_blocks[block] ) {
+			memset(&hdr, 0, sizeof(hdr));
+			memcpy(hdr.magic, HDR_MAGIC, sizeof(hdr.magic));
+			memcpy(hdr.name, "bad", 3);
+			hdr.length = 0xFFFFFFF0;
+			for ( i = 0; i + sizeof(hdr) <= bad_erasesize; i += sizeof(hdr) )
+				memcpy(img.data + img.pos + i, &hdr, sizeof(hdr));
+			continue;
+		}
+		snprintf(name, sizeof(name), "block-%u", block % 50);
+		image_section(&img, name, block / 50, test_rand(&img) % (bad_erasesize - sizeof(hdr)));
+	}
+	if ( image_write(&img, file) != 0 ) {
+		perror(file);
+		return 1;
+	}
+
+	/* What the reader should see: bad blocks erased */
+	expected = img;
+	expected.data = malloc(img.size);
+	memcpy(expected.data, img.data, img.size);
+	for ( block = 0; block < BLOCKS; block++ )
+		if ( bad_blocks[block] )
+			memset(expected.data + block * bad_erasesize, 0xFF, bad_erasesize);
+
+	bad_queries = 0;
+	cal = stream_open(file, img.size, bad_erasesize);
+	if ( ! cal ) {
+		fprintf(stderr, "bad blocks: scan failed\n");
+		errors++;
+	} else {
+		if ( bad_queries == 0 ) {
+			fprintf(stderr, "bad blocks: MEMGETBADBLOCK never asked\n");
+			errors++;
+		}
+		if ( find_section(cal, "bad") ) {
+			fprintf(stderr, "bad blocks: header from a bad block indexed\n");
+			errors++;
+		}
+		errors += check_sections(cal, expected.data, expected.size);
+		errors += check_payloads(cal, expected.data);
+		cal_finish(cal);
+	}
+
+	bad_erasesize = 0;
+	free(expected.data);
+	free(img.data);
+	return errors;
+
+}
+
+int main(void) {
+
+	char file[] = "/tmp/test-stream-XXXXXX";
+	int fd, errors = 0;
+
+	crc32_init();
+
+	fd = mkstemp(file);
+	if ( fd < 0 ) {
+		perror(file);
+		return 1;
+	}
+	close(fd);
+
+	errors += test_windows(file);
+	errors += test_bad_blocks(file);
+
+	unlink(file);
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
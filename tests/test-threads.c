@@ -0,0 +1,224 @@
+/*
+ * Concurrent first lookups on one handle, mapped and streamed: threads
+ * released together look up every section, good, corrupted and missing ones,
+ * and must all get what a single thread gets. In streaming mode they must
+ * also agree on one payload copy per section.
+ */
+
+#include <sched.h>
+#include <stdarg.h>
+
+/* cal.c asks for bad blocks through ioctl(), see test_ioctl() */
+#define ioctl test_ioctl
+#include "../cal.c"
+#undef ioctl
+#include "image.h"
+
+/* sys/ioctl.h declared it under the other name */
+extern int ioctl(int fd, unsigned long request, ...);
+
+#define THREADS 8
+#define ROUNDS 25
+#define SECTIONS 48
+
+struct expected {
+	char name[16];
+	int ret;
+	unsigned long len;
+	const uint8_t * payload;	/* In the image data */
+};
+
+static struct expected expected[SECTIONS + 1];
+static unsigned int nexpected;
+
+/*
+ * No bad blocks, but every streamed read gives the other threads a turn in
+ * the middle of a first lookup, also on a single CPU
+ */
+int test_ioctl(int fd, unsigned long request, ...) {
+
+	va_list ap;
+	void * arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if ( request != MEMGETBADBLOCK )
+		return ioctl(fd, request, arg);
+
+	sched_yield();
+	errno = ENOTTY;
+	return -1;
+
+}
+
+struct reader {
+	pthread_t thread;
+	unsigned int id;
+	struct cal * cal;
+	pthread_barrier_t * start;
+	const void * ptrs[SECTIONS + 1];
+	int errors;
+};
+
+static void * reader_run(void * arg) {
+
+	struct reader * reader = arg;
+	const void * ptr;
+	unsigned long len;
+	unsigned int i, n;
+	int ret;
+
+	pthread_barrier_wait(reader->start);
+
+	/* Half of the threads go backwards, so they race on every section */
+	for ( n = 0; n < nexpected; n++ ) {
+		i = reader->id % 2 ? nexpected - 1 - n : n;
+		ptr = NULL;
+		ret = cal_get_block_ref(reader->cal, expected[i].name, &ptr, &len, 0);
+		reader->ptrs[i] = ptr;
+		if ( ret != expected[i].ret ) {
+			fprintf(stderr, "thread %u, %s: returned %d instead of %d\n", reader->id, expected[i].name, ret, expected[i].ret);
+			reader->errors++;
+		} else if ( ret == 0 && (len != expected[i].len || memcmp(ptr, expected[i].payload, len) != 0) ) {
+			fprintf(stderr, "thread %u, %s: payload differs\n", reader->id, expected[i].name);
+			reader->errors++;
+		}
+	}
+
+	return NULL;
+
+}
+
+static int race(struct cal * cal, const char * mode) {
+
+	struct reader readers[THREADS];
+	pthread_barrier_t start;
+	unsigned int t, i;
+	int errors = 0;
+
+	pthread_barrier_init(&start, NULL, THREADS);
+
+	for ( t = 0; t < THREADS; t++ ) {
+		memset(&readers[t], 0, sizeof(readers[t]));
+		readers[t].id = t;
+		readers[t].cal = cal;
+		readers[t].start = &start;
+		if ( pthread_create(&readers[t].thread, NULL, reader_run, &readers[t]) != 0 ) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	for ( t = 0; t < THREADS; t++ ) {
+		pthread_join(readers[t].thread, NULL);
+		errors += readers[t].errors;
+	}
+
+	pthread_barrier_destroy(&start);
+
+	/* One copy per section, the one the handle keeps */
+	for ( t = 1; t < THREADS; t++ ) {
+		for ( i = 0; i < nexpected; i++ ) {
+			if ( readers[t].ptrs[i] != readers[0].ptrs[i] ) {
+				fprintf(stderr, "%s, %s: threads got different copies\n", mode, expected[i].name);
+				errors++;
+			}
+		}
+	}
+
+	return errors;
+
+}
+
+int main(void) {
+
+	char file[] = "/tmp/test-threads-XXXXXX";
+	struct test_image img;
+	struct cal * cal;
+	const void * ptr;
+	unsigned long len;
+	unsigned int i, round;
+	int64_t offset;
+	int fd, errors = 0;
+
+	fd = mkstemp(file);
+	if ( fd < 0 ) {
+		perror(file);
+		return 1;
+	}
+	close(fd);
+
+	/* Two versions of every section, every fifth latest one corrupted */
+	image_start(&img, 128 * 1024, 30);
+	for ( round = 0; round < 2; round++ ) {
+		for ( i = 0; i < SECTIONS; i++ ) {
+			snprintf(expected[i].name, sizeof(expected[i].name), "thread-%u", i);
+			offset = image_section(&img, expected[i].name, round, 1 + test_rand(&img) % 1500);
+			if ( offset < 0 ) {
+				fprintf(stderr, "image too small\n");
+				return 1;
+			}
+			image_gap(&img, test_rand(&img) % 64, 0);
+			if ( round == 1 && i % 5 == 0 )
+				img.data[offset + sizeof(struct header)] ^= 0x01;
+		}
+	}
+	if ( image_write(&img, file) != 0 ) {
+		perror(file);
+		return 1;
+	}
+
+	strcpy(expected[SECTIONS].name, "missing");
+	nexpected = SECTIONS + 1;
+
+	/* What one thread gets from the mapped image */
+	if ( cal_init_file(file, &cal) != 0 || ! cal->mapped ) {
+		fprintf(stderr, "cannot map %s\n", file);
+		return 1;
+	}
+	for ( i = 0; i < nexpected; i++ ) {
+		expected[i].ret = cal_get_block_ref(cal, expected[i].name, &ptr, &len, 0);
+		if ( expected[i].ret == 0 ) {
+			expected[i].len = len;
+			expected[i].payload = img.data + ((const uint8_t *)ptr - (const uint8_t *)cal->mem);
+		}
+		if ( (expected[i].ret == 0) != (i < SECTIONS && i % 5 != 0) ) {
+			fprintf(stderr, "%s: returned %d single threaded\n", expected[i].name, expected[i].ret);
+			errors++;
+		}
+	}
+	cal_finish(cal);
+
+	for ( round = 0; round < ROUNDS; round++ ) {
+
+		if ( cal_init_file(file, &cal) != 0 ) {
+			fprintf(stderr, "round %u: cannot open %s\n", round, file);
+			return 1;
+		}
+		errors += race(cal, "mapped");
+		cal_finish(cal);
+
+		/* Erase blocks smaller than most payloads, so the window moves a lot */
+		cal = stream_open(file, img.size, round % 2 ? 512 : 4096);
+		if ( ! cal ) {
+			fprintf(stderr, "round %u: cannot stream %s\n", round, file);
+			return 1;
+		}
+		errors += race(cal, "streamed");
+		cal_finish(cal);
+
+	}
+
+	free(img.data);
+	unlink(file);
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,115 @@
+#!/bin/sh
+# wl1251-cal --uevent against a fake sysfs tree: a request pending at startup
+# and a broadcast NVS request must get the NVS of a normal run, with loading
+# 1 then 0. Other firmware, other actions and events not sent by root must be
+# left alone, and a request whose data cannot be written must be aborted
+# with -1. Skipped where uevents cannot be broadcast. The events name device
+# paths that do not exist, so other listeners like udev ignore them.
+
+dir=$(mktemp -d) || exit 1
+pid=
+
+cleanup() {
+	[ -n "$pid" ] && kill $pid 2> /dev/null
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+if ! tests/uevent-inject change /wl1251-cal-test SUBSYSTEM=wl1251-cal-test; then
+	[ $? -eq 77 ] && echo "cannot broadcast uevents" && exit 77
+	exit 1
+fi
+
+tests/gencal --wl1251 "$dir/cal.img" || exit 1
+
+# What a normal run pushes
+: > "$dir/loading"
+: > "$dir/expected"
+./wl1251-cal --cal-image="$dir/cal.img" --no-cache --nvs-loading="$dir/loading" \
+	--nvs-push-data="$dir/expected" > "$dir/out" 2>&1 || { cat "$dir/out"; exit 1; }
+[ -s "$dir/expected" ] || { echo "no NVS pushed by a normal run"; exit 1; }
+
+sys="$dir/sys"
+
+# request NAME, an empty firmware request directory below the fake sysfs
+request() {
+	mkdir -p "$sys$1" && : > "$sys$1/loading" && : > "$sys$1/data"
+}
+
+# answered NAME, waits up to 5 s for the request to be reported answered
+answered() {
+	i=0
+	while ! grep -qF "Answered firmware request $sys$1" "$dir/uevent"; do
+		i=$((i + 1))
+		[ $i -gt 100 ] && return 1
+		sleep 0.05
+	done
+}
+
+check() {
+	if [ "$(cat "$sys$1/loading")" != "$2" ]; then
+		echo "$1: loading is \"$(cat "$sys$1/loading")\" instead of \"$2\""
+		exit 1
+	fi
+	if [ "$2" = 0 ] && ! cmp -s "$sys$1/data" "$dir/expected"; then
+		echo "$1: data differs from a normal run"
+		exit 1
+	fi
+}
+
+untouched() {
+	if [ -s "$sys$1/loading" ] || [ -s "$sys$1/data" ]; then
+		echo "$1: answered"
+		exit 1
+	fi
+}
+
+pending=/class/firmware/wl1251-nvs.bin
+nvs=/devices/platform/wl1251/firmware/ti-connectivity!wl1251-nvs.bin
+other=/devices/platform/other/firmware/other.bin
+remove=/devices/platform/remove/firmware/wl1251-nvs.bin
+user=/devices/platform/user/firmware/wl1251-nvs.bin
+broken=/devices/platform/broken/firmware/wl1251-nvs.bin
+
+request $pending
+request $nvs
+request $other
+request $remove
+request $user
+mkdir -p "$sys$broken" && : > "$sys$broken/loading" && mkdir "$sys$broken/data"
+
+./wl1251-cal --cal-image="$dir/cal.img" --no-cache --uevent --sysfs-root="$sys" > "$dir/uevent" 2>&1 &
+pid=$!
+
+i=0
+while ! grep -q "Waiting for firmware requests" "$dir/uevent"; do
+	i=$((i + 1))
+	if [ $i -gt 100 ] || ! kill -0 $pid 2> /dev/null; then
+		cat "$dir/uevent"
+		echo "wl1251-cal --uevent did not start"
+		exit 1
+	fi
+	sleep 0.05
+done
+
+check $pending 0
+
+# Events are handled in order, so the last one being answered means the others were seen
+tests/uevent-inject add $other SUBSYSTEM=firmware FIRMWARE=other.bin || exit 1
+tests/uevent-inject remove $remove SUBSYSTEM=firmware FIRMWARE=wl1251-nvs.bin || exit 1
+tests/uevent-inject --uid=1000 add $user SUBSYSTEM=firmware FIRMWARE=wl1251-nvs.bin || exit 1
+tests/uevent-inject add $broken SUBSYSTEM=firmware FIRMWARE=wl1251-nvs.bin || exit 1
+tests/uevent-inject add $nvs SUBSYSTEM=firmware FIRMWARE=ti-connectivity/wl1251-nvs.bin || exit 1
+
+if ! answered $nvs; then
+	cat "$dir/uevent"
+	echo "$nvs: not answered"
+	exit 1
+fi
+cat "$dir/uevent"
+
+check $nvs 0
+check $broken -1
+untouched $other
+untouched $remove
+untouched $user
@@ -0,0 +1,161 @@
+/*
+ * cal_write_block() on a mapped image, on a private copy of it like when
+ * mmap() fails, and streamed: a block must read back from the file, and a
+ * write that does not land as meant must fail without the handle or its
+ * private copy showing the new block. The same goes for a compaction.
+ */
+
+/* Writes to the image go through test_pwrite(), which can corrupt them */
+#define pwrite test_pwrite
+#include "../cal.c"
+#undef pwrite
+#include "image.h"
+
+/* unistd.h declared it under the other name */
+extern ssize_t pwrite(int fd, const void * buf, size_t len, off_t offset);
+
+static int corrupt;
+
+ssize_t test_pwrite(int fd, const void * buf, size_t len, off_t offset) {
+
+	uint8_t copy[4096];
+	size_t n = len < sizeof(copy) ? len : sizeof(copy);
+
+	if ( ! corrupt )
+		return pwrite(fd, buf, len, offset);
+
+	/* A bit that did not program, in the payload */
+	memcpy(copy, buf, n);
+	copy[n - 1] ^= 0x01;
+	return pwrite(fd, copy, n, offset);
+
+}
+
+/* The private copy cal_init_file() reads when the image cannot be mapped */
+static void make_private(struct cal * cal) {
+
+	void * copy = mem_alloc(cal->size);
+
+	if ( ! copy ) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(copy, cal->mem, cal->size);
+	munmap(cal->mem, cal->size);
+	cal->mem = copy;
+	cal->mapped = 0;
+
+}
+
+static int test_mode(const char * file, const char * mode) {
+
+	static const char good[] = "written as meant";
+	static const char bad[] = "written with a flipped bit";
+	struct cal_compact_stats stats;
+	struct test_image img;
+	struct cal * cal;
+	uint8_t * copy;
+	const void * ptr;
+	unsigned long len;
+	int64_t tail;
+	int errors = 0;
+
+	image_start(&img, 16 * 1024, 40);
+	image_section(&img, "before", 0, 100);
+	image_section(&img, "write", 0, 200);
+	if ( image_write(&img, file) != 0 ) {
+		perror(file);
+		return 1;
+	}
+
+	if ( strcmp(mode, "streamed") == 0 ) {
+		cal = stream_open(file, img.size, 4096);
+	} else if ( cal_init_file(file, &cal) != 0 ) {
+		cal = NULL;
+	} else if ( strcmp(mode, "private") == 0 ) {
+		make_private(cal);
+	}
+	free(img.data);
+	if ( ! cal ) {
+		fprintf(stderr, "%s: cannot open %s\n", mode, file);
+		return 1;
+	}
+
+	if ( cal_write_block(cal, "write", good, sizeof(good), 0) != 0 ) {
+		fprintf(stderr, "%s: good write failed\n", mode);
+		errors++;
+	} else if ( cal_get_block_ref(cal, "write", &ptr, &len, 0) != 0 || len != sizeof(good) || memcmp(ptr, good, len) != 0 ) {
+		fprintf(stderr, "%s: good write does not read back\n", mode);
+		errors++;
+	}
+
+	tail = cal->tail;
+	corrupt = 1;
+	if ( cal_write_block(cal, "write", bad, sizeof(bad), 0) == 0 ) {
+		fprintf(stderr, "%s: corrupted write succeeded\n", mode);
+		errors++;
+	}
+	corrupt = 0;
+
+	if ( cal->tail != tail || cal_get_block_ref(cal, "write", &ptr, &len, 0) != 0 || len != sizeof(good) || memcmp(ptr, good, len) != 0 ) {
+		fprintf(stderr, "%s: handle changed by the corrupted write\n", mode);
+		errors++;
+	}
+	if ( cal->mem && ! cal->mapped && ((const uint8_t *)cal->mem)[tail] != 0xFF ) {
+		fprintf(stderr, "%s: private copy changed by the corrupted write\n", mode);
+		errors++;
+	}
+
+	/* Drops the first version of "write", MTD erases are not answered here */
+	if ( cal->fd < 0 ) {
+		copy = malloc(cal->size);
+		if ( ! copy ) {
+			perror("malloc");
+			exit(1);
+		}
+		memcpy(copy, cal->mem, cal->size);
+		corrupt = 1;
+		if ( cal_compact(cal, &stats) == 0 ) {
+			fprintf(stderr, "%s: corrupted compaction succeeded\n", mode);
+			errors++;
+		}
+		corrupt = 0;
+		if ( ! cal->mapped && memcmp(copy, cal->mem, cal->size) != 0 ) {
+			fprintf(stderr, "%s: private copy changed by the corrupted compaction\n", mode);
+			errors++;
+		}
+		free(copy);
+	}
+
+	cal_finish(cal);
+
+	return errors;
+
+}
+
+int main(void) {
+
+	char file[] = "/tmp/test-write-XXXXXX";
+	int fd, errors = 0;
+
+	fd = mkstemp(file);
+	if ( fd < 0 ) {
+		perror(file);
+		return 1;
+	}
+	close(fd);
+
+	errors += test_mode(file, "mapped");
+	errors += test_mode(file, "private");
+	errors += test_mode(file, "streamed");
+
+	unlink(file);
+
+	if ( errors ) {
+		fprintf(stderr, "%d errors\n", errors);
+		return 1;
+	}
+
+	return 0;
+
+}
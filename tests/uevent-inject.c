@@ -0,0 +1,94 @@
+/*
+ * Broadcast a kernel style uevent to the listeners of the uevent netlink
+ * socket, for testing wl1251-cal --uevent.
+ *
+ * Usage: uevent-inject [--uid=N] ACTION DEVPATH [KEY=VALUE]...
+ *
+ * ACTION and DEVPATH also go into the payload as ACTION= and DEVPATH=, like
+ * the kernel sends them. --uid sends the event with other credentials than
+ * root's. Exits with 77 if broadcasting uevents is not permitted here.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_nl addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct ucred cred;
+	char control[CMSG_SPACE(sizeof(struct ucred))];
+	char buf[4096];
+	size_t len = 0;
+	int first = 1;
+	int ret;
+	int fd;
+	int i;
+
+	cred.pid = getpid();
+	cred.uid = getuid();
+	cred.gid = getgid();
+
+	if (argc > first && strncmp(argv[first], "--uid=", 6) == 0)
+		cred.uid = atoi(argv[first++] + 6);
+
+	if (argc - first < 2) {
+		fprintf(stderr, "Usage: %s [--uid=N] ACTION DEVPATH [KEY=VALUE]...\n", argv[0]);
+		return 1;
+	}
+
+	ret = snprintf(buf, sizeof(buf), "%s@%s%cACTION=%s%cDEVPATH=%s", argv[first], argv[first + 1], 0, argv[first], 0, argv[first + 1]);
+	len = ret + 1;
+	for (i = first + 2; i < argc && ret > 0 && len < sizeof(buf); i++) {
+		ret = snprintf(buf + len, sizeof(buf) - len, "%s", argv[i]);
+		len += ret + 1;
+	}
+	if (ret < 0 || len > sizeof(buf)) {
+		fprintf(stderr, "uevent-inject: event too long\n");
+		return 1;
+	}
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		perror("uevent-inject: Cannot open uevent socket");
+		return errno == EPERM || errno == EACCES || errno == EAFNOSUPPORT || errno == EPROTONOSUPPORT ? 77 : 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_CREDENTIALS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(cred));
+	memcpy(CMSG_DATA(cmsg), &cred, sizeof(cred));
+
+	if (sendmsg(fd, &msg, 0) < 0) {
+		perror("uevent-inject: Cannot send uevent");
+		close(fd);
+		return errno == EPERM || errno == EACCES ? 77 : 1;
+	}
+
+	close(fd);
+	return 0;
+}
@@ -18,17 +18,31 @@
   Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <time.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 
+#include <linux/netlink.h>
 #include <net/if.h>
 #include <net/if_arp.h>
 
@@ -37,18 +51,54 @@
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
 #include <linux/nl80211.h>
+#include <linux/rtnetlink.h>
+#include <poll.h>
 #endif
 
 #ifdef WITH_DBUS
 #include <dbus/dbus.h>
 #endif
 
+#ifdef WITH_DLOPEN
+#include <dlfcn.h>
+#endif
+
+#ifdef WITH_SDT
+#include <sys/sdt.h>
+#endif
+
 #ifdef WITH_LIBCAL
 #include <cal.h>
 #else
 #include "cal.h"
 #endif
 
+#include "mcc-table.h"
+
+#ifdef WITH_STATIC_ARENA
+#if defined(WITH_LIBCAL) || defined(WITH_DBUS) || defined(WITH_LIBNL)
+#error "WITH_STATIC_ARENA needs the bundled cal.c and works without DBus and libnl"
+#endif
+/* NVS buffers share the fixed CAL arena, nothing on the push path uses the heap */
+#define wl1251_alloc(size) cal_alloc(size)
+#define wl1251_free(ptr) cal_free(ptr)
+#else
+#define wl1251_alloc(size) malloc(size)
+#define wl1251_free(ptr) free(ptr)
+#endif
+
+/* USDT probes of the wl1251 provider, wl1251-cal.bt turns them into a per-boot breakdown */
+#ifdef WITH_SDT
+#define WL1251_PROBE(name, ...) STAP_PROBEV(wl1251, name, ##__VA_ARGS__)
+#else
+#define WL1251_PROBE(name, ...) do { } while (0)
+#endif
+
+/* --daemon needs the bus and netlink, or the fakes standing in for both */
+#if (defined(WITH_DBUS) && defined(WITH_LIBNL)) || defined(WITH_FAKE)
+#define WL1251_DAEMON
+#endif
+
 #ifdef WITH_LIBNL1
 #define nl_sock nl_handle
 #define nl_socket_alloc nl_handle_alloc
@@ -56,6 +106,236 @@
 #define nl_perror(error, s) nl_perror(s)
 #endif
 
+#ifdef WITH_DLOPEN
+
+#ifdef WITH_LIBNL1
+#error "WITH_DLOPEN needs libnl-2.0 or libnl-3.0"
+#endif
+
+#ifndef WL1251_LIBDBUS_SONAME
+#define WL1251_LIBDBUS_SONAME "libdbus-1.so.3"
+#endif
+
+/* libdbus default, only DBUS_SYSTEM_BUS_ADDRESS overrides it */
+#define WL1251_DBUS_SYSTEM_SOCKET "/var/run/dbus/system_bus_socket"
+
+#ifndef WL1251_LIBNL_GENL_SONAME
+#define WL1251_LIBNL_GENL_SONAME "libnl-genl-3.so.200"
+#endif
+
+/*
+ * libdbus and libnl are not linked, the first phase which needs one of them
+ * loads it with wl1251_dl_dbus_load() or wl1251_dl_nl_load(). Calls go
+ * through a table filled by dlsym(), the defines below point them there.
+ * libnl is only loaded after the NVS is pushed to sysfs and libdbus not at
+ * all while there is no system bus.
+ */
+#define WL1251_DL_DBUS(F) \
+	F(dbus_bus_add_match) \
+	F(dbus_bus_get) \
+	F(dbus_connection_pop_message) \
+	F(dbus_connection_read_write) \
+	F(dbus_connection_read_write_dispatch) \
+	F(dbus_connection_send_with_reply) \
+	F(dbus_connection_unref) \
+	F(dbus_error_free) \
+	F(dbus_error_init) \
+	F(dbus_error_is_set) \
+	F(dbus_message_get_args) \
+	F(dbus_message_get_type) \
+	F(dbus_message_is_signal) \
+	F(dbus_message_iter_get_arg_type) \
+	F(dbus_message_iter_get_basic) \
+	F(dbus_message_iter_init) \
+	F(dbus_message_iter_next) \
+	F(dbus_message_iter_recurse) \
+	F(dbus_message_new_method_call) \
+	F(dbus_message_unref) \
+	F(dbus_pending_call_cancel) \
+	F(dbus_pending_call_get_completed) \
+	F(dbus_pending_call_steal_reply) \
+	F(dbus_pending_call_unref) \
+	F(dbus_set_error_from_message)
+
+#define WL1251_DL_LIBNL(F) \
+	F(genl_connect) \
+	F(genl_ctrl_resolve) \
+	F(genlmsg_put) \
+	F(nl_cb_alloc) \
+	F(nl_cb_err) \
+	F(nl_cb_put) \
+	F(nl_cb_set) \
+	F(nl_connect) \
+	F(nl_perror) \
+	F(nl_recvmsgs) \
+	F(nl_send_auto_complete) \
+	F(nl_socket_alloc) \
+	F(nl_socket_free) \
+	F(nl_socket_get_fd) \
+	F(nla_put) \
+	F(nlmsg_alloc) \
+	F(nlmsg_alloc_simple) \
+	F(nlmsg_append) \
+	F(nlmsg_free) \
+	F(nlmsg_hdr)
+
+/* Nothing to load without either library */
+#if defined(WITH_DBUS) || defined(WITH_LIBNL)
+
+#define WL1251_DL_MEMBER(name) __typeof__(name) *dl_##name;
+
+static struct {
+#ifdef WITH_DBUS
+	WL1251_DL_DBUS(WL1251_DL_MEMBER)
+#endif
+#ifdef WITH_LIBNL
+	WL1251_DL_LIBNL(WL1251_DL_MEMBER)
+#endif
+} wl1251_dl;
+
+#ifdef WITH_DBUS
+#define dbus_bus_add_match (wl1251_dl.dl_dbus_bus_add_match)
+#define dbus_bus_get (wl1251_dl.dl_dbus_bus_get)
+#define dbus_connection_pop_message (wl1251_dl.dl_dbus_connection_pop_message)
+#define dbus_connection_read_write (wl1251_dl.dl_dbus_connection_read_write)
+#define dbus_connection_read_write_dispatch (wl1251_dl.dl_dbus_connection_read_write_dispatch)
+#define dbus_connection_send_with_reply (wl1251_dl.dl_dbus_connection_send_with_reply)
+#define dbus_connection_unref (wl1251_dl.dl_dbus_connection_unref)
+#define dbus_error_free (wl1251_dl.dl_dbus_error_free)
+#define dbus_error_init (wl1251_dl.dl_dbus_error_init)
+#define dbus_error_is_set (wl1251_dl.dl_dbus_error_is_set)
+#define dbus_message_get_args (wl1251_dl.dl_dbus_message_get_args)
+#define dbus_message_get_type (wl1251_dl.dl_dbus_message_get_type)
+#define dbus_message_is_signal (wl1251_dl.dl_dbus_message_is_signal)
+#define dbus_message_iter_get_arg_type (wl1251_dl.dl_dbus_message_iter_get_arg_type)
+#define dbus_message_iter_get_basic (wl1251_dl.dl_dbus_message_iter_get_basic)
+#define dbus_message_iter_init (wl1251_dl.dl_dbus_message_iter_init)
+#define dbus_message_iter_next (wl1251_dl.dl_dbus_message_iter_next)
+#define dbus_message_iter_recurse (wl1251_dl.dl_dbus_message_iter_recurse)
+#define dbus_message_new_method_call (wl1251_dl.dl_dbus_message_new_method_call)
+#define dbus_message_unref (wl1251_dl.dl_dbus_message_unref)
+#define dbus_pending_call_cancel (wl1251_dl.dl_dbus_pending_call_cancel)
+#define dbus_pending_call_get_completed (wl1251_dl.dl_dbus_pending_call_get_completed)
+#define dbus_pending_call_steal_reply (wl1251_dl.dl_dbus_pending_call_steal_reply)
+#define dbus_pending_call_unref (wl1251_dl.dl_dbus_pending_call_unref)
+#define dbus_set_error_from_message (wl1251_dl.dl_dbus_set_error_from_message)
+#endif
+
+#ifdef WITH_LIBNL
+#define genl_connect (wl1251_dl.dl_genl_connect)
+#define genl_ctrl_resolve (wl1251_dl.dl_genl_ctrl_resolve)
+#define genlmsg_put (wl1251_dl.dl_genlmsg_put)
+#define nl_cb_alloc (wl1251_dl.dl_nl_cb_alloc)
+#define nl_cb_err (wl1251_dl.dl_nl_cb_err)
+#define nl_cb_put (wl1251_dl.dl_nl_cb_put)
+#define nl_cb_set (wl1251_dl.dl_nl_cb_set)
+#define nl_connect (wl1251_dl.dl_nl_connect)
+#define nl_perror (wl1251_dl.dl_nl_perror)
+#define nl_recvmsgs (wl1251_dl.dl_nl_recvmsgs)
+#define nl_send_auto_complete (wl1251_dl.dl_nl_send_auto_complete)
+#define nl_socket_alloc (wl1251_dl.dl_nl_socket_alloc)
+#define nl_socket_free (wl1251_dl.dl_nl_socket_free)
+#define nl_socket_get_fd (wl1251_dl.dl_nl_socket_get_fd)
+#define nla_put (wl1251_dl.dl_nla_put)
+#define nlmsg_alloc (wl1251_dl.dl_nlmsg_alloc)
+#define nlmsg_alloc_simple (wl1251_dl.dl_nlmsg_alloc_simple)
+#define nlmsg_append (wl1251_dl.dl_nlmsg_append)
+#define nlmsg_free (wl1251_dl.dl_nlmsg_free)
+#define nlmsg_hdr (wl1251_dl.dl_nlmsg_hdr)
+#endif
+
+static void *wl1251_dl_open(const char *soname)
+{
+	void *handle;
+
+	handle = dlopen(soname, RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
+		fprintf(stderr, "wl1251-cal: Cannot load %s\n", dlerror());
+	return handle;
+}
+
+static void *wl1251_dl_sym(void *handle, const char *name, int *missing)
+{
+	void *sym;
+
+	sym = dlsym(handle, name);
+	if (!sym) {
+		fprintf(stderr, "wl1251-cal: Cannot resolve %s\n", name);
+		*missing = 1;
+	}
+	return sym;
+}
+
+#define WL1251_DL_SYM(name) wl1251_dl.dl_##name = wl1251_dl_sym(handle, #name, &missing);
+
+#endif
+
+#ifdef WITH_DBUS
+
+static pthread_once_t wl1251_dl_dbus_once = PTHREAD_ONCE_INIT;
+static int wl1251_dl_dbus_ok;
+
+static void wl1251_dl_dbus_open(void)
+{
+	void *handle;
+	int missing = 0;
+
+	/* Early in boot there is no bus yet and nothing to load libdbus for */
+	if (!getenv("DBUS_SYSTEM_BUS_ADDRESS") && access(WL1251_DBUS_SYSTEM_SOCKET, F_OK) != 0) {
+		fprintf(stderr, "wl1251-cal: No dbus system bus, not loading " WL1251_LIBDBUS_SONAME "\n");
+		return;
+	}
+
+	handle = wl1251_dl_open(WL1251_LIBDBUS_SONAME);
+	if (!handle)
+		return;
+
+	WL1251_DL_DBUS(WL1251_DL_SYM)
+	wl1251_dl_dbus_ok = !missing;
+}
+
+static int wl1251_dl_dbus_load(void)
+{
+	pthread_once(&wl1251_dl_dbus_once, wl1251_dl_dbus_open);
+	return wl1251_dl_dbus_ok ? 0 : -1;
+}
+
+#endif
+
+#ifdef WITH_LIBNL
+
+static pthread_once_t wl1251_dl_nl_once = PTHREAD_ONCE_INIT;
+static int wl1251_dl_nl_ok;
+
+/* libnl-genl pulls in libnl, dlsym() finds both through its handle */
+static void wl1251_dl_nl_open(void)
+{
+	void *handle;
+	int missing = 0;
+
+	handle = wl1251_dl_open(WL1251_LIBNL_GENL_SONAME);
+	if (!handle)
+		return;
+
+	WL1251_DL_LIBNL(WL1251_DL_SYM)
+	wl1251_dl_nl_ok = !missing;
+}
+
+static int wl1251_dl_nl_load(void)
+{
+	pthread_once(&wl1251_dl_nl_once, wl1251_dl_nl_open);
+	return wl1251_dl_nl_ok ? 0 : -1;
+}
+
+#endif
+
+#else
+
+#define wl1251_dl_dbus_load() 0
+#define wl1251_dl_nl_load() 0
+
+#endif
+
 #ifdef WITH_WL1251_NL
 
 #define WL1251_NL_NAME "wl1251"
@@ -91,11 +371,211 @@ enum wl1251_nl_attrs {
 
 #endif
 
-struct code_domain {
-	int country_code;
-	char regdomain[3];
+#define WL1251_TIMING_MAX_PHASES 16
+#define WL1251_TIMING_LOG_RUNS 64
+
+struct wl1251_phase {
+	const char *name;
+	double ms;		/* CLOCK_MONOTONIC duration */
+	long minflt;		/* Minor page faults */
+	long majflt;		/* Major page faults */
+	long maxrss_kb;		/* Growth of peak RSS */
 };
 
+static struct wl1251_timings {
+	int enabled;
+	int json;
+	struct timespec start;
+	struct timespec last;
+	struct rusage last_usage;
+	unsigned int count;
+	struct wl1251_phase phases[WL1251_TIMING_MAX_PHASES];
+} timings;
+
+static double wl1251_timespec_ms(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000.0 + (b->tv_nsec - a->tv_nsec) / 1000000.0;
+}
+
+static void wl1251_timing_start(void)
+{
+	WL1251_PROBE(start);
+	clock_gettime(CLOCK_MONOTONIC, &timings.start);
+	timings.last = timings.start;
+	getrusage(RUSAGE_SELF, &timings.last_usage);
+}
+
+/* Close the current phase, everything since the previous mark is charged to name */
+static void wl1251_timing_mark(const char *name)
+{
+	struct wl1251_phase *phase;
+	struct timespec now;
+	struct rusage usage;
+
+	WL1251_PROBE(phase, name);
+
+	if (!timings.enabled || timings.count >= WL1251_TIMING_MAX_PHASES)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &usage);
+
+	phase = &timings.phases[timings.count++];
+	phase->name = name;
+	phase->ms = wl1251_timespec_ms(&timings.last, &now);
+	phase->minflt = usage.ru_minflt - timings.last_usage.ru_minflt;
+	phase->majflt = usage.ru_majflt - timings.last_usage.ru_majflt;
+	phase->maxrss_kb = usage.ru_maxrss - timings.last_usage.ru_maxrss;
+
+	timings.last = now;
+	timings.last_usage = usage;
+}
+
+/* Record a phase that ran concurrently and was timed by its owner */
+static void wl1251_timing_add(const char *name, double ms)
+{
+	struct wl1251_phase *phase;
+
+	if (!timings.enabled || timings.count >= WL1251_TIMING_MAX_PHASES)
+		return;
+
+	phase = &timings.phases[timings.count++];
+	memset(phase, 0, sizeof(*phase));
+	phase->name = name;
+	phase->ms = ms;
+}
+
+static void wl1251_timing_json(FILE *stream)
+{
+	unsigned int i;
+
+	fprintf(stream, "{\"total_ms\":%.3f,\"phases\":[", wl1251_timespec_ms(&timings.start, &timings.last));
+	for (i = 0; i < timings.count; i++)
+		fprintf(stream, "%s{\"name\":\"%s\",\"ms\":%.3f,\"minflt\":%ld,\"majflt\":%ld,\"maxrss_kb\":%ld}",
+			i ? "," : "", timings.phases[i].name, timings.phases[i].ms,
+			timings.phases[i].minflt, timings.phases[i].majflt, timings.phases[i].maxrss_kb);
+	fprintf(stream, "]}\n");
+}
+
+static void wl1251_timing_print(void)
+{
+	unsigned int i;
+
+	if (!timings.enabled)
+		return;
+
+	if (timings.json) {
+		wl1251_timing_json(stdout);
+		return;
+	}
+
+	printf("wl1251-cal: %-10s %10s %8s %8s %10s\n", "phase", "ms", "minflt", "majflt", "maxrss_kb");
+	for (i = 0; i < timings.count; i++)
+		printf("wl1251-cal: %-10s %10.3f %8ld %8ld %10ld\n", timings.phases[i].name, timings.phases[i].ms,
+			timings.phases[i].minflt, timings.phases[i].majflt, timings.phases[i].maxrss_kb);
+	printf("wl1251-cal: %-10s %10.3f\n", "total", wl1251_timespec_ms(&timings.start, &timings.last));
+}
+
+/*
+ * Append this run as one JSON line, keeping only the last WL1251_TIMING_LOG_RUNS
+ * runs. The log is rewritten to a temporary file that replaces it once synced,
+ * so an interrupted run leaves the previous log intact.
+ */
+static void wl1251_timing_log(const char *file)
+{
+	FILE *stream;
+	char tmp[PATH_MAX];
+	char *buf = NULL;
+	char *start;
+	size_t len = 0;
+	size_t alloc = 0;
+	size_t ret;
+	unsigned int lines = 0;
+	int err;
+
+	if (!timings.enabled || !file)
+		return;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+		fprintf(stderr, "wl1251-cal: Timings log path %s is too long\n", file);
+		return;
+	}
+
+	stream = fopen(file, "r");
+	if (!stream && errno != ENOENT) {
+		fprintf(stderr, "wl1251-cal: Cannot open timings log %s: %s\n", file, strerror(errno));
+		return;
+	}
+
+	if (stream) {
+		do {
+			if (len == alloc) {
+				alloc = alloc ? alloc * 2 : 4096;
+				start = realloc(buf, alloc);
+				if (!start) {
+					fprintf(stderr, "wl1251-cal: Cannot read timings log %s: Out of memory\n", file);
+					fclose(stream);
+					free(buf);
+					return;
+				}
+				buf = start;
+			}
+			ret = fread(buf + len, 1, alloc - len, stream);
+			len += ret;
+		} while (ret > 0);
+
+		err = ferror(stream);
+		fclose(stream);
+		if (err) {
+			fprintf(stderr, "wl1251-cal: Cannot read timings log %s\n", file);
+			free(buf);
+			return;
+		}
+	}
+
+	start = buf;
+	for (ret = 0; ret < len; ret++)
+		if (buf[ret] == '\n')
+			lines++;
+	while (start && lines >= WL1251_TIMING_LOG_RUNS) {
+		start = memchr(start, '\n', buf + len - start);
+		if (!start)
+			break;
+		start++;
+		lines--;
+	}
+
+	stream = fopen(tmp, "w");
+	if (!stream) {
+		fprintf(stderr, "wl1251-cal: Cannot create timings log %s: %s\n", tmp, strerror(errno));
+		free(buf);
+		return;
+	}
+
+	if (start)
+		fwrite(start, 1, buf + len - start, stream);
+	free(buf);
+
+	wl1251_timing_json(stream);
+
+	if (fflush(stream) != 0 || ferror(stream) || fsync(fileno(stream)) != 0) {
+		fprintf(stderr, "wl1251-cal: Cannot write timings log %s: %s\n", tmp, strerror(errno));
+		fclose(stream);
+		unlink(tmp);
+		return;
+	}
+
+	if (fclose(stream) != 0 || rename(tmp, file) != 0) {
+		fprintf(stderr, "wl1251-cal: Cannot replace timings log %s: %s\n", file, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+#define WL1251_NL_TIMEOUT 2000
+
+/* Whole country code lookup, csd and oFono are asked at the same time */
+#define WL1251_COUNTRY_CODE_TIMEOUT 2000
+
 static int wl1251_set_mac_address(char *iface, unsigned char *address)
 {
 	struct ifreq ifr;
@@ -136,20 +616,129 @@ static int wl1251_set_mac_address(char *iface, unsigned char *address)
 
 #ifdef WITH_LIBNL
 
-static int wl1251_nl_push_regdomain(struct nl_sock *nlh, char *regdomain)
+#define WL1251_NL_MAX_PENDING 4
+
+/*
+ * One netlink session: a generic netlink socket with family ids resolved
+ * once, a route socket for link settings and the requests still waiting for
+ * their ack. Requests are sent back to back and acked together by
+ * wl1251_nl_wait().
+ */
+struct wl1251_nl {
+	struct nl_sock *genl;
+	struct nl_sock *route;
+	int nl80211;
+#ifdef WITH_WL1251_NL
+	int wl1251;
+#endif
+	unsigned int pending;
+	unsigned int waited;
+	struct {
+		struct nl_sock *sock;
+		unsigned int seq;
+		const char *what;
+		int done;
+		int error;
+	} acks[WL1251_NL_MAX_PENDING];
+};
+
+static struct nl_sock *wl1251_nl_connect(int protocol)
 {
-	struct nl_msg *msg = NULL;
-	int family = -1;
-	int ret = -1;
+	struct nl_sock *nlh;
 	int error;
 
-	family = genl_ctrl_resolve(nlh, "nl80211");
-	if (family < 0) {
+	nlh = nl_socket_alloc();
+	if (!nlh) {
+		perror("wl1251-cal: failed to alloc netlink");
+		return NULL;
+	}
+
+	if (protocol == NETLINK_GENERIC)
+		error = genl_connect(nlh);
+	else
+		error = nl_connect(nlh, protocol);
+
+	if (error < 0) {
+		nl_perror(error, "wl1251-cal: failed to connect netlink");
+		nl_socket_free(nlh);
+		return NULL;
+	}
+
+	return nlh;
+}
+
+static int wl1251_nl_open(struct wl1251_nl *nl)
+{
+	memset(nl, 0, sizeof(*nl));
+
+	if (wl1251_dl_nl_load() < 0)
+		return -1;
+
+	nl->genl = wl1251_nl_connect(NETLINK_GENERIC);
+	if (!nl->genl)
+		return -1;
+
+	nl->nl80211 = genl_ctrl_resolve(nl->genl, "nl80211");
+	if (nl->nl80211 < 0)
 		fprintf(stderr, "wl1251-cal: didn't find nl80211 netlink control\n");
-		goto out;
+	else
+		printf("wl1251-cal: nl80211 netlink family id %d\n", nl->nl80211);
+
+#ifdef WITH_WL1251_NL
+	nl->wl1251 = genl_ctrl_resolve(nl->genl, WL1251_NL_NAME);
+	if (nl->wl1251 < 0)
+		fprintf(stderr, "wl1251-cal: didn't find wl1251 netlink control\n");
+	else
+		printf("wl1251-cal: " WL1251_NL_NAME " netlink family id is %d\n", nl->wl1251);
+#endif
+
+	return 0;
+}
+
+static void wl1251_nl_close(struct wl1251_nl *nl)
+{
+	if (nl->route)
+		nl_socket_free(nl->route);
+	nl_socket_free(nl->genl);
+}
+
+/* Send msg and remember its sequence number until the ack arrives */
+static int wl1251_nl_send(struct wl1251_nl *nl, struct nl_sock *sock, struct nl_msg *msg, const char *what)
+{
+	char buf[128];
+	int error;
+
+	if (nl->pending >= WL1251_NL_MAX_PENDING) {
+		fprintf(stderr, "wl1251-cal: too many netlink requests in flight for %s\n", what);
+		return -1;
 	}
 
-	printf("wl1251-cal: nl80211 netlink family id %d\n", family);
+	if ((error = nl_send_auto_complete(sock, msg)) < 0) {
+		WL1251_PROBE(nl_send, what, 0, error);
+		snprintf(buf, sizeof(buf), "wl1251-cal: failed to send netlink message %s", what);
+		nl_perror(error, buf);
+		return -1;
+	}
+
+	nl->waited = 0;
+	nl->acks[nl->pending].sock = sock;
+	nl->acks[nl->pending].seq = nlmsg_hdr(msg)->nlmsg_seq;
+	nl->acks[nl->pending].what = what;
+	nl->acks[nl->pending].done = 0;
+	nl->acks[nl->pending].error = 0;
+	WL1251_PROBE(nl_send, what, nl->acks[nl->pending].seq, 0);
+	nl->pending++;
+	return 0;
+}
+
+static int wl1251_nl_push_regdomain(struct wl1251_nl *nl, const char *regdomain)
+{
+	struct nl_msg *msg = NULL;
+	int ret = -1;
+	int error;
+
+	if (nl->nl80211 < 0)
+		goto out;
 
 	msg = nlmsg_alloc();
 	if (!msg) {
@@ -157,7 +746,7 @@ static int wl1251_nl_push_regdomain(struct nl_sock *nlh, char *regdomain)
 		goto out;
 	}
 
-	if (!genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, 0, NL80211_CMD_REQ_SET_REG, 0)) {
+	if (!genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, nl->nl80211, 0, NLM_F_ACK, NL80211_CMD_REQ_SET_REG, 0)) {
 		errno = ENOBUFS;
 		perror("wl1251-cal: failed to gen netlink message NL80211_CMD_REQ_SET_REG");
 		goto out;
@@ -168,12 +757,7 @@ static int wl1251_nl_push_regdomain(struct nl_sock *nlh, char *regdomain)
 		goto out;
 	}
 
-	if ((error = nl_send_auto_complete(nlh, msg)) < 0) {
-		nl_perror(error, "wl1251-cal: failed to send netlink message NL80211_CMD_REQ_SET_REG");
-		goto out;
-	}
-
-	ret = 0;
+	ret = wl1251_nl_send(nl, nl->genl, msg, "NL80211_CMD_REQ_SET_REG");
 
 out:
 	nlmsg_free(msg);
@@ -182,20 +766,14 @@ out:
 
 #ifdef WITH_WL1251_NL
 
-static int wl1251_nl_push_nvs(struct nl_sock *nlh, char *iface, unsigned char *nvs, uint32_t nvs_size)
+static int wl1251_nl_push_nvs(struct wl1251_nl *nl, char *iface, const unsigned char *nvs, uint32_t nvs_size)
 {
 	struct nl_msg *msg = NULL;
-	int family = -1;
 	int ret = -1;
 	int error;
 
-	family = genl_ctrl_resolve(nlh, WL1251_NL_NAME);
-	if (family < 0) {
-		fprintf(stderr, "wl1251-cal: didn't find wl1251 netlink control\n");
+	if (nl->wl1251 < 0)
 		goto out;
-	}
-
-	printf("wl1251-cal: " WL1251_NL_NAME " netlink family id is %d\n", family);
 
 	msg = nlmsg_alloc();
 	if (!msg) {
@@ -203,7 +781,7 @@ static int wl1251_nl_push_nvs(struct nl_sock *nlh, char *iface, unsigned char *n
 		goto out;
 	}
 
-	if (!genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, 0, WL1251_NL_CMD_NVS_PUSH, WL1251_NL_VERSION)) {
+	if (!genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, nl->wl1251, 0, NLM_F_ACK, WL1251_NL_CMD_NVS_PUSH, WL1251_NL_VERSION)) {
 		errno = ENOBUFS;
 		perror("wl1251-cal: failed to gen netlink message WL1251_NL_CMD_NVS_PUSH");
 		goto out;
@@ -224,12 +802,7 @@ static int wl1251_nl_push_nvs(struct nl_sock *nlh, char *iface, unsigned char *n
 		goto out;
 	}
 
-	if ((error = nl_send_auto_complete(nlh, msg)) < 0) {
-		nl_perror(error, "wl1251-cal: failed to send netlink message WL1251_NL_CMD_NVS_PUSH");
-		goto out;
-	}
-
-	ret = 0;
+	ret = wl1251_nl_send(nl, nl->genl, msg, "WL1251_NL_CMD_NVS_PUSH");
 
 out:
 	nlmsg_free(msg);
@@ -238,99 +811,242 @@ out:
 
 #endif
 
-static struct nl_sock *wl1251_nl_connect(void)
+/* RTM_SETLINK replacement for the SIOCSIFHWADDR ioctl, address is stored reversed like in CAL */
+static int wl1251_nl_set_mac_address(struct wl1251_nl *nl, char *iface, unsigned char *address)
 {
-	struct nl_sock *nlh;
+	struct nl_msg *msg = NULL;
+	struct ifinfomsg ifi;
+	unsigned char mac[6];
+	int ret = -1;
 	int error;
+	int i;
 
-	nlh = nl_socket_alloc();
-	if (!nlh) {
-		perror("wl1251-cal: failed to alloc netlink");
-		return NULL;
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = if_nametoindex(iface);
+	if (!ifi.ifi_index) {
+		fprintf(stderr, "wl1251-cal: bad interface name %s\n", iface);
+		return -1;
 	}
 
-	if ((error = genl_connect(nlh)) < 0) {
-		nl_perror(error, "wl1251-cal: failed to connect netlink");
-		nl_socket_free(nlh);
-		return NULL;
+	if (!nl->route) {
+		nl->route = wl1251_nl_connect(NETLINK_ROUTE);
+		if (!nl->route)
+			return -1;
 	}
 
-	return nlh;
+	for (i = 0; i < 6; i++)
+		mac[i] = address[5-i];
+
+	msg = nlmsg_alloc_simple(RTM_SETLINK, NLM_F_ACK);
+	if (!msg) {
+		perror("wl1251-cal: failed to alloc netlink message RTM_SETLINK");
+		goto out;
+	}
+
+	if ((error = nlmsg_append(msg, &ifi, sizeof(ifi), NLMSG_ALIGNTO)) < 0 ||
+	    (error = nla_put(msg, IFLA_ADDRESS, sizeof(mac), mac)) < 0) {
+		nl_perror(error, "wl1251-cal: failed to put netlink message RTM_SETLINK");
+		goto out;
+	}
+
+	ret = wl1251_nl_send(nl, nl->route, msg, "RTM_SETLINK");
+
+out:
+	nlmsg_free(msg);
+	return ret;
 }
 
-static void wl1251_nl_destroy(struct nl_sock *nlh)
+static int wl1251_nl_ack(struct wl1251_nl *nl, struct nl_sock *sock, unsigned int seq, int error)
 {
-	nl_socket_free(nlh);
+	unsigned int i;
+
+	for (i = 0; i < nl->pending; i++) {
+		if (nl->acks[i].sock == sock && nl->acks[i].seq == seq && !nl->acks[i].done) {
+			nl->acks[i].done = 1;
+			nl->acks[i].error = error;
+			WL1251_PROBE(nl_recv, nl->acks[i].what, seq, error);
+			printf("wl1251-cal: %s %s\n", nl->acks[i].what, error ? "failed" : "acked");
+			return NL_OK;
+		}
+	}
+
+	return NL_OK;
 }
 
+struct wl1251_nl_receiver {
+	struct wl1251_nl *nl;
+	struct nl_sock *sock;
+};
+
 static int error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
 {
-	printf("wl1251-cal: error_handler()\n");
-	*((int *)arg) = err->error;
-	return NL_STOP;
+	struct wl1251_nl_receiver *rx = arg;
+
+	(void)nla;
+	return wl1251_nl_ack(rx->nl, rx->sock, err->msg.nlmsg_seq, err->error);
 }
 
 static int ack_handler(struct nl_msg *msg, void *arg)
 {
-	printf("wl1251-cal: ack_handler()\n");
-	*((int *)arg) = 0;
-	return NL_STOP;
+	struct wl1251_nl_receiver *rx = arg;
+
+	return wl1251_nl_ack(rx->nl, rx->sock, nlmsg_hdr(msg)->nlmsg_seq, 0);
 }
 
-static int finish_handler(struct nl_msg *msg, void *arg)
+static int seq_check_handler(struct nl_msg *msg, void *arg)
 {
-	printf("wl1251-cal: finish_handler()\n");
-	*((int *)arg) = 0;
-	return NL_SKIP;
+	/* Sequence numbers are matched against the pending table instead */
+	(void)msg;
+	(void)arg;
+	return NL_OK;
 }
 
-static int wl1251_nl_receive(struct nl_sock *nlh)
+/*
+ * Collect the acks of every request sent since the last call, waiting at most
+ * timeout ms in total. Returns 0 if all of them succeeded, the outcome of each
+ * one is kept for wl1251_nl_acked() until the next request is sent.
+ */
+static int wl1251_nl_wait(struct wl1251_nl *nl, int timeout)
 {
-	struct nl_cb *cb;
-	int ret;
+	struct wl1251_nl_receiver rx[2];
+	struct nl_cb *cb[2];
+	struct pollfd fds[2];
+	struct timespec start, now;
+	unsigned int nfds = 0;
+	unsigned int left;
+	unsigned int i;
+	int remaining;
+	int ret = 0;
 	int error;
 
-	cb = nl_cb_alloc(NL_CB_DEFAULT);
-	if (!cb) {
-		perror("wl1251-cal: nl_cb_alloc failed");
-		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < 2; i++) {
+		rx[nfds].nl = nl;
+		rx[nfds].sock = i ? nl->route : nl->genl;
+		if (!rx[nfds].sock)
+			continue;
+		cb[nfds] = nl_cb_alloc(NL_CB_DEFAULT);
+		if (!cb[nfds]) {
+			perror("wl1251-cal: nl_cb_alloc failed");
+			ret = -1;
+			goto out;
+		}
+		nl_cb_err(cb[nfds], NL_CB_CUSTOM, error_handler, &rx[nfds]);
+		nl_cb_set(cb[nfds], NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &rx[nfds]);
+		nl_cb_set(cb[nfds], NL_CB_SEQ_CHECK, NL_CB_CUSTOM, seq_check_handler, NULL);
+		fds[nfds].fd = nl_socket_get_fd(rx[nfds].sock);
+		fds[nfds].events = POLLIN;
+		nfds++;
 	}
 
-	nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &ret);
-	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &ret);
-	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &ret);
+	while (1) {
+
+		left = 0;
+		for (i = 0; i < nl->pending; i++)
+			if (!nl->acks[i].done)
+				left++;
+		if (!left)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		remaining = timeout - (int)wl1251_timespec_ms(&start, &now);
+		if (remaining <= 0) {
+			fprintf(stderr, "wl1251-cal: timeout waiting for %u netlink acks\n", left);
+			ret = -1;
+			break;
+		}
+
+		error = poll(fds, nfds, remaining);
+		if (error < 0 && errno == EINTR)
+			continue;
+		if (error < 0) {
+			perror("wl1251-cal: poll on netlink failed");
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < nfds; i++) {
+			if (!(fds[i].revents & (POLLIN | POLLERR)))
+				continue;
+			if ((error = nl_recvmsgs(rx[i].sock, cb[i])) < 0)
+				nl_perror(error, "wl1251-cal: nl_recvmsgs failed");
+		}
+
+	}
 
-	ret = 1;
-	while (ret > 0) {
-		if ((error = nl_recvmsgs(nlh, cb)) < 0)
-			nl_perror(error, "wl1251-cal: nl_recvmsgs failed");
+	for (i = 0; i < nl->pending; i++) {
+		if (nl->acks[i].done && nl->acks[i].error) {
+			fprintf(stderr, "wl1251-cal: %s failed: %s\n", nl->acks[i].what, strerror(-nl->acks[i].error));
+			ret = -1;
+		}
 	}
 
-	nl_cb_put(cb);
+out:
+	nl->waited = nl->pending;
+	nl->pending = 0;
+	for (i = 0; i < nfds; i++)
+		nl_cb_put(cb[i]);
 	return ret;
 }
 
+/* Whether the request what was acked without an error by the last wait */
+static int wl1251_nl_acked(struct wl1251_nl *nl, const char *what)
+{
+	unsigned int i;
+
+	for (i = 0; i < nl->waited; i++)
+		if (strcmp(nl->acks[i].what, what) == 0)
+			return nl->acks[i].done && !nl->acks[i].error;
+
+	return 0;
+}
+
+#endif
+
+#ifdef WITH_LIBCAL
+
+/* libcal only hands out private copies, *copy must be freed by the caller */
+static int wl1251_cal_get_block(struct cal *c, const char *name, const unsigned char **ptr, unsigned long *len, void **copy)
+{
+	*copy = NULL;
+	if (cal_read_block(c, name, copy, len, 0) < 0)
+		return -1;
+	*ptr = *copy;
+	return 0;
+}
+
+#else
+
+static int wl1251_cal_get_block(struct cal *c, const char *name, const unsigned char **ptr, unsigned long *len, void **copy)
+{
+	*copy = NULL;
+	return cal_get_block_ref(c, name, (const void **)ptr, len, 0);
+}
+
 #endif
 
 static void wl1251_cal_read_address(struct cal *c, unsigned char *address)
 {
-	void *npc_ptr = NULL;
+	void *npc_copy = NULL;
+	const unsigned char *npc_ptr;
 	unsigned long npc_len;
-	unsigned char *npc;
+	const unsigned char *npc;
 	int npc_count;
 	int have_address;
 	int i;
 
-	if (!c || cal_read_block(c, "cert-npc", &npc_ptr, &npc_len, 0) < 0)
+	if (!c || wl1251_cal_get_block(c, "cert-npc", &npc_ptr, &npc_len, &npc_copy) < 0)
 		npc_len = 0;
 
 	have_address = 0;
 
-	if (npc_len) {
+	if (npc_len >= 0x94 + 4) {
 		npc = npc_ptr + 0x94;
 		npc_count = npc[0] | npc[1] << 8 | npc[2] << 16 | npc[3] << 24;
 		npc += 4;
-		for (i = 0; i < npc_count; i++) {
+		for (i = 0; i < npc_count && npc + 14 <= npc_ptr + npc_len; i++) {
 			if (memcmp(npc, "WLAN_ID", 8) == 0) {
 				memcpy(address, npc+8, 6);
 				printf("wl1251-cal: found MAC address %02x:%02x:%02x:%02x:%02x:%02x\n",
@@ -347,26 +1063,27 @@ static void wl1251_cal_read_address(struct cal *c, unsigned char *address)
 		fprintf(stderr, "wl1251-cal: couldn't read WLAN mac address from CAL\n");
 	}
 
-	free(npc_ptr);
+	free(npc_copy);
 }
 
 static void wl1251_cal_read_fcc(struct cal *c, int *fcc)
 {
-	void *ccc_ptr = NULL;
+	void *ccc_copy = NULL;
+	const unsigned char *ccc_ptr;
 	unsigned long ccc_len;
-	unsigned char *ccc;
+	const unsigned char *ccc;
 	int ccc_count;
 	int i;
 
-	if (!c || cal_read_block(c, "cert-ccc", &ccc_ptr, &ccc_len, 0) < 0)
+	if (!c || wl1251_cal_get_block(c, "cert-ccc", &ccc_ptr, &ccc_len, &ccc_copy) < 0)
 		ccc_len = 0;
 
 	*fcc = 0;
-	if (ccc_len) {
+	if (ccc_len >= 368 + 4) {
 		ccc = ccc_ptr + 368;
 		ccc_count = ccc[0] | ccc[1] << 8 | ccc[2] << 16 | ccc[3] << 24;
 		ccc += 4;
-		for (i = 0; i < (ccc_count / 4); i++) {
+		for (i = 0; i < (ccc_count / 4) && ccc + 4 <= ccc_ptr + ccc_len; i++) {
 			if (ccc[0] == 0 && ccc[1] == 0 && ccc[2] == 2 && ccc[3] == 0)
 				*fcc = 1;
 			ccc += 4;
@@ -375,58 +1092,73 @@ static void wl1251_cal_read_fcc(struct cal *c, int *fcc)
 		fprintf(stderr, "wl1251-cal: couldn't read fcc from CAL\n");
 	}
 
-	free(ccc_ptr);
+	free(ccc_copy);
 }
 
 static void wl1251_cal_read_nvs(struct cal *c, unsigned char **nvs, unsigned long *nvs_len)
 {
-	void *nvs_ptr;
+	void *nvs_copy = NULL;
+	const unsigned char *nvs_ptr;
 
-	if (!c || cal_read_block(c, "wlan-tx-cost3_0", &nvs_ptr, nvs_len, 0) < 0)
+	if (!c || wl1251_cal_get_block(c, "wlan-tx-cost3_0", &nvs_ptr, nvs_len, &nvs_copy) < 0)
 		*nvs_len = 0;
 
+	/* NVS is patched in place and outlives the CAL handle, so keep one private copy */
+	if (*nvs_len && !nvs_copy) {
+		nvs_copy = wl1251_alloc(*nvs_len);
+		if (nvs_copy)
+			memcpy(nvs_copy, nvs_ptr, *nvs_len);
+		else
+			*nvs_len = 0;
+	}
+
 	if (*nvs_len) {
 		printf("wl1251-cal: Got CAL NVS\n");
-		*nvs = nvs_ptr;
+		*nvs = nvs_copy;
 	} else {
 		fprintf(stderr, "wl1251-cal: Couldnt get a CAL NVS, using default one\n");
 		*nvs = NULL;
 	}
 }
 
-static void wl1251_cal_read(unsigned char *address, int *fcc, unsigned char **nvs, unsigned long *nvs_len)
+static void wl1251_cal_read(struct cal *c, unsigned char *address, int *fcc, unsigned char **nvs, unsigned long *nvs_len)
 {
-	struct cal *c;
-
-	if (cal_init(&c) < 0) {
-		fprintf(stderr, "wl1251-cal: cal_init failed\n");
-		c = NULL;
-	}
-
 	wl1251_cal_read_address(c, address);
 	wl1251_cal_read_fcc(c, fcc);
 
 	if (nvs)
 		wl1251_cal_read_nvs(c, nvs, nvs_len);
-
-	if (c)
-		cal_finish(c);
 }
 
+#ifndef WL1251_FIRMWARE_DIR
+#define WL1251_FIRMWARE_DIR "/lib/firmware"
+#endif
+#define WL1251_FIRMWARE_NVS WL1251_FIRMWARE_DIR "/ti-connectivity/wl1251-nvs.bin"
+#define WL1251_FIRMWARE_NVS_OLD WL1251_FIRMWARE_DIR "/wl1251-nvs.bin"
+
+/*
+ * The firmware NVS file read by wl1251_vfs_read_nvs(), kept open with its
+ * state at that time so that an unchanged NVS can be pushed from it later.
+ */
+static struct {
+	int fd;
+	struct stat st;
+} wl1251_fw_nvs = { .fd = -1 };
+
 static void wl1251_vfs_read_nvs(unsigned char **nvs, unsigned long *nvs_len)
 {
 	int fd;
 	int errno_old;
 	off_t size;
 
-	fd = open("/lib/firmware/ti-connectivity/wl1251-nvs.bin", O_RDONLY);
+	fd = open(WL1251_FIRMWARE_NVS, O_RDONLY);
 	if (fd < 0) {
 		errno_old = errno;
-		fd = open("/lib/firmware/wl1251-nvs.bin", O_RDONLY);
+		fd = open(WL1251_FIRMWARE_NVS_OLD, O_RDONLY);
 		if (fd < 0) {
-			perror("wl1251-cal: Cannot open NVS file /lib/firmware/wl1251-nvs.bin");
+			perror("wl1251-cal: Cannot open NVS file " WL1251_FIRMWARE_NVS_OLD);
 			errno = errno_old;
-			perror("wl1251-cal: Cannot open NVS file /lib/firmware/ti-connectivity/wl1251-nvs.bin");
+			perror("wl1251-cal: Cannot open NVS file " WL1251_FIRMWARE_NVS);
 			return;
 		}
 	}
@@ -441,7 +1173,7 @@ static void wl1251_vfs_read_nvs(unsigned char **nvs, unsigned long *nvs_len)
 		return;
 	}
 
-	*nvs = malloc(size+4);
+	*nvs = wl1251_alloc(size+4);
 	*nvs_len = size+4;
 	if (!*nvs) {
 		perror("wl1251-cal: malloc failed");
@@ -453,393 +1185,2580 @@ static void wl1251_vfs_read_nvs(unsigned char **nvs, unsigned long *nvs_len)
 	if (read(fd, *nvs+4, size) != size) {
 		perror("wl1251-cal: Cannot read NVS file wl1251-nvs.bin");
 		close(fd);
-		free(*nvs);
+		wl1251_free(*nvs);
 		*nvs = NULL;
 		*nvs_len = 0;
 		return;
 	}
 
-	nvs[0] = nvs[1] = nvs[2] = nvs[3] = 0;
+	(*nvs)[0] = (*nvs)[1] = (*nvs)[2] = (*nvs)[3] = 0;
 
 	printf("wl1251-cal: Got NVS from firmware directory\n");
-	close(fd);
+
+	if (wl1251_fw_nvs.fd >= 0)
+		close(wl1251_fw_nvs.fd);
+	wl1251_fw_nvs.fd = -1;
+	if (fstat(fd, &wl1251_fw_nvs.st) == 0 && wl1251_fw_nvs.st.st_size == size)
+		wl1251_fw_nvs.fd = fd;
+	else
+		close(fd);
 }
 
-static int wl1251_vfs_read_regdomain(char *regdomain)
+/* Whether the firmware NVS file still holds what wl1251_vfs_read_nvs() read */
+static int wl1251_vfs_nvs_unchanged(void)
 {
-	FILE * stream;
-	char buf[4];
-	size_t len;
-	int ret;
+	struct stat st;
 
-	stream = popen(". /etc/default/crda; echo $REGDOMAIN", "r");
-	if (!stream)
-		return 1;
+	if (wl1251_fw_nvs.fd < 0 || fstat(wl1251_fw_nvs.fd, &st) < 0)
+		return 0;
 
-	len = 0;
+	return st.st_size == wl1251_fw_nvs.st.st_size &&
+	       st.st_mtim.tv_sec == wl1251_fw_nvs.st.st_mtim.tv_sec &&
+	       st.st_mtim.tv_nsec == wl1251_fw_nvs.st.st_mtim.tv_nsec &&
+	       st.st_ctim.tv_sec == wl1251_fw_nvs.st.st_ctim.tv_sec &&
+	       st.st_ctim.tv_nsec == wl1251_fw_nvs.st.st_ctim.tv_nsec;
+}
 
-	if (fgets(buf, sizeof(buf), stream)) {
-		len = strlen(buf);
-		if (len > 0 && buf[len-1] == '\n')
-			buf[--len] = 0;
+/* Bytes left until the next page boundary of the file offset, at most len */
+static size_t wl1251_page_chunk(unsigned long offset, unsigned long len)
+{
+	static long cached;
+	unsigned long chunk;
+	long page;
+
+	/* Batch workers get here concurrently */
+	page = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+	if (!page) {
+		page = sysconf(_SC_PAGESIZE);
+		if (page <= 0)
+			page = 4096;
+		__atomic_store_n(&cached, page, __ATOMIC_RELAXED);
 	}
 
-	ret = pclose(stream);
-	if (ret != 0)
-		return -1;
+	chunk = page - offset % page;
+	return chunk < len ? chunk : len;
+}
 
-	if (len == 0) {
-		fprintf(stderr, "wl1251-cal: REGDOMAIN in /etc/default/crda is not specified\n");
-		return -1;
-	} else if (len != 2) {
-		fprintf(stderr, "wl1251-cal: REGDOMAIN in /etc/default/crda is incorrect\n");
-		return -1;
+/* Retries short writes and EINTR, the firmware loader buffers each write per page */
+static int wl1251_write_all(int fd, const unsigned char *buf, unsigned long len)
+{
+	unsigned long done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = write(fd, buf + done, wl1251_page_chunk(done, len - done));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0) {
+			errno = EIO;
+			return -1;
+		}
+		done += ret;
 	}
 
-	memcpy(regdomain, buf, 3);
 	return 0;
 }
 
-#ifdef WITH_DBUS
+/*
+ * Copy len bytes of in to out in the kernel. Returns -2 without copying
+ * anything if sendfile does not work for these files.
+ */
+static int wl1251_sendfile_all(int out, int in, unsigned long len)
+{
+	unsigned long done = 0;
+	off_t offset = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = sendfile(out, in, &offset, wl1251_page_chunk(done, len - done));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && done == 0 && (errno == EINVAL || errno == ENOSYS))
+			return -2;
+		if (ret < 0)
+			return -1;
+		if (ret == 0) {
+			errno = EIO;
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
 
-static int wl1251_csd_read_contry_code(DBusConnection *connection)
+/*
+ * Push the NVS without its prefix to the firmware loader data file. An
+ * unpatched NVS from the firmware directory goes from the page cache without
+ * passing through our buffer, from the file it was read from and only while
+ * that file is unchanged.
+ */
+static int wl1251_push_nvs_data(int fd, const unsigned char *nvs, unsigned long nvs_len, int from_file)
 {
-	DBusError error;
-	DBusMessage *message;
-	DBusMessage *reply;
-	char status;
-	dbus_uint16_t lac, network_type, supported_services;
-	dbus_uint32_t cell_id, operator_code, country_code;
-	dbus_int32_t error_value;
+	int ret = -2;
 
-	message = dbus_message_new_method_call("com.nokia.phone.net", "/com/nokia/phone/net", "Phone.Net", "get_registration_status");
-	if (!message) {
-		fprintf(stderr, "wl1251-cal: Failed to ask registration status: %s\n", strerror(ENOMEM));
-		return 0;
+	if (from_file && wl1251_vfs_nvs_unchanged() &&
+	    (unsigned long)wl1251_fw_nvs.st.st_size == nvs_len-4) {
+		ret = wl1251_sendfile_all(fd, wl1251_fw_nvs.fd, nvs_len-4);
+		if (ret != -2)
+			return ret;
 	}
 
-	dbus_error_init(&error);
-	reply = dbus_connection_send_with_reply_and_block(connection, message, 2000, &error);
-	dbus_message_unref(message);
-	if (dbus_error_is_set(&error)) {
-		fprintf(stderr, "wl1251-cal: Failed to ask registration status: %s\n", error.message);
-		dbus_error_free(&error);
-		return 0;
-	} else if (!reply) {
-		fprintf(stderr, "wl1251-cal: Failed to ask registration status\n");
-		return 0;
+	return wl1251_write_all(fd, nvs+4, nvs_len-4);
+}
+
+#define WL1251_UEVENT_BUFFER 8192
+
+static int wl1251_sysfs_write(const char *file, const char *value)
+{
+	int fd;
+
+	fd = open(file, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "wl1251-cal: Cannot open file %s: %s\n", file, strerror(errno));
+		return -1;
 	}
 
-	dbus_error_init(&error);
-	if (!dbus_message_get_args(reply, &error,
-					DBUS_TYPE_BYTE, &status,
-					DBUS_TYPE_UINT16, &lac,
-					DBUS_TYPE_UINT32, &cell_id,
-					DBUS_TYPE_UINT32, &operator_code,
-					DBUS_TYPE_UINT32, &country_code,
-					DBUS_TYPE_BYTE, &network_type,
-					DBUS_TYPE_BYTE, &supported_services,
-					DBUS_TYPE_INT32, &error_value,
-					DBUS_TYPE_INVALID)) {
-		fprintf(stderr, "wl1251-cal: Could not get args from reply: %s\n", error.message);
-		dbus_error_free(&error);
-		dbus_message_unref(reply);
-		return 0;
+	if (wl1251_write_all(fd, (const unsigned char *)value, strlen(value)) < 0) {
+		fprintf(stderr, "wl1251-cal: Cannot write to file %s: %s\n", file, strerror(errno));
+		close(fd);
+		return -1;
 	}
 
-	dbus_message_unref(reply);
-	printf("wl1251-cal: Country code: %u\n", (unsigned int)country_code);
-	return country_code;
+	close(fd);
+	return 0;
 }
 
-static int wl1251_ofono_read_country_code(DBusConnection *connection)
+static int wl1251_sysfs_push(const char *file, const unsigned char *nvs, unsigned long nvs_len, int from_file)
 {
-	/* TODO: see https://git.kernel.org/cgit/network/ofono/ofono.git/tree/test/get-serving-cell-info */
-	return 0;
-}
+	int ret;
+	int fd;
 
-#endif
+	/* The first 4 bytes are not pushed, there must be at least those */
+	if (nvs_len < 4) {
+		fprintf(stderr, "wl1251-cal: Cannot push NVS of %lu bytes to file %s\n", nvs_len, file);
+		return -1;
+	}
 
-/*
- Generate:
- $ sed 's/ \t/|/' /usr/share/operator-wizard/mcc_mapping | sort -t'|' -k2 > mcc_mapping
- $ sort -t'|' -k4 /usr/share/clock/wdb > wdb
- $ join -1 2 -2 4 -t'|' -o1.1,2.3 mcc_mapping wdb | sort -u | sed 's/^/{ /;s/|/, "/;s/$/" },/'
-*/
-static const struct code_domain codes[] = {
-	{ 202, "GR" }, { 204, "NL" }, { 206, "BE" }, { 208, "FR" }, { 212, "MC" }, { 213, "AD" },
-	{ 214, "ES" }, { 216, "HU" }, { 218, "BA" }, { 219, "HR" }, { 220, "RS" }, { 222, "IT" },
-	{ 225, "VA" }, { 226, "RO" }, { 228, "CH" }, { 230, "CZ" }, { 231, "SK" }, { 232, "AT" },
-	{ 234, "GB" }, { 235, "GB" }, { 238, "DK" }, { 240, "SE" }, { 242, "NO" }, { 244, "FI" },
-	{ 246, "LT" }, { 247, "LV" }, { 248, "EE" }, { 250, "RU" }, { 255, "UA" }, { 257, "BY" },
-	{ 259, "MD" }, { 260, "PL" }, { 262, "DE" }, { 266, "GI" }, { 268, "PT" }, { 270, "LU" },
-	{ 272, "IE" }, { 274, "IS" }, { 276, "AL" }, { 278, "MT" }, { 280, "CY" }, { 282, "GE" },
-	{ 283, "AM" }, { 284, "BG" }, { 286, "TR" }, { 288, "FO" }, { 290, "GL" }, { 292, "SM" },
-	{ 293, "SI" }, { 294, "MK" }, { 295, "LI" }, { 297, "ME" }, { 302, "CA" }, { 308, "FR" },
-	{ 310, "US" }, { 311, "US" }, { 312, "US" }, { 313, "US" }, { 314, "US" }, { 315, "US" },
-	{ 316, "US" }, { 330, "PR" }, { 332, "US" }, { 334, "MX" }, { 338, "JM" }, { 340, "FR" },
-	{ 342, "BB" }, { 344, "AG" }, { 346, "KY" }, { 348, "VG" }, { 350, "BM" }, { 352, "GD" },
-	{ 354, "MS" }, { 356, "KN" }, { 358, "LC" }, { 360, "VC" }, { 362, "NL" }, { 363, "AW" },
-	{ 364, "BS" }, { 365, "AI" }, { 366, "DM" }, { 368, "CU" }, { 370, "DO" }, { 372, "HT" },
-	{ 374, "TT" }, { 376, "TC" }, { 400, "AZ" }, { 401, "KZ" }, { 402, "BT" }, { 404, "IN" },
-	{ 405, "IN" }, { 410, "PK" }, { 412, "AF" }, { 413, "LK" }, { 414, "MM" }, { 415, "LB" },
-	{ 416, "JO" }, { 417, "SY" }, { 418, "IQ" }, { 419, "KW" }, { 420, "SA" }, { 421, "YE" },
-	{ 422, "OM" }, { 424, "AE" }, { 425, "IL" }, { 426, "BH" }, { 427, "QA" }, { 428, "MN" },
-	{ 429, "NP" }, { 430, "AE" }, { 431, "AE" }, { 432, "IR" }, { 434, "UZ" }, { 436, "TJ" },
-	{ 437, "KG" }, { 438, "TM" }, { 440, "JP" }, { 441, "JP" }, { 450, "KR" }, { 452, "VN" },
-	{ 455, "MO" }, { 456, "KH" }, { 457, "LA" }, { 460, "CN" }, { 460, "HK" }, { 466, "TW" },
-	{ 467, "KP" }, { 470, "BD" }, { 472, "MV" }, { 502, "MY" }, { 505, "AU" }, { 510, "ID" },
-	{ 514, "TL" }, { 515, "PH" }, { 520, "TH" }, { 525, "SG" }, { 528, "BN" }, { 530, "NZ" },
-	{ 535, "GU" }, { 536, "NR" }, { 537, "PG" }, { 539, "TO" }, { 540, "SB" }, { 541, "VU" },
-	{ 542, "FJ" }, { 543, "WF" }, { 544, "WS" }, { 545, "KI" }, { 546, "FR" }, { 547, "PF" },
-	{ 548, "CK" }, { 549, "WS" }, { 550, "FM" }, { 550, "MP" }, { 551, "MH" }, { 552, "PW" },
-	{ 602, "EG" }, { 603, "DZ" }, { 604, "MA" }, { 605, "TN" }, { 606, "LY" }, { 607, "GM" },
-	{ 608, "SN" }, { 609, "MR" }, { 610, "ML" }, { 611, "GN" }, { 612, "CI" }, { 613, "BF" },
-	{ 614, "NE" }, { 615, "TG" }, { 616, "BJ" }, { 617, "MU" }, { 618, "LR" }, { 619, "SL" },
-	{ 620, "GH" }, { 621, "NG" }, { 622, "TD" }, { 623, "CF" }, { 624, "CM" }, { 625, "CV" },
-	{ 626, "ST" }, { 627, "GQ" }, { 628, "GA" }, { 629, "CG" }, { 630, "CD" }, { 631, "AO" },
-	{ 632, "GW" }, { 633, "SC" }, { 634, "SD" }, { 635, "RW" }, { 636, "ET" }, { 637, "SO" },
-	{ 638, "DJ" }, { 639, "KE" }, { 640, "TZ" }, { 641, "UG" }, { 642, "BI" }, { 643, "MZ" },
-	{ 645, "ZM" }, { 646, "MG" }, { 647, "FR" }, { 648, "ZW" }, { 649, "NA" }, { 650, "MW" },
-	{ 651, "LS" }, { 652, "BW" }, { 653, "SZ" }, { 654, "KM" }, { 655, "ZA" }, { 657, "ER" },
-	{ 702, "BZ" }, { 704, "GT" }, { 706, "SV" }, { 708, "HN" }, { 710, "NI" }, { 712, "CR" },
-	{ 714, "PA" }, { 716, "PE" }, { 722, "AR" }, { 724, "BR" }, { 730, "CL" }, { 732, "CO" },
-	{ 734, "VE" }, { 736, "BO" }, { 738, "GY" }, { 740, "EC" }, { 742, "FR" }, { 744, "PY" },
-	{ 746, "SR" }, { 748, "UY" }
-};
+	WL1251_PROBE(sysfs_push_start, file, nvs_len-4, from_file);
+
+	fd = open(file, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "wl1251-cal: Cannot open file %s: %s\n", file, strerror(errno));
+		WL1251_PROBE(sysfs_push_done, file, nvs_len-4, -1);
+		return -1;
+	}
 
-static const int fcc_codes[] = { 302, 310, 311, 316, 312, 313, 314, 315, 332, 466, 724, 722, 334, 732 };
+	ret = wl1251_push_nvs_data(fd, nvs, nvs_len, from_file);
+	if (ret < 0)
+		fprintf(stderr, "wl1251-cal: Cannot push NVS to file %s: %s\n", file, strerror(errno));
 
-static void wl1251_country_code_to_regdomain(int country_code, int fcc, char *regdomain)
+	close(fd);
+	WL1251_PROBE(sysfs_push_done, file, nvs_len-4, ret);
+	return ret;
+}
+
+/*
+ * The uevent socket of the real transport. Only root may announce firmware
+ * requests, so wl1251_real_uevent_recv() drops events sent by anyone else.
+ */
+static int wl1251_real_uevent_fd = -1;
+
+static int wl1251_real_uevent_open(void)
 {
-	unsigned int i;
+	struct sockaddr_nl addr;
+	int on = 1;
 
-	if (country_code == 0 && fcc) {
-		printf("wl1251-cal: FCC country\n");
-		memcpy(regdomain, "US", 3);
-		return;
+	wl1251_real_uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (wl1251_real_uevent_fd < 0) {
+		perror("wl1251-cal: Cannot open uevent socket");
+		return -1;
 	}
 
-	for (i = 0; i < sizeof(fcc_codes)/sizeof(fcc_codes[0]); ++i) {
-		if (fcc_codes[i] == country_code) {
-			printf("wl1251-cal: FCC country\n");
-			memcpy(regdomain, "US", 3);
-			return;
-		}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+
+	if (bind(wl1251_real_uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    setsockopt(wl1251_real_uevent_fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
+		perror("wl1251-cal: Cannot listen for uevents");
+		close(wl1251_real_uevent_fd);
+		wl1251_real_uevent_fd = -1;
+		return -1;
 	}
 
-	for (i = 0; i < sizeof(codes)/sizeof(codes[0]); ++i) {
-		if (codes[i].country_code == country_code) {
-			printf("wl1251-cal: Regulatory domain: %s\n", codes[i].regdomain);
-			memcpy(regdomain, codes[i].regdomain, 3);
-			return;
-		}
+	return 0;
+}
+
+static ssize_t wl1251_real_uevent_recv(char *buf, size_t size)
+{
+	struct sockaddr_nl addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct ucred *cred;
+	char control[CMSG_SPACE(sizeof(struct ucred))];
+	ssize_t len;
+
+	while (1) {
+
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buf;
+		iov.iov_len = size;
+		msg.msg_name = &addr;
+		msg.msg_namelen = sizeof(addr);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		len = recvmsg(wl1251_real_uevent_fd, &msg, 0);
+		if (len < 0)
+			return -1;
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS)
+			continue;
+		cred = (struct ucred *)CMSG_DATA(cmsg);
+		if (cred->uid == 0 && len > 0)
+			return len;
+
 	}
+}
 
-	printf("wl1251-cal: Country code is unknown, setting regulatory domain: EU\n");
-	memcpy(regdomain, "EU", 3);
+static void wl1251_real_uevent_close(void)
+{
+	close(wl1251_real_uevent_fd);
+	wl1251_real_uevent_fd = -1;
 }
 
-static unsigned char default_nvs[] = {
-	0x00, 0x00, 0x00, 0x00, 0x02, 0x11, 0x56, 0x06, 0x1c, 0x06, 0x01, 0x16, 0x60, 0x03,
-	0x07, 0x01, 0x09, 0x56, 0x12, 0x00, 0x00, 0x00, 0x01, 0x0d, 0x56, 0x40, 0x00, 0x00,
-	0x00, 0x02, 0x6d, 0x54, 0x09, 0x03, 0x07, 0x20, 0x00, 0x00, 0x00, 0x00, 0x01, 0x15,
-	0x58, 0xa4, 0x00, 0x00, 0x00, 0x01, 0x31, 0x56, 0x02, 0x02, 0x00, 0x00, 0x01, 0x35,
-	0x56, 0x04, 0xd1, 0x13, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
-	0x62, 0x00, 0x64, 0x00, 0x76, 0x00, 0xae, 0x00, 0xd4, 0x00, 0x2a, 0x01, 0x33, 0x01,
-	0x35, 0x01, 0x4b, 0x01, 0x0d, 0x02, 0x3f, 0x02, 0x5b, 0x02, 0x6d, 0x02, 0x79, 0x02,
-	0xa3, 0x02, 0xae, 0x02, 0x00, 0x00, 0x01, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1b, 0x02, 0x00, 0x00,
-	0x3e, 0x00, 0x7a, 0x00, 0xb6, 0x00, 0xcc, 0x00, 0xe3, 0x00, 0xfa, 0x00, 0x00, 0x00,
-	0x3c, 0x00, 0x78, 0x00, 0xb4, 0x00, 0xf0, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x78, 0x00,
-	0xb4, 0x00, 0xf0, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x78, 0x00, 0xb4, 0x00, 0xf0, 0x00,
-	0x00, 0x00, 0x3c, 0x00, 0x78, 0x00, 0xb4, 0x00, 0xf0, 0x00, 0x09, 0x04, 0x44, 0x10,
-	0xfc, 0x03, 0x45, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x0e, 0x08, 0x01, 0x3b, 0x00, 0x24, 0x00,
-	0x58, 0x04, 0x64, 0x00, 0xc0, 0x06, 0x85, 0x09, 0xa0, 0x00, 0x3c, 0x00, 0x24, 0x00,
-	0x00, 0x04, 0x50, 0x00, 0xd0, 0x01, 0x60, 0x13, 0xd0, 0x00, 0x3c, 0x00, 0x24, 0x00,
-	0x00, 0x04, 0x50, 0x00, 0xd0, 0x01, 0x8c, 0x14, 0x08, 0x01, 0x3c, 0x00, 0x24, 0x00,
-	0x00, 0x04, 0x50, 0x00, 0xd0, 0x01, 0xb8, 0x15, 0x08, 0x01, 0x3c, 0x00, 0x24, 0x00,
-	0x00, 0x04, 0x50, 0x00, 0xd0, 0x01, 0x44, 0x16, 0xb5, 0x00, 0x52, 0x00, 0x24, 0x00,
-	0x87, 0x04, 0x64, 0x00, 0x6e, 0x02, 0x85, 0x09, 0x01, 0x07, 0x10, 0x00, 0x00, 0x40,
-	0x00, 0x00, 0x01, 0x00, 0x00, 0x05, 0x04, 0x00, 0x00, 0xfe, 0xfa, 0x00, 0x00, 0x00,
-	0xff, 0xff, 0xff, 0xff, 0xfd, 0xfd, 0xfd, 0xfd, 0xfb, 0x00, 0xfd, 0xfa, 0xf7, 0x30,
-	0x04, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f,
-	0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00,
-	0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f,
-	0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00,
-	0x0f, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f,
-	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00,
-	0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f,
-	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00,
-	0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f,
-	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00,
-	0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f,
-	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00,
-	0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f,
-	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x30, 0x01, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x0d, 0x02, 0x94, 0x05, 0x94, 0x05, 0x94, 0x05, 0x94,
-	0x05, 0x95, 0x05, 0x94, 0x05, 0x82, 0x00, 0x9b, 0x00, 0x9b, 0x00, 0x9b, 0x00, 0x9b,
-	0x00, 0xc3, 0x00, 0x01, 0x00, 0x10, 0x01, 0x1e, 0x18, 0x18, 0x1e, 0x00, 0x22, 0x00,
-	0x00, 0x24, 0x25, 0x26, 0x27, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x01, 0x20, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x05, 0x07, 0x05, 0x03, 0x00, 0x08,
-	0x02, 0x02, 0x02, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x0a, 0x06, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x01, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+#ifndef WITH_LIBCAL
+
+#ifndef WL1251_CACHE_DIR
+#define WL1251_CACHE_DIR "/var/cache/wl1251-cal"
+#endif
+#define WL1251_CACHE_FILE WL1251_CACHE_DIR "/nvs.cache"
+#define WL1251_CACHE_MAGIC "W1C1"
+
+enum wl1251_cache_mode {
+	WL1251_CACHE_ON,
+	WL1251_CACHE_OFF,
+	WL1251_CACHE_REBUILD,
 };
 
-int main(int argc, char *argv[])
-{
-	int i;
-	int fd;
-	unsigned char *nvs = NULL;
-	unsigned long nvs_len = 0;
-	char *nvs_loading = NULL;
-	char *nvs_push_data = NULL;
+/*
+ * Cached result of wl1251_cal_read() and wl1251_vfs_read_nvs(). The NVS is
+ * stored before the regdomain and MAC patches, those are applied every run.
+ * An empty NVS means the default one is used.
+ */
+struct wl1251_cache_header {
+	char magic[4];
+	uint32_t fingerprint;	/* cal_fingerprint() of the CAL source */
+	int64_t fw_size;	/* Firmware NVS file size, -1 if there is none */
+	int64_t fw_mtime;	/* Firmware NVS file mtime */
 	unsigned char address[6];
-	int country_code = 0;
-	int fcc;
-	char regdomain[3];
+	uint8_t fcc;
+	uint8_t fw_nvs;		/* NVS was read from the firmware directory */
+	uint32_t nvs_len;
+	uint32_t nvs_sum;	/* FNV-1a of the NVS */
+};
 
-#ifdef WITH_DBUS
-	DBusError error;
-	DBusConnection *conn;
-#endif
+static uint32_t wl1251_cache_sum(const unsigned char *data, unsigned long len)
+{
+	uint32_t sum = 2166136261U;
 
-#ifdef WITH_LIBNL
-	struct nl_sock *nlh;
-#endif
+	while (len--)
+		sum = (sum ^ *data++) * 16777619U;
+	return sum;
+}
 
-	if (argc == 3) {
-		for (i = 1; i < 3; ++i) {
-			if (strncmp(argv[i], "--nvs-loading=", strlen("--nvs-loading=")) == 0)
-				nvs_loading = argv[i] + strlen("--nvs-loading=");
-			else if (strncmp(argv[i], "--nvs-push-data=", strlen("--nvs-push-data=")) == 0)
-				nvs_push_data = argv[i] + strlen("--nvs-push-data=");
-		}
-		if (nvs_loading && !nvs_loading[0])
-			nvs_loading = NULL;
-		if (nvs_push_data && !nvs_push_data[0])
-			nvs_push_data = NULL;
+static void wl1251_cache_key(struct cal *c, int fw_nvs, struct wl1251_cache_header *hdr)
+{
+	struct stat st;
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, WL1251_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->fingerprint = cal_fingerprint(c);
+	hdr->fw_nvs = fw_nvs;
+
+	/*
+	 * Also when the NVS did not come from the firmware file, one installed
+	 * later replaces a cached default NVS.
+	 */
+	if (stat(WL1251_FIRMWARE_NVS, &st) == 0 || stat(WL1251_FIRMWARE_NVS_OLD, &st) == 0) {
+		hdr->fw_size = st.st_size;
+		hdr->fw_mtime = st.st_mtime;
+	} else {
+		hdr->fw_size = -1;
 	}
+}
 
-	if ((argc != 3 || !nvs_loading || !nvs_push_data) && argc != 1) {
-#if 0
-		printf("Usage: %s [--nvs-loading=/sys/class/firmware/ti-connectivity!wl1251-nvs.bin/loading --nvs-push-data=/sys/class/firmware/ti-connectivity!wl1251-nvs.bin/data]\n", argv[0]);
-#endif
-		printf("Usage: %s\n", argv[0]);
-		return 1;
-	}
+static int wl1251_cache_load(struct cal *c, unsigned char *address, int *fcc, unsigned char **nvs, unsigned long *nvs_len)
+{
+	struct wl1251_cache_header key, hdr;
+	unsigned char *buf;
+	int fd;
 
-	if (nvs_loading) {
-		fd = open(nvs_loading, O_WRONLY);
-		if (fd < 0) {
-			fprintf(stderr, "wl1251-cal: Cannot open file %s: %s\n", nvs_loading, strerror(errno));
-			return 1;
-		}
-		if (write(fd, "1\n", 2) < 0) {
-			fprintf(stderr, "wl1251-cal: Cannot write to file %s: %s\n", nvs_loading, strerror(errno));
-			return 1;
-		}
+	fd = open(WL1251_CACHE_FILE, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
 		close(fd);
+		return -1;
 	}
 
-	wl1251_cal_read(address, &fcc, &nvs, &nvs_len);
+	wl1251_cache_key(c, hdr.fw_nvs, &key);
 
-	if (!nvs)
-		wl1251_vfs_read_nvs(&nvs, &nvs_len);
-
-	if (!nvs) {
-		nvs = default_nvs;
-		nvs_len = sizeof(default_nvs);
+	if (memcmp(hdr.magic, key.magic, sizeof(hdr.magic)) != 0 ||
+	    hdr.fingerprint != key.fingerprint ||
+	    hdr.fw_size != key.fw_size || hdr.fw_mtime != key.fw_mtime ||
+	    (hdr.nvs_len && hdr.nvs_len < 4)) {
+		close(fd);
+		return -1;
 	}
 
-#ifdef WITH_DBUS
+	buf = wl1251_alloc(hdr.nvs_len ? hdr.nvs_len : 1);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
 
-	dbus_error_init(&error);
-	conn = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
-	if (!conn) {
-		fprintf(stderr, "wl1251-cal: couldn't get dbus system bus. %s\n", error.message);
-		dbus_error_free(&error);
-	} else {
-		country_code = wl1251_csd_read_contry_code(conn);
-		if (!country_code)
-			country_code = wl1251_ofono_read_country_code(conn);
-		dbus_connection_unref(conn);
+	if (read(fd, buf, hdr.nvs_len) != (ssize_t)hdr.nvs_len ||
+	    wl1251_cache_sum(buf, hdr.nvs_len) != hdr.nvs_sum) {
+		wl1251_free(buf);
+		close(fd);
+		return -1;
 	}
 
-#endif
+	close(fd);
 
-	if (country_code || fcc) {
-		wl1251_country_code_to_regdomain(country_code, fcc, regdomain);
-	} else if (wl1251_vfs_read_regdomain(regdomain) < 0) {
-		printf("wl1251-cal: Fallback regulatory domain: EU\n");
-		memcpy(regdomain, "EU", 3);
+	if (!hdr.nvs_len) {
+		wl1251_free(buf);
+		buf = NULL;
 	}
 
-	if (memcmp(regdomain, "US", 3) == 0 && nvs_len == 756) {
-		nvs[377] = 2;
-		nvs[337] = 2;
-		nvs[380] = 9;
-		nvs[340] = 9;
-	}
+	memcpy(address, hdr.address, 6);
+	*fcc = hdr.fcc;
+	*nvs = buf;
+	*nvs_len = hdr.nvs_len;
+	return 0;
+}
+
+static void wl1251_cache_store(struct cal *c, unsigned char *address, int fcc, unsigned char *nvs, unsigned long nvs_len, int fw_nvs)
+{
+	struct wl1251_cache_header hdr;
+	int fd;
 
-	if (memcmp(address, "\0\0\0\0\0\0", 6) != 0 && nvs_len == 756 && nvs[29] == 2 && nvs[30] == 0x6d && nvs[31] == 0x54)
-		memcpy(nvs+32, address, 6);
+	wl1251_cache_key(c, fw_nvs, &hdr);
+	memcpy(hdr.address, address, 6);
+	hdr.fcc = fcc;
+	hdr.nvs_len = nvs_len;
+	hdr.nvs_sum = wl1251_cache_sum(nvs, nvs_len);
 
-	if (nvs_push_data) {
-		fd = open(nvs_push_data, O_WRONLY);
-		if (fd < 0) {
-			fprintf(stderr, "wl1251-cal: Cannot open file %s: %s\n", nvs_push_data, strerror(errno));
-		} else {
-			if (write(fd, nvs+4, nvs_len-4) < 0)
-				fprintf(stderr, "wl1251-cal: Cannot push NVS to file %s: %s\n", nvs_push_data, strerror(errno));
-			close(fd);
-		}
+	mkdir(WL1251_CACHE_DIR, 0755);
+
+	fd = open(WL1251_CACHE_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "wl1251-cal: Cannot create cache file %s: %s\n", WL1251_CACHE_FILE ".tmp", strerror(errno));
+		return;
 	}
 
-	if (nvs_loading) {
-		fd = open(nvs_loading, O_WRONLY);
-		if (fd < 0) {
-			fprintf(stderr, "wl1251-cal: Cannot open file %s: %s\n", nvs_loading, strerror(errno));
-		} else {
-			if (write(fd, "0\n", 2) < 0)
-				fprintf(stderr, "wl1251-cal: Cannot write to file %s: %s\n", nvs_loading, strerror(errno));
-			close(fd);
-		}
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, nvs, nvs_len) != (ssize_t)nvs_len ||
+	    fsync(fd) != 0) {
+		fprintf(stderr, "wl1251-cal: Cannot write cache file %s: %s\n", WL1251_CACHE_FILE ".tmp", strerror(errno));
+		close(fd);
+		unlink(WL1251_CACHE_FILE ".tmp");
+		return;
 	}
 
-	if (!nvs_push_data) {
-		if (memcmp(address, "\0\0\0\0\0\0", 6) != 0)
-			wl1251_set_mac_address("wlan0", address);
+	close(fd);
+
+	if (rename(WL1251_CACHE_FILE ".tmp", WL1251_CACHE_FILE) != 0) {
+		fprintf(stderr, "wl1251-cal: Cannot replace cache file %s: %s\n", WL1251_CACHE_FILE, strerror(errno));
+		unlink(WL1251_CACHE_FILE ".tmp");
 	}
+}
 
-#ifdef WITH_LIBNL
+#endif
 
-	nlh = wl1251_nl_connect();
-	if (nlh) {
-		if (!nvs_push_data) {
-#ifdef WITH_WL1251_NL
-			if (wl1251_nl_push_nvs(nlh, "wlan0", nvs+4, nvs_len-4) < 0)
-				fprintf(stderr, "wl1251-cal: Couldnt push NVS\n");
-			wl1251_nl_receive(nlh);
+#ifndef WL1251_CRDA_FILE
+#define WL1251_CRDA_FILE "/etc/default/crda"
 #endif
+#define WL1251_CRDA_UNSUPPORTED (-2)
+
+/*
+ * Parse one shell word at *line into value (truncated to size) and return its
+ * full length. Only plain characters and quotes without expansions are
+ * understood, anything else returns WL1251_CRDA_UNSUPPORTED.
+ */
+static int wl1251_crda_parse_word(const char **line, char *value, size_t size)
+{
+	const char *ptr = *line;
+	size_t len = 0;
+	char quote;
+
+	while (*ptr && !strchr(" \t\n", *ptr)) {
+		if (*ptr == '\'' || *ptr == '"') {
+			quote = *ptr++;
+			while (*ptr && *ptr != quote) {
+				if (quote == '"' && strchr("$`\\", *ptr))
+					return WL1251_CRDA_UNSUPPORTED;
+				if (len + 1 < size)
+					value[len] = *ptr;
+				len++;
+				ptr++;
+			}
+			if (*ptr != quote)
+				return WL1251_CRDA_UNSUPPORTED;
+			ptr++;
+			continue;
 		}
-		if (wl1251_nl_push_regdomain(nlh, regdomain) < 0)
-			fprintf(stderr, "wl1251-cal: Couldnt push regdomain\n");
-		wl1251_nl_receive(nlh);
-		wl1251_nl_destroy(nlh);
+		if (strchr("$`\\;&|<>(){}*?[~", *ptr))
+			return WL1251_CRDA_UNSUPPORTED;
+		if (len + 1 < size)
+			value[len] = *ptr;
+		len++;
+		ptr++;
 	}
 
+	value[len < size ? len : size - 1] = 0;
+	*line = ptr;
+	return len;
+}
+
+/*
+ * Evaluate the assignment-only subset of shell used by crda defaults files:
+ * comments, export, quoting, last assignment wins. Returns the length of
+ * REGDOMAIN, -1 if the file cannot be read or WL1251_CRDA_UNSUPPORTED if it
+ * needs a real shell.
+ */
+static int wl1251_crda_parse(const char *file, char *value, size_t size)
+{
+	char text[4096];
+	char line[256];
+	char word[64];
+	const char *pos;
+	const char *next;
+	const char *ptr;
+	const char *env;
+	ssize_t text_len;
+	size_t name_len;
+	int exported;
+	int found = 0;
+	int len = 0;
+	int ret = 0;
+	int fd;
+
+	/* Read in one go, stdio would allocate */
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	text_len = read(fd, text, sizeof(text));
+	close(fd);
+	if (text_len < 0)
+		return -1;
+	if (text_len == sizeof(text))
+		return WL1251_CRDA_UNSUPPORTED;
+
+	for (pos = text; pos < text + text_len; pos = next) {
+
+		next = memchr(pos, '\n', text + text_len - pos);
+		next = next ? next + 1 : text + text_len;
+
+		/* Overlong lines or line continuations */
+		if ((size_t)(next - pos) >= sizeof(line)) {
+			ret = WL1251_CRDA_UNSUPPORTED;
+			break;
+		}
+		memcpy(line, pos, next - pos);
+		line[next - pos] = 0;
+		if (strstr(line, "\\\n")) {
+			ret = WL1251_CRDA_UNSUPPORTED;
+			break;
+		}
+
+		ptr = line + strspn(line, " \t");
+		exported = strncmp(ptr, "export", 6) == 0 && (ptr[6] == ' ' || ptr[6] == '\t');
+		if (exported)
+			ptr += 6 + strspn(ptr + 6, " \t");
+
+		if (*ptr == 0 || *ptr == '\n' || *ptr == '#')
+			continue;
+
+		name_len = strspn(ptr, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_");
+		if (name_len == 0 || (*ptr >= '0' && *ptr <= '9')) {
+			ret = WL1251_CRDA_UNSUPPORTED;
+			break;
+		}
+
+		if (ptr[name_len] == '=') {
+			if (name_len == strlen("REGDOMAIN") && strncmp(ptr, "REGDOMAIN", name_len) == 0) {
+				ptr += name_len + 1;
+				ret = wl1251_crda_parse_word(&ptr, value, size);
+				len = ret;
+				found = 1;
+			} else {
+				ptr += name_len + 1;
+				ret = wl1251_crda_parse_word(&ptr, word, sizeof(word));
+			}
+			if (ret < 0)
+				break;
+		} else if (exported) {
+			/* export NAME */
+			ptr += name_len;
+		} else {
+			ret = WL1251_CRDA_UNSUPPORTED;
+			break;
+		}
+
+		/* Only a comment may follow */
+		ptr += strspn(ptr, " \t");
+		if (*ptr != 0 && *ptr != '\n' && *ptr != '#') {
+			ret = WL1251_CRDA_UNSUPPORTED;
+			break;
+		}
+
+		ret = 0;
+	}
+
+	if (ret < 0)
+		return ret;
+
+	/* Like the shell, fall back to the inherited environment */
+	if (!found) {
+		env = getenv("REGDOMAIN");
+		if (!env)
+			env = "";
+		len = strlen(env);
+		snprintf(value, size, "%s", env);
+	}
+
+	return len;
+}
+
+static int wl1251_shell_read_regdomain(char *value, size_t size)
+{
+	FILE * stream;
+	size_t len;
+	int ret;
+
+	stream = popen(". " WL1251_CRDA_FILE "; echo $REGDOMAIN", "r");
+	if (!stream)
+		return -1;
+
+	len = 0;
+
+	if (fgets(value, size, stream)) {
+		len = strlen(value);
+		if (len > 0 && value[len-1] == '\n')
+			value[--len] = 0;
+	}
+
+	ret = pclose(stream);
+	if (ret != 0)
+		return -1;
+
+	return len;
+}
+
+/* Returns the length of REGDOMAIN or -1, buf is filled like wl1251_crda_parse() */
+static int wl1251_crda_read(char *buf, size_t size)
+{
+	int len;
+
+	len = wl1251_crda_parse(WL1251_CRDA_FILE, buf, size);
+	if (len == WL1251_CRDA_UNSUPPORTED) {
+		printf("wl1251-cal: Evaluating " WL1251_CRDA_FILE " with shell\n");
+		len = wl1251_shell_read_regdomain(buf, size);
+	}
+
+	return len;
+}
+
+/* Validate a REGDOMAIN value returned by wl1251_crda_read() */
+static int wl1251_vfs_read_regdomain(const char *buf, int len, char *regdomain)
+{
+	if (len < 0)
+		return -1;
+
+	if (len == 0) {
+		fprintf(stderr, "wl1251-cal: REGDOMAIN in /etc/default/crda is not specified\n");
+		return -1;
+	} else if (len != 2) {
+		fprintf(stderr, "wl1251-cal: REGDOMAIN in /etc/default/crda is incorrect\n");
+		return -1;
+	}
+
+	memcpy(regdomain, buf, 3);
+	return 0;
+}
+
+#ifdef WITH_DBUS
+
+#define WL1251_CSD_SERVICE "com.nokia.phone.net"
+#define WL1251_CSD_PATH "/com/nokia/phone/net"
+#define WL1251_CSD_INTERFACE "Phone.Net"
+
+/* Country code from a get_registration_status reply or registration_status_change signal */
+static int wl1251_csd_parse_registration(DBusMessage *message)
+{
+	DBusError error;
+	unsigned char status;
+	dbus_uint16_t lac;
+	dbus_uint32_t cell_id, operator_code, country_code;
+
+	dbus_error_init(&error);
+	if (!dbus_message_get_args(message, &error,
+					DBUS_TYPE_BYTE, &status,
+					DBUS_TYPE_UINT16, &lac,
+					DBUS_TYPE_UINT32, &cell_id,
+					DBUS_TYPE_UINT32, &operator_code,
+					DBUS_TYPE_UINT32, &country_code,
+					DBUS_TYPE_INVALID)) {
+		fprintf(stderr, "wl1251-cal: Could not get args from %s: %s\n",
+			dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL ? "signal" : "reply", error.message);
+		dbus_error_free(&error);
+		return 0;
+	}
+
+	printf("wl1251-cal: Country code: %u\n", (unsigned int)country_code);
+	return country_code;
+}
+
+#define WL1251_OFONO_SERVICE "org.ofono"
+#define WL1251_OFONO_MANAGER_INTERFACE "org.ofono.Manager"
+#define WL1251_OFONO_NETREG_INTERFACE "org.ofono.NetworkRegistration"
+#define WL1251_OFONO_MAX_MODEMS 4
+
+static DBusPendingCall *wl1251_dbus_call(DBusConnection *connection, const char *service, const char *path, const char *interface, const char *method, int timeout)
+{
+	DBusMessage *message;
+	DBusPendingCall *pending = NULL;
+
+	message = dbus_message_new_method_call(service, path, interface, method);
+	if (!message || !dbus_connection_send_with_reply(connection, message, &pending, timeout) || !pending)
+		fprintf(stderr, "wl1251-cal: Failed to call %s.%s: %s\n", interface, method, strerror(ENOMEM));
+	WL1251_PROBE(dbus_call, service, method, pending);
+
+	if (message)
+		dbus_message_unref(message);
+	return pending;
+}
+
+/* Reply of a completed call, NULL and a message if it failed */
+static DBusMessage *wl1251_dbus_reply(DBusPendingCall *pending, const char *what)
+{
+	DBusError error;
+	DBusMessage *reply;
+
+	reply = dbus_pending_call_steal_reply(pending);
+	dbus_pending_call_unref(pending);
+	if (!reply) {
+		WL1251_PROBE(dbus_reply, what, pending, -1);
+		fprintf(stderr, "wl1251-cal: Failed to ask %s\n", what);
+		return NULL;
+	}
+
+	dbus_error_init(&error);
+	if (dbus_set_error_from_message(&error, reply)) {
+		WL1251_PROBE(dbus_reply, what, pending, -1);
+		fprintf(stderr, "wl1251-cal: Failed to ask %s: %s\n", what, error.message);
+		dbus_error_free(&error);
+		dbus_message_unref(reply);
+		return NULL;
+	}
+
+	WL1251_PROBE(dbus_reply, what, pending, 0);
+	return reply;
+}
+
+/* Find a{sv} entry key in the dict iter points to and recurse into its variant */
+static int wl1251_dbus_dict_get(DBusMessageIter *iter, const char *key, DBusMessageIter *value)
+{
+	DBusMessageIter dict, entry;
+	const char *name;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+		return -1;
+
+	dbus_message_iter_recurse(iter, &dict);
+	while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+		dbus_message_iter_recurse(&dict, &entry);
+		if (dbus_message_iter_get_arg_type(&entry) == DBUS_TYPE_STRING) {
+			dbus_message_iter_get_basic(&entry, &name);
+			dbus_message_iter_next(&entry);
+			if (strcmp(name, key) == 0 && dbus_message_iter_get_arg_type(&entry) == DBUS_TYPE_VARIANT) {
+				dbus_message_iter_recurse(&entry, value);
+				return 0;
+			}
+		}
+		dbus_message_iter_next(&dict);
+	}
+
+	return -1;
+}
+
+/* Paths of the modems with network registration from a GetModems reply, a(oa{sv}) */
+static int wl1251_ofono_parse_modems(DBusMessage *reply, char paths[][PATH_MAX], int max)
+{
+	DBusMessageIter iter, modems, modem, interfaces, interface;
+	const char *path;
+	const char *name;
+	int count = 0;
+	int netreg;
+
+	dbus_message_iter_init(reply, &iter);
+	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
+		fprintf(stderr, "wl1251-cal: Could not get args from oFono GetModems reply\n");
+		return 0;
+	}
+
+	dbus_message_iter_recurse(&iter, &modems);
+	while (count < max && dbus_message_iter_get_arg_type(&modems) == DBUS_TYPE_STRUCT) {
+		dbus_message_iter_recurse(&modems, &modem);
+		if (dbus_message_iter_get_arg_type(&modem) == DBUS_TYPE_OBJECT_PATH) {
+			dbus_message_iter_get_basic(&modem, &path);
+			dbus_message_iter_next(&modem);
+
+			/* Without an Interfaces property just try it */
+			netreg = 1;
+			if (wl1251_dbus_dict_get(&modem, "Interfaces", &interfaces) == 0 && dbus_message_iter_get_arg_type(&interfaces) == DBUS_TYPE_ARRAY) {
+				netreg = 0;
+				dbus_message_iter_recurse(&interfaces, &interface);
+				while (dbus_message_iter_get_arg_type(&interface) == DBUS_TYPE_STRING) {
+					dbus_message_iter_get_basic(&interface, &name);
+					if (strcmp(name, WL1251_OFONO_NETREG_INTERFACE) == 0)
+						netreg = 1;
+					dbus_message_iter_next(&interface);
+				}
+			}
+
+			if (netreg && strlen(path) < PATH_MAX)
+				strcpy(paths[count++], path);
+		}
+		dbus_message_iter_next(&modems);
+	}
+
+	return count;
+}
+
+/* MobileCountryCode from a NetworkRegistration GetProperties reply, a{sv} */
+static int wl1251_ofono_parse_netreg(DBusMessage *reply)
+{
+	DBusMessageIter iter, value;
+	const char *mcc;
+	int country_code;
+
+	dbus_message_iter_init(reply, &iter);
+	if (wl1251_dbus_dict_get(&iter, "MobileCountryCode", &value) < 0 || dbus_message_iter_get_arg_type(&value) != DBUS_TYPE_STRING)
+		return 0;
+
+	dbus_message_iter_get_basic(&value, &mcc);
+	country_code = atoi(mcc);
+	if (country_code > 0)
+		printf("wl1251-cal: Country code: %d (oFono)\n", country_code);
+	return country_code > 0 ? country_code : 0;
+}
+
+static void wl1251_dbus_cancel(DBusPendingCall **pending)
+{
+	if (!*pending)
+		return;
+	dbus_pending_call_cancel(*pending);
+	dbus_pending_call_unref(*pending);
+	*pending = NULL;
+}
+
+/*
+ * Ask csd (get_registration_status) and oFono (GetModems, then the
+ * NetworkRegistration properties of each modem) with pending calls on
+ * connection. The first valid country code wins and the other calls are
+ * cancelled, everything together is bounded by WL1251_COUNTRY_CODE_TIMEOUT.
+ */
+static int wl1251_dbus_read_country_code(DBusConnection *connection)
+{
+	DBusPendingCall *csd;
+	DBusPendingCall *modems;
+	DBusPendingCall *netreg[WL1251_OFONO_MAX_MODEMS] = { NULL };
+	DBusMessage *reply;
+	struct timespec start, now;
+	char paths[WL1251_OFONO_MAX_MODEMS][PATH_MAX];
+	int country_code = 0;
+	int remaining;
+	int pending;
+	int count;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	csd = wl1251_dbus_call(connection, WL1251_CSD_SERVICE, WL1251_CSD_PATH, WL1251_CSD_INTERFACE, "get_registration_status", WL1251_COUNTRY_CODE_TIMEOUT);
+	modems = wl1251_dbus_call(connection, WL1251_OFONO_SERVICE, "/", WL1251_OFONO_MANAGER_INTERFACE, "GetModems", WL1251_COUNTRY_CODE_TIMEOUT);
+
+	for (;;) {
+		if (csd && dbus_pending_call_get_completed(csd)) {
+			reply = wl1251_dbus_reply(csd, "registration status");
+			csd = NULL;
+			if (reply) {
+				country_code = wl1251_csd_parse_registration(reply);
+				dbus_message_unref(reply);
+			}
+			if (country_code)
+				break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		remaining = WL1251_COUNTRY_CODE_TIMEOUT - (int)wl1251_timespec_ms(&start, &now);
+
+		if (modems && dbus_pending_call_get_completed(modems)) {
+			reply = wl1251_dbus_reply(modems, "oFono modems");
+			modems = NULL;
+			count = 0;
+			if (reply) {
+				count = wl1251_ofono_parse_modems(reply, paths, WL1251_OFONO_MAX_MODEMS);
+				dbus_message_unref(reply);
+			}
+			for (i = 0; i < count && remaining > 0; i++)
+				netreg[i] = wl1251_dbus_call(connection, WL1251_OFONO_SERVICE, paths[i], WL1251_OFONO_NETREG_INTERFACE, "GetProperties", remaining);
+		}
+
+		pending = csd || modems;
+		for (i = 0; i < WL1251_OFONO_MAX_MODEMS; i++) {
+			if (netreg[i] && dbus_pending_call_get_completed(netreg[i])) {
+				reply = wl1251_dbus_reply(netreg[i], "oFono network registration");
+				netreg[i] = NULL;
+				if (reply) {
+					country_code = wl1251_ofono_parse_netreg(reply);
+					dbus_message_unref(reply);
+				}
+				if (country_code)
+					break;
+			}
+			if (netreg[i])
+				pending = 1;
+		}
+		if (country_code || !pending)
+			break;
+
+		if (remaining <= 0) {
+			fprintf(stderr, "wl1251-cal: No country code from csd or oFono within %d ms\n", WL1251_COUNTRY_CODE_TIMEOUT);
+			break;
+		}
+
+		/* Replies complete their pending calls when they are dispatched */
+		if (!dbus_connection_read_write_dispatch(connection, remaining)) {
+			fprintf(stderr, "wl1251-cal: Lost dbus connection while asking for country code\n");
+			break;
+		}
+	}
+
+	wl1251_dbus_cancel(&csd);
+	wl1251_dbus_cancel(&modems);
+	for (i = 0; i < WL1251_OFONO_MAX_MODEMS; i++)
+		wl1251_dbus_cancel(&netreg[i]);
+
+	return country_code;
+}
+
+#endif
+
+/*
+ * Every device access of a provisioning run goes through a transport. The
+ * real one reads CAL from the MTD and talks to DBus, sysfs and netlink, the
+ * fake one (--fake, WITH_FAKE builds) answers in process so that the whole
+ * flow can be timed and its failure paths exercised on any Linux machine.
+ * nl_* after a failed nl_open() are never called. uevent_recv() returns
+ * the next firmware uevent sent by root, 0 once no more will come.
+ * registration_next() waits up to timeout ms for a Phone.Net registration
+ * change and returns 1 with its country code, 0 without one and -1 once
+ * none will come. A transport without registration_open cannot --daemon.
+ */
+struct wl1251_transport {
+	const char *name;
+	int (*cal_open)(const char *image, struct cal **c);
+	int (*country_code)(void);
+	int (*sysfs_write)(const char *file, const char *value);
+	int (*sysfs_push)(const char *file, const unsigned char *nvs, unsigned long nvs_len, int from_file);
+	int (*set_mac)(char *iface, unsigned char *address);
+	int (*nl_open)(void);
+	int (*nl_set_mac)(char *iface, unsigned char *address);
+	int (*nl_push_nvs)(char *iface, const unsigned char *nvs, uint32_t nvs_size);
+	int (*nl_push_regdomain)(const char *regdomain);
+	int (*nl_wait)(int timeout);
+	int (*nl_acked)(const char *what);
+	void (*nl_close)(void);
+	int (*uevent_open)(void);
+	ssize_t (*uevent_recv)(char *buf, size_t size);
+	void (*uevent_close)(void);
+	int (*registration_open)(void);
+	int (*registration_next)(int timeout, int *country_code);
+	void (*registration_close)(void);
+};
+
+/* image is a file holding a copy of the CAL partition, NULL for the MTD */
+static int wl1251_real_cal_open(const char *image, struct cal **c)
+{
+#ifndef WITH_LIBCAL
+	if (image)
+		return cal_init_file(image, c);
+#else
+	(void)image;
+#endif
+	return cal_init(c);
+}
+
+static int wl1251_real_country_code(void)
+{
+#ifdef WITH_DBUS
+	DBusError error;
+	DBusConnection *conn;
+	int country_code;
+
+	if (wl1251_dl_dbus_load() < 0)
+		return 0;
+
+	dbus_error_init(&error);
+	conn = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
+	if (!conn) {
+		fprintf(stderr, "wl1251-cal: couldn't get dbus system bus. %s\n", error.message);
+		dbus_error_free(&error);
+		return 0;
+	}
+
+	country_code = wl1251_dbus_read_country_code(conn);
+	dbus_connection_unref(conn);
+	return country_code;
+#else
+	return 0;
+#endif
+}
+
+#ifdef WITH_LIBNL
+
+static struct wl1251_nl wl1251_real_nl;
+
+static int wl1251_real_nl_open(void)
+{
+	return wl1251_nl_open(&wl1251_real_nl);
+}
+
+static int wl1251_real_nl_set_mac(char *iface, unsigned char *address)
+{
+	return wl1251_nl_set_mac_address(&wl1251_real_nl, iface, address);
+}
+
+/* Without the wl1251 family the NVS only goes through sysfs */
+static int wl1251_real_nl_push_nvs(char *iface, const unsigned char *nvs, uint32_t nvs_size)
+{
+#ifdef WITH_WL1251_NL
+	return wl1251_nl_push_nvs(&wl1251_real_nl, iface, nvs, nvs_size);
+#else
+	(void)iface;
+	(void)nvs;
+	(void)nvs_size;
+	return 0;
+#endif
+}
+
+static int wl1251_real_nl_push_regdomain(const char *regdomain)
+{
+	return wl1251_nl_push_regdomain(&wl1251_real_nl, regdomain);
+}
+
+static int wl1251_real_nl_wait(int timeout)
+{
+	return wl1251_nl_wait(&wl1251_real_nl, timeout);
+}
+
+static int wl1251_real_nl_acked(const char *what)
+{
+	return wl1251_nl_acked(&wl1251_real_nl, what);
+}
+
+static void wl1251_real_nl_close(void)
+{
+	wl1251_nl_close(&wl1251_real_nl);
+}
+
+#else
+
+static int wl1251_real_nl_open(void)
+{
+	return -1;
+}
+
+#endif
+
+#if defined(WITH_DBUS) && defined(WITH_LIBNL)
+
+static DBusConnection *wl1251_real_registration_conn;
+
+static int wl1251_real_registration_open(void)
+{
+	DBusError error;
+
+	if (wl1251_dl_dbus_load() < 0)
+		return -1;
+
+	dbus_error_init(&error);
+	wl1251_real_registration_conn = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
+	if (!wl1251_real_registration_conn) {
+		fprintf(stderr, "wl1251-cal: couldn't get dbus system bus. %s\n", error.message);
+		dbus_error_free(&error);
+		return -1;
+	}
+
+	dbus_bus_add_match(wl1251_real_registration_conn, "type='signal',interface='" WL1251_CSD_INTERFACE "',member='registration_status_change'", &error);
+	if (dbus_error_is_set(&error)) {
+		fprintf(stderr, "wl1251-cal: Cannot subscribe to registration changes: %s\n", error.message);
+		dbus_error_free(&error);
+		dbus_connection_unref(wl1251_real_registration_conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int wl1251_real_registration_next(int timeout, int *country_code)
+{
+	DBusMessage *message;
+
+	message = dbus_connection_pop_message(wl1251_real_registration_conn);
+	if (!message) {
+		if (!dbus_connection_read_write(wl1251_real_registration_conn, timeout)) {
+			fprintf(stderr, "wl1251-cal: Lost dbus connection\n");
+			return -1;
+		}
+		message = dbus_connection_pop_message(wl1251_real_registration_conn);
+		if (!message)
+			return 0;
+	}
+
+	if (!dbus_message_is_signal(message, WL1251_CSD_INTERFACE, "registration_status_change")) {
+		dbus_message_unref(message);
+		return 0;
+	}
+
+	*country_code = wl1251_csd_parse_registration(message);
+	dbus_message_unref(message);
+	return 1;
+}
+
+static void wl1251_real_registration_close(void)
+{
+	dbus_connection_unref(wl1251_real_registration_conn);
+}
+
+#endif
+
+static const struct wl1251_transport wl1251_real_transport = {
+	.name = "real",
+	.cal_open = wl1251_real_cal_open,
+	.country_code = wl1251_real_country_code,
+	.sysfs_write = wl1251_sysfs_write,
+	.sysfs_push = wl1251_sysfs_push,
+	.set_mac = wl1251_set_mac_address,
+	.nl_open = wl1251_real_nl_open,
+#ifdef WITH_LIBNL
+	.nl_set_mac = wl1251_real_nl_set_mac,
+	.nl_push_nvs = wl1251_real_nl_push_nvs,
+	.nl_push_regdomain = wl1251_real_nl_push_regdomain,
+	.nl_wait = wl1251_real_nl_wait,
+	.nl_acked = wl1251_real_nl_acked,
+	.nl_close = wl1251_real_nl_close,
+#endif
+	.uevent_open = wl1251_real_uevent_open,
+	.uevent_recv = wl1251_real_uevent_recv,
+	.uevent_close = wl1251_real_uevent_close,
+#if defined(WITH_DBUS) && defined(WITH_LIBNL)
+	.registration_open = wl1251_real_registration_open,
+	.registration_next = wl1251_real_registration_next,
+	.registration_close = wl1251_real_registration_close,
+#endif
+};
+
+#ifdef WITH_FAKE
+
+#define WL1251_FAKE_MAX_PENDING 4
+
+enum wl1251_fake_mode {
+	WL1251_FAKE_OK,
+	WL1251_FAKE_FAIL,
+	WL1251_FAKE_MISSING,
+};
+
+/*
+ * State of the fake devices. The Phone.Net service answers with mcc after
+ * mcc_delay ms and sends signals registration changes signal_delay ms
+ * apart, the genl families ack or fail every request after nl_delay ms, the
+ * kernel announces uevents NVS requests and the firmware sysfs directory
+ * checks the loading protocol and keeps a checksum of the data instead of
+ * the data.
+ */
+static struct wl1251_fake {
+	int mcc;
+	int mcc_delay;
+	enum wl1251_fake_mode nl;
+	int nl_delay;
+	enum wl1251_fake_mode sysfs;
+	enum wl1251_fake_mode mac;
+	int uevents;
+	int signals;
+	int signal_delay;
+	int loading;
+	unsigned long data_len;
+	uint32_t data_sum;
+	unsigned int pending;
+	unsigned int acked;
+	const char *requests[WL1251_FAKE_MAX_PENDING];
+	int uevent;
+	int signal;
+	int signal_waited;
+} fake;
+
+static void wl1251_fake_sleep(int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static int wl1251_fake_country_code(void)
+{
+	if (fake.mcc_delay >= WL1251_COUNTRY_CODE_TIMEOUT) {
+		wl1251_fake_sleep(WL1251_COUNTRY_CODE_TIMEOUT);
+		fprintf(stderr, "wl1251-cal: No country code from csd or oFono within %d ms\n", WL1251_COUNTRY_CODE_TIMEOUT);
+		return 0;
+	}
+
+	wl1251_fake_sleep(fake.mcc_delay);
+	if (fake.mcc)
+		printf("wl1251-cal: Country code: %d (fake Phone.Net)\n", fake.mcc);
+	return fake.mcc;
+}
+
+static int wl1251_fake_sysfs_write(const char *file, const char *value)
+{
+	if (fake.sysfs == WL1251_FAKE_MISSING) {
+		fprintf(stderr, "wl1251-cal: Cannot open file %s: %s\n", file, strerror(ENOENT));
+		return -1;
+	}
+
+	if (strcmp(value, "1\n") == 0) {
+		fake.loading = 1;
+		fake.data_len = 0;
+		fake.data_sum = 2166136261U;
+		return 0;
+	}
+
+	if (!fake.loading) {
+		fprintf(stderr, "wl1251-cal: fake firmware: loading %.*s without a request\n", (int)strcspn(value, "\n"), value);
+		return -1;
+	}
+
+	fake.loading = 0;
+	if (strcmp(value, "0\n") == 0)
+		printf("wl1251-cal: fake firmware: loaded %lu bytes, FNV-1a %08x\n", fake.data_len, (unsigned int)fake.data_sum);
+	else
+		printf("wl1251-cal: fake firmware: request aborted\n");
+	return 0;
+}
+
+static int wl1251_fake_sysfs_push(const char *file, const unsigned char *nvs, unsigned long nvs_len, int from_file)
+{
+	unsigned long i;
+
+	(void)from_file;
+
+	if (nvs_len < 4) {
+		fprintf(stderr, "wl1251-cal: Cannot push NVS of %lu bytes to file %s\n", nvs_len, file);
+		return -1;
+	}
+
+	if (fake.sysfs == WL1251_FAKE_MISSING) {
+		fprintf(stderr, "wl1251-cal: Cannot open file %s: %s\n", file, strerror(ENOENT));
+		return -1;
+	}
+
+	if (fake.sysfs == WL1251_FAKE_FAIL || !fake.loading) {
+		fprintf(stderr, "wl1251-cal: Cannot push NVS to file %s: %s\n", file, strerror(fake.loading ? EIO : ENODEV));
+		return -1;
+	}
+
+	/* FNV-1a of what the driver would get, like wl1251_push_nvs_data() without the prefix */
+	for (i = 4; i < nvs_len; i++)
+		fake.data_sum = (fake.data_sum ^ nvs[i]) * 16777619U;
+	fake.data_len += nvs_len - 4;
+	return 0;
+}
+
+static int wl1251_fake_set_mac(char *iface, unsigned char *address)
+{
+	if (fake.mac == WL1251_FAKE_FAIL) {
+		fprintf(stderr, "wl1251-cal: ioctl SIOCSIFHWADDR failed: %s\n", strerror(EPERM));
+		return -1;
+	}
+
+	printf("wl1251-cal: fake SIOCSIFHWADDR %s %02x:%02x:%02x:%02x:%02x:%02x\n", iface,
+	       address[5], address[4], address[3], address[2], address[1], address[0]);
+	return 0;
+}
+
+static int wl1251_fake_nl_open(void)
+{
+	if (fake.nl == WL1251_FAKE_MISSING) {
+		fprintf(stderr, "wl1251-cal: fake netlink: no generic netlink\n");
+		return -1;
+	}
+
+	fake.pending = 0;
+	printf("wl1251-cal: fake netlink: nl80211 and wl1251 families\n");
+	return 0;
+}
+
+static int wl1251_fake_nl_send(const char *what)
+{
+	if (fake.pending >= WL1251_FAKE_MAX_PENDING) {
+		fprintf(stderr, "wl1251-cal: too many netlink requests in flight for %s\n", what);
+		return -1;
+	}
+
+	fake.acked = 0;
+	fake.requests[fake.pending++] = what;
+	return 0;
+}
+
+static int wl1251_fake_nl_set_mac(char *iface, unsigned char *address)
+{
+	(void)iface;
+	(void)address;
+	return wl1251_fake_nl_send("RTM_SETLINK");
+}
+
+static int wl1251_fake_nl_push_nvs(char *iface, const unsigned char *nvs, uint32_t nvs_size)
+{
+	(void)iface;
+	(void)nvs;
+	(void)nvs_size;
+	return wl1251_fake_nl_send("WL1251_NL_CMD_NVS_PUSH");
+}
+
+static int wl1251_fake_nl_push_regdomain(const char *regdomain)
+{
+	(void)regdomain;
+	return wl1251_fake_nl_send("NL80211_CMD_REQ_SET_REG");
+}
+
+static int wl1251_fake_nl_wait(int timeout)
+{
+	unsigned int i;
+	int ret = 0;
+
+	if (!fake.pending)
+		return 0;
+
+	if (fake.nl_delay >= timeout) {
+		wl1251_fake_sleep(timeout);
+		fprintf(stderr, "wl1251-cal: timeout waiting for %u netlink acks\n", fake.pending);
+		fake.pending = 0;
+		return -1;
+	}
+
+	wl1251_fake_sleep(fake.nl_delay);
+	for (i = 0; i < fake.pending; i++)
+		printf("wl1251-cal: %s %s\n", fake.requests[i], fake.nl == WL1251_FAKE_FAIL ? "failed" : "acked");
+	for (i = 0; i < fake.pending && fake.nl == WL1251_FAKE_FAIL; i++) {
+		fprintf(stderr, "wl1251-cal: %s failed: %s\n", fake.requests[i], strerror(EINVAL));
+		ret = -1;
+	}
+
+	if (fake.nl != WL1251_FAKE_FAIL)
+		fake.acked = fake.pending;
+	fake.pending = 0;
+	return ret;
+}
+
+static int wl1251_fake_nl_acked(const char *what)
+{
+	unsigned int i;
+
+	for (i = 0; i < fake.acked; i++)
+		if (strcmp(fake.requests[i], what) == 0)
+			return 1;
+
+	return 0;
+}
+
+static void wl1251_fake_nl_close(void)
+{
+	fake.pending = 0;
+}
+
+/* Announced in turn for each NVS request: other firmware and a removal, both ignored, then the request */
+static const char *const wl1251_fake_uevents[][3] = {
+	{ "add", "/devices/platform/fake/firmware/other.bin", "other.bin" },
+	{ "remove", "/devices/platform/wl1251/firmware/wl1251-nvs.bin", "wl1251-nvs.bin" },
+	{ "add", "/devices/platform/wl1251/firmware/ti-connectivity!wl1251-nvs.bin", "ti-connectivity/wl1251-nvs.bin" },
+};
+
+#define WL1251_FAKE_UEVENTS (int)(sizeof(wl1251_fake_uevents)/sizeof(wl1251_fake_uevents[0]))
+
+static int wl1251_fake_uevent_open(void)
+{
+	fake.uevent = 0;
+	printf("wl1251-cal: fake uevents: %d NVS requests\n", fake.uevents);
+	return 0;
+}
+
+static ssize_t wl1251_fake_uevent_recv(char *buf, size_t size)
+{
+	const char *const *event;
+	int len;
+
+	if (fake.uevent >= fake.uevents * WL1251_FAKE_UEVENTS)
+		return 0;
+
+	event = wl1251_fake_uevents[fake.uevent++ % WL1251_FAKE_UEVENTS];
+	len = snprintf(buf, size, "%s@%s%cACTION=%s%cDEVPATH=%s%cSUBSYSTEM=firmware%cFIRMWARE=%s",
+		       event[0], event[1], 0, event[0], 0, event[1], 0, 0, event[2]);
+	if (len < 0 || (size_t)len >= size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return len + 1;
+}
+
+static void wl1251_fake_uevent_close(void)
+{
+	fake.uevent = 0;
+}
+
+/* Country codes of the registration changes in turn: a change, the same again, an FCC country, no coverage, another change */
+static const int wl1251_fake_registrations[] = { 262, 262, 310, 0, 244 };
+
+static int wl1251_fake_registration_open(void)
+{
+	fake.signal = 0;
+	fake.signal_waited = 0;
+	printf("wl1251-cal: fake Phone.Net: %d registration changes\n", fake.signals);
+	return 0;
+}
+
+static int wl1251_fake_registration_next(int timeout, int *country_code)
+{
+	if (fake.signal >= fake.signals) {
+		printf("wl1251-cal: fake Phone.Net: no more registration changes\n");
+		return -1;
+	}
+
+	if (fake.signal_delay - fake.signal_waited > timeout) {
+		wl1251_fake_sleep(timeout);
+		fake.signal_waited += timeout;
+		return 0;
+	}
+
+	wl1251_fake_sleep(fake.signal_delay - fake.signal_waited);
+	fake.signal_waited = 0;
+	*country_code = wl1251_fake_registrations[fake.signal++ % (sizeof(wl1251_fake_registrations)/sizeof(wl1251_fake_registrations[0]))];
+	printf("wl1251-cal: Country code: %d (fake Phone.Net)\n", *country_code);
+	return 1;
+}
+
+static void wl1251_fake_registration_close(void)
+{
+	fake.signal = 0;
+}
+
+static const struct wl1251_transport wl1251_fake_transport = {
+	.name = "fake",
+	.cal_open = wl1251_real_cal_open,
+	.country_code = wl1251_fake_country_code,
+	.sysfs_write = wl1251_fake_sysfs_write,
+	.sysfs_push = wl1251_fake_sysfs_push,
+	.set_mac = wl1251_fake_set_mac,
+	.nl_open = wl1251_fake_nl_open,
+	.nl_set_mac = wl1251_fake_nl_set_mac,
+	.nl_push_nvs = wl1251_fake_nl_push_nvs,
+	.nl_push_regdomain = wl1251_fake_nl_push_regdomain,
+	.nl_wait = wl1251_fake_nl_wait,
+	.nl_acked = wl1251_fake_nl_acked,
+	.nl_close = wl1251_fake_nl_close,
+	.uevent_open = wl1251_fake_uevent_open,
+	.uevent_recv = wl1251_fake_uevent_recv,
+	.uevent_close = wl1251_fake_uevent_close,
+	.registration_open = wl1251_fake_registration_open,
+	.registration_next = wl1251_fake_registration_next,
+	.registration_close = wl1251_fake_registration_close,
+};
+
+static int wl1251_fake_number(const char *opt, size_t len, const char *key, int *value)
+{
+	size_t n = strlen(key);
+	char *end;
+	long ms;
+
+	if (len <= n || strncmp(opt, key, n) != 0)
+		return 0;
+
+	ms = strtol(opt + n, &end, 10);
+	if (end != opt + len || ms < 0 || ms > 60000)
+		return -1;
+
+	*value = ms;
+	return 1;
+}
+
+/*
+ * Parse the --fake options, comma separated: mcc=N, mcc-delay=MS,
+ * nl=ack|fail|missing, nl-delay=MS, sysfs=ok|fail|missing, mac=ok|fail,
+ * uevents=N, signals=N and signal-delay=MS.
+ */
+static int wl1251_fake_parse(const char *spec)
+{
+	const char *opt;
+	size_t len;
+	int ret;
+
+	for (opt = spec; *opt; opt += len + (opt[len] == ',')) {
+		len = strcspn(opt, ",");
+
+#define WL1251_FAKE_OPT(name) (len == strlen(name) && strncmp(opt, name, len) == 0)
+		if (WL1251_FAKE_OPT("nl=ack"))
+			fake.nl = WL1251_FAKE_OK;
+		else if (WL1251_FAKE_OPT("nl=fail"))
+			fake.nl = WL1251_FAKE_FAIL;
+		else if (WL1251_FAKE_OPT("nl=missing"))
+			fake.nl = WL1251_FAKE_MISSING;
+		else if (WL1251_FAKE_OPT("sysfs=ok"))
+			fake.sysfs = WL1251_FAKE_OK;
+		else if (WL1251_FAKE_OPT("sysfs=fail"))
+			fake.sysfs = WL1251_FAKE_FAIL;
+		else if (WL1251_FAKE_OPT("sysfs=missing"))
+			fake.sysfs = WL1251_FAKE_MISSING;
+		else if (WL1251_FAKE_OPT("mac=ok"))
+			fake.mac = WL1251_FAKE_OK;
+		else if (WL1251_FAKE_OPT("mac=fail"))
+			fake.mac = WL1251_FAKE_FAIL;
+		else if ((ret = wl1251_fake_number(opt, len, "mcc=", &fake.mcc)) != 0 ||
+			 (ret = wl1251_fake_number(opt, len, "mcc-delay=", &fake.mcc_delay)) != 0 ||
+			 (ret = wl1251_fake_number(opt, len, "nl-delay=", &fake.nl_delay)) != 0 ||
+			 (ret = wl1251_fake_number(opt, len, "uevents=", &fake.uevents)) != 0 ||
+			 (ret = wl1251_fake_number(opt, len, "signals=", &fake.signals)) != 0 ||
+			 (ret = wl1251_fake_number(opt, len, "signal-delay=", &fake.signal_delay)) != 0) {
+			if (ret < 0)
+				return -1;
+		} else if (len) {
+			return -1;
+		}
+#undef WL1251_FAKE_OPT
+	}
+
+	return 0;
+}
+
+#endif
+
+static const struct wl1251_transport *transport = &wl1251_real_transport;
+
+/* Answer the firmware request whose sysfs directory is dir */
+static int wl1251_uevent_answer(const char *dir, const unsigned char *nvs, unsigned long nvs_len, int from_file)
+{
+	char loading[PATH_MAX];
+	char data[PATH_MAX];
+	int ret;
+
+	if (snprintf(loading, sizeof(loading), "%s/loading", dir) >= (int)sizeof(loading) ||
+	    snprintf(data, sizeof(data), "%s/data", dir) >= (int)sizeof(data)) {
+		fprintf(stderr, "wl1251-cal: Firmware request path %s is too long\n", dir);
+		return -1;
+	}
+
+	if (transport->sysfs_write(loading, "1\n") < 0)
+		return -1;
+
+	ret = transport->sysfs_push(data, nvs, nvs_len, from_file);
+
+	/* -1 aborts the request, the driver then fails instead of waiting for a timeout */
+	if (transport->sysfs_write(loading, ret ? "-1\n" : "0\n") < 0)
+		ret = -1;
+
+	if (!ret)
+		printf("wl1251-cal: Answered firmware request %s\n", dir);
+
+	return ret;
+}
+
+static int wl1251_uevent_is_nvs(const char *firmware)
+{
+	return strcmp(firmware, "ti-connectivity/wl1251-nvs.bin") == 0 || strcmp(firmware, "wl1251-nvs.bin") == 0;
+}
+
+/*
+ * Serve firmware requests for the NVS as the kernel announces them on the
+ * uevent socket, until killed or the fake kernel has no more. Requests made
+ * before we started listening are picked up from sysfs first.
+ */
+static int wl1251_uevent_listen(const char *sysfs, const unsigned char *nvs, unsigned long nvs_len, int from_file)
+{
+	static const char *const pending[] = {
+		"/class/firmware/ti-connectivity!wl1251-nvs.bin",
+		"/class/firmware/wl1251-nvs.bin",
+	};
+	char buf[WL1251_UEVENT_BUFFER];
+	char dir[PATH_MAX];
+	const char *action, *subsystem, *firmware, *devpath;
+	const char *key;
+	unsigned int i;
+	ssize_t len;
+
+	if (transport->uevent_open() < 0)
+		return 1;
+
+	for (i = 0; i < sizeof(pending)/sizeof(pending[0]); ++i) {
+		snprintf(dir, sizeof(dir), "%s%s", sysfs, pending[i]);
+		if (access(dir, F_OK) == 0)
+			wl1251_uevent_answer(dir, nvs, nvs_len, from_file);
+	}
+
+	printf("wl1251-cal: Waiting for firmware requests\n");
+	fflush(stdout);
+
+	while (1) {
+
+		len = transport->uevent_recv(buf, sizeof(buf) - 1);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == ENOBUFS) {
+			fprintf(stderr, "wl1251-cal: uevent socket overrun, rescanning sysfs\n");
+			for (i = 0; i < sizeof(pending)/sizeof(pending[0]); ++i) {
+				snprintf(dir, sizeof(dir), "%s%s", sysfs, pending[i]);
+				if (access(dir, F_OK) == 0)
+					wl1251_uevent_answer(dir, nvs, nvs_len, from_file);
+			}
+			continue;
+		}
+		if (len < 0) {
+			perror("wl1251-cal: Cannot receive uevent");
+			transport->uevent_close();
+			return 1;
+		}
+		if (len == 0)
+			break;
+
+		buf[len] = 0;
+		action = subsystem = firmware = devpath = NULL;
+		for (key = buf; key < buf + len; key += strlen(key) + 1) {
+			if (strncmp(key, "ACTION=", 7) == 0)
+				action = key + 7;
+			else if (strncmp(key, "SUBSYSTEM=", 10) == 0)
+				subsystem = key + 10;
+			else if (strncmp(key, "FIRMWARE=", 9) == 0)
+				firmware = key + 9;
+			else if (strncmp(key, "DEVPATH=", 8) == 0)
+				devpath = key + 8;
+		}
+
+		if (!action || !subsystem || !firmware || !devpath ||
+		    strcmp(action, "add") != 0 || strcmp(subsystem, "firmware") != 0 ||
+		    !wl1251_uevent_is_nvs(firmware))
+			continue;
+
+		if (snprintf(dir, sizeof(dir), "%s%s", sysfs, devpath) >= (int)sizeof(dir))
+			continue;
+
+		wl1251_uevent_answer(dir, nvs, nvs_len, from_file);
+		fflush(stdout);
+
+	}
+
+	transport->uevent_close();
+	return 0;
+}
+
+static void wl1251_country_code_to_regdomain(int country_code, int fcc, char *regdomain)
+{
+	const struct mcc_domain *domain = NULL;
+
+	if (country_code >= MCC_MIN && country_code <= MCC_MAX)
+		domain = &mcc_domains[country_code - MCC_MIN];
+
+	if ((country_code == 0 && fcc) || (domain && domain->fcc)) {
+		printf("wl1251-cal: FCC country\n");
+		memcpy(regdomain, "US", 3);
+		return;
+	}
+
+	if (domain && domain->regdomain[0]) {
+		printf("wl1251-cal: Regulatory domain: %s\n", domain->regdomain);
+		memcpy(regdomain, domain->regdomain, 3);
+		return;
+	}
+
+	printf("wl1251-cal: Country code is unknown, setting regulatory domain: EU\n");
+	memcpy(regdomain, "EU", 3);
+}
+
+/*
+ * Default NVS, the per-channel TX power limits of the band edge channels 1
+ * and 11 are parameters so the regdomain variants are built at compile time.
+ */
+#define WL1251_DEFAULT_NVS(ch1_lo, ch1_hi, ch11_lo, ch11_hi) { \
+	0x00, 0x00, 0x00, 0x00, 0x02, 0x11, 0x56, 0x06, 0x1c, 0x06, 0x01, 0x16, 0x60, 0x03, \
+	0x07, 0x01, 0x09, 0x56, 0x12, 0x00, 0x00, 0x00, 0x01, 0x0d, 0x56, 0x40, 0x00, 0x00, \
+	0x00, 0x02, 0x6d, 0x54, 0x09, 0x03, 0x07, 0x20, 0x00, 0x00, 0x00, 0x00, 0x01, 0x15, \
+	0x58, 0xa4, 0x00, 0x00, 0x00, 0x01, 0x31, 0x56, 0x02, 0x02, 0x00, 0x00, 0x01, 0x35, \
+	0x56, 0x04, 0xd1, 0x13, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, \
+	0x62, 0x00, 0x64, 0x00, 0x76, 0x00, 0xae, 0x00, 0xd4, 0x00, 0x2a, 0x01, 0x33, 0x01, \
+	0x35, 0x01, 0x4b, 0x01, 0x0d, 0x02, 0x3f, 0x02, 0x5b, 0x02, 0x6d, 0x02, 0x79, 0x02, \
+	0xa3, 0x02, 0xae, 0x02, 0x00, 0x00, 0x01, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1b, 0x02, 0x00, 0x00, \
+	0x3e, 0x00, 0x7a, 0x00, 0xb6, 0x00, 0xcc, 0x00, 0xe3, 0x00, 0xfa, 0x00, 0x00, 0x00, \
+	0x3c, 0x00, 0x78, 0x00, 0xb4, 0x00, 0xf0, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x78, 0x00, \
+	0xb4, 0x00, 0xf0, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x78, 0x00, 0xb4, 0x00, 0xf0, 0x00, \
+	0x00, 0x00, 0x3c, 0x00, 0x78, 0x00, 0xb4, 0x00, 0xf0, 0x00, 0x09, 0x04, 0x44, 0x10, \
+	0xfc, 0x03, 0x45, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x0e, 0x08, 0x01, 0x3b, 0x00, 0x24, 0x00, \
+	0x58, 0x04, 0x64, 0x00, 0xc0, 0x06, 0x85, 0x09, 0xa0, 0x00, 0x3c, 0x00, 0x24, 0x00, \
+	0x00, 0x04, 0x50, 0x00, 0xd0, 0x01, 0x60, 0x13, 0xd0, 0x00, 0x3c, 0x00, 0x24, 0x00, \
+	0x00, 0x04, 0x50, 0x00, 0xd0, 0x01, 0x8c, 0x14, 0x08, 0x01, 0x3c, 0x00, 0x24, 0x00, \
+	0x00, 0x04, 0x50, 0x00, 0xd0, 0x01, 0xb8, 0x15, 0x08, 0x01, 0x3c, 0x00, 0x24, 0x00, \
+	0x00, 0x04, 0x50, 0x00, 0xd0, 0x01, 0x44, 0x16, 0xb5, 0x00, 0x52, 0x00, 0x24, 0x00, \
+	0x87, 0x04, 0x64, 0x00, 0x6e, 0x02, 0x85, 0x09, 0x01, 0x07, 0x10, 0x00, 0x00, 0x40, \
+	0x00, 0x00, 0x01, 0x00, 0x00, 0x05, 0x04, 0x00, 0x00, 0xfe, 0xfa, 0x00, 0x00, 0x00, \
+	0xff, 0xff, 0xff, 0xff, 0xfd, 0xfd, 0xfd, 0xfd, 0xfb, 0x00, 0xfd, 0xfa, 0xf7, 0x30, \
+	0x04, ch1_lo, 0x00, 0x00, ch1_hi, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, \
+	0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, \
+	0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, ch11_lo, \
+	0x00, 0x00, ch11_hi, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, 0x0f, 0x0f, 0x00, 0x00, \
+	0x0f, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, \
+	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, \
+	0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, \
+	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, \
+	0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, \
+	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, \
+	0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, \
+	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, \
+	0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, \
+	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x30, 0x01, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x0d, 0x02, 0x94, 0x05, 0x94, 0x05, 0x94, 0x05, 0x94, \
+	0x05, 0x95, 0x05, 0x94, 0x05, 0x82, 0x00, 0x9b, 0x00, 0x9b, 0x00, 0x9b, 0x00, 0x9b, \
+	0x00, 0xc3, 0x00, 0x01, 0x00, 0x10, 0x01, 0x1e, 0x18, 0x18, 0x1e, 0x00, 0x22, 0x00, \
+	0x00, 0x24, 0x25, 0x26, 0x27, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x01, 0x20, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x05, 0x07, 0x05, 0x03, 0x00, 0x08, \
+	0x02, 0x02, 0x02, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x0a, 0x06, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x01, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+	0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, \
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff \
+}
+
+static const unsigned char default_nvs[] = WL1251_DEFAULT_NVS(0x0f, 0x0f, 0x0f, 0x0f);
+static const unsigned char default_nvs_fcc[] = WL1251_DEFAULT_NVS(0x02, 0x09, 0x02, 0x09);
+
+/*
+ * NVS layout: a 4 byte prefix which is not pushed, register bursts of
+ * { u8 count, le16 address, count * le32 value } ended by a zero count, and
+ * 7 bytes after that zero the radio tables, which are uploaded as one blob.
+ */
+#define WL1251_NVS_PREFIX 4
+#define WL1251_NVS_TABLES_SKIP 7
+#define WL1251_NVS_TABLES_LEN 688
+#define WL1251_NVS_MAC_REG 0x546c
+#define WL1251_NVS_TX_POWER 269	/* Offset in the tables, 4 bytes per 2.4GHz channel */
+
+struct wl1251_nvs {
+	unsigned long mac;		/* MAC address in the WL1251_NVS_MAC_REG burst */
+	unsigned long tables;
+	unsigned long tx_power;		/* Channel 1 TX power limits */
+};
+
+static int wl1251_nvs_parse(const unsigned char *nvs, unsigned long nvs_len, struct wl1251_nvs *layout)
+{
+	unsigned long offset = WL1251_NVS_PREFIX;
+	unsigned long count;
+	unsigned int address;
+
+	memset(layout, 0, sizeof(*layout));
+
+	while (offset < nvs_len && nvs[offset]) {
+		count = nvs[offset];
+		address = (nvs[offset+1] & 0xfe) | (nvs[offset+2] << 8);
+		if (offset + 3 + count * 4 > nvs_len) {
+			fprintf(stderr, "wl1251-cal: Unknown NVS layout: register burst at %lu is truncated\n", offset);
+			return -1;
+		}
+		if (address == WL1251_NVS_MAC_REG && count >= 2)
+			layout->mac = offset + 3;
+		offset += 3 + count * 4;
+	}
+
+	if (offset >= nvs_len) {
+		fprintf(stderr, "wl1251-cal: Unknown NVS layout: register bursts are not terminated\n");
+		return -1;
+	}
+
+	if (!layout->mac) {
+		fprintf(stderr, "wl1251-cal: Unknown NVS layout: no MAC address register burst\n");
+		return -1;
+	}
+
+	layout->tables = offset + WL1251_NVS_TABLES_SKIP;
+	if (nvs_len != layout->tables + WL1251_NVS_TABLES_LEN) {
+		fprintf(stderr, "wl1251-cal: Unknown NVS layout: radio tables are %ld bytes, expected %d\n", (long)(nvs_len - layout->tables), WL1251_NVS_TABLES_LEN);
+		return -1;
+	}
+
+	layout->tx_power = layout->tables + WL1251_NVS_TX_POWER;
+	return 0;
+}
+
+/* Returns 1 if the NVS was changed */
+static int wl1251_nvs_set_mac(unsigned char *nvs, const struct wl1251_nvs *layout, const unsigned char *address)
+{
+	if (memcmp(nvs + layout->mac, address, 6) == 0)
+		return 0;
+	memcpy(nvs + layout->mac, address, 6);
+	return 1;
+}
+
+/* FCC needs lower limits on the band edge channels, returns 1 if the NVS was changed */
+static int wl1251_nvs_set_fcc_power(unsigned char *nvs, const struct wl1251_nvs *layout)
+{
+	static const int channels[] = { 1, 11 };
+	unsigned char *limits;
+	unsigned int i;
+	int changed = 0;
+
+	for (i = 0; i < sizeof(channels)/sizeof(channels[0]); ++i) {
+		limits = nvs + layout->tx_power + (channels[i] - 1) * 4;
+		changed |= limits[0] != 2 || limits[3] != 9;
+		limits[0] = 2;
+		limits[3] = 9;
+	}
+
+	return changed;
+}
+
+/*
+ * Returns the NVS to push. A loaded NVS is patched in place, otherwise the
+ * default variant for the regdomain is used as is, or copied into *nvs when
+ * the MAC address has to be set. *patched tells if a loaded NVS was changed.
+ */
+static const unsigned char *wl1251_nvs_select(unsigned char **nvs, unsigned long *nvs_len, const char *regdomain, const unsigned char *address, int *patched)
+{
+	const unsigned char *variant;
+	struct wl1251_nvs layout;
+	int fcc_power = memcmp(regdomain, "US", 3) == 0;
+	int set_mac = memcmp(address, "\0\0\0\0\0\0", 6) != 0;
+
+	*patched = 0;
+
+	if (*nvs && wl1251_nvs_parse(*nvs, *nvs_len, &layout) < 0) {
+		fprintf(stderr, "wl1251-cal: Rejecting NVS, using default one\n");
+		wl1251_free(*nvs);
+		*nvs = NULL;
+	}
+
+	if (*nvs) {
+		if (fcc_power)
+			*patched |= wl1251_nvs_set_fcc_power(*nvs, &layout);
+	} else {
+		variant = fcc_power ? default_nvs_fcc : default_nvs;
+		*nvs_len = sizeof(default_nvs);
+		if (!set_mac)
+			return variant;
+		*nvs = wl1251_alloc(sizeof(default_nvs));
+		if (!*nvs) {
+			perror("wl1251-cal: malloc failed");
+			return variant;
+		}
+		memcpy(*nvs, variant, sizeof(default_nvs));
+		wl1251_nvs_parse(*nvs, *nvs_len, &layout);
+	}
+
+	if (set_mac)
+		*patched |= wl1251_nvs_set_mac(*nvs, &layout, address);
+
+	return *nvs;
+}
+
+#ifdef WL1251_DAEMON
+
+static volatile sig_atomic_t wl1251_daemon_stop;
+static volatile sig_atomic_t wl1251_daemon_dump;
+
+struct wl1251_daemon_stats {
+	unsigned long signals;
+	unsigned long pushes;
+	double latency_min;	/* Signal receipt to netlink send, ms */
+	double latency_max;
+	double latency_sum;
+};
+
+static void wl1251_daemon_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		wl1251_daemon_dump = 1;
+	else
+		wl1251_daemon_stop = 1;
+}
+
+static void wl1251_daemon_print_stats(const struct wl1251_daemon_stats *stats)
+{
+	printf("wl1251-cal: %lu registration signals, %lu regdomain pushes", stats->signals, stats->pushes);
+	if (stats->pushes)
+		printf(", signal to send min %.3f avg %.3f max %.3f ms",
+			stats->latency_min, stats->latency_sum / stats->pushes, stats->latency_max);
+	printf("\n");
+	fflush(stdout);
+}
+
+/*
+ * Stay resident and follow Phone.Net registration changes, pushing a new
+ * regdomain over one long lived netlink socket whenever it changes.
+ * SIGUSR1 prints statistics, SIGTERM and SIGINT stop.
+ */
+static int wl1251_daemon(int fcc, const char *regdomain)
+{
+	struct sigaction sa;
+	struct timespec received, sent;
+	struct wl1251_daemon_stats stats;
+	char current[3], next[3];
+	int country_code;
+	double ms;
+	int ret;
+
+	memset(&stats, 0, sizeof(stats));
+	memcpy(current, regdomain, 3);
+
+	if (transport->registration_open() < 0)
+		return 1;
+
+	if (transport->nl_open() < 0) {
+		transport->registration_close();
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wl1251_daemon_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	printf("wl1251-cal: Waiting for registration changes, regulatory domain: %s\n", current);
+	fflush(stdout);
+
+	while (!wl1251_daemon_stop) {
+
+		if (wl1251_daemon_dump) {
+			wl1251_daemon_dump = 0;
+			wl1251_daemon_print_stats(&stats);
+		}
+
+		fflush(stdout);
+
+		ret = transport->registration_next(1000, &country_code);
+		if (ret < 0)
+			break;
+		if (ret == 0)
+			continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &received);
+		stats.signals++;
+
+		/* Out of coverage, keep what we have */
+		if (!country_code && !fcc)
+			continue;
+
+		wl1251_country_code_to_regdomain(country_code, fcc, next);
+		if (memcmp(next, current, 3) == 0)
+			continue;
+
+		if (transport->nl_push_regdomain(next) < 0) {
+			fprintf(stderr, "wl1251-cal: Couldnt push regdomain\n");
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &sent);
+		ms = wl1251_timespec_ms(&received, &sent);
+
+		/* Keep the old one as current so that the next signal retries */
+		if (transport->nl_wait(WL1251_NL_TIMEOUT) < 0) {
+			fprintf(stderr, "wl1251-cal: Regulatory domain %s not acked, retrying on next change\n", next);
+			continue;
+		}
+
+		if (!stats.pushes || ms < stats.latency_min)
+			stats.latency_min = ms;
+		if (ms > stats.latency_max)
+			stats.latency_max = ms;
+		stats.latency_sum += ms;
+		stats.pushes++;
+
+		printf("wl1251-cal: Regulatory domain %s pushed %.3f ms after signal\n", next, ms);
+		memcpy(current, next, 3);
+	}
+
+	wl1251_daemon_print_stats(&stats);
+	transport->nl_close();
+	transport->registration_close();
+	return 0;
+}
+
+#endif
+
+/*
+ * Everything the regdomain depends on apart from CAL: the network country
+ * code and /etc/default/crda. It runs next to CAL and NVS loading, main()
+ * joins it right before the NVS is patched.
+ */
+struct wl1251_regdomain_query {
+	pthread_t thread;
+	int started;
+	int country_code;
+	char crda[4];
+	int crda_len;
+	struct timespec start;
+	double ms;
+};
+
+static void *wl1251_regdomain_query_run(void *arg)
+{
+	struct wl1251_regdomain_query *query = arg;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &query->start);
+	query->country_code = transport->country_code();
+
+	/* Only needed without country code and FCC, which is not known yet */
+	query->crda_len = -1;
+	if (!query->country_code)
+		query->crda_len = wl1251_crda_read(query->crda, sizeof(query->crda));
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	query->ms = wl1251_timespec_ms(&query->start, &end);
+	WL1251_PROBE(query_done, query->country_code, query->crda_len, (long)(query->ms * 1000));
+	return NULL;
+}
+
+static void wl1251_regdomain_query_start(struct wl1251_regdomain_query *query)
+{
+#ifdef WITH_STATIC_ARENA
+	/* A thread allocates its TLS and without DBus only crda is read, join runs it */
+	query->started = 0;
+#else
+	query->started = pthread_create(&query->thread, NULL, wl1251_regdomain_query_run, query) == 0;
+	if (!query->started)
+		fprintf(stderr, "wl1251-cal: Cannot start regdomain query thread, running it later\n");
+#endif
+}
+
+static void wl1251_regdomain_query_join(struct wl1251_regdomain_query *query)
+{
+	if (query->started)
+		pthread_join(query->thread, NULL);
+	else
+		wl1251_regdomain_query_run(query);
+}
+
+/*
+ * Returns 1 if the NVS came from the firmware directory. Without any NVS *nvs
+ * stays NULL and wl1251_nvs_select() picks a default one.
+ */
+static int wl1251_read_nvs_data(struct cal *c, unsigned char *address, int *fcc, unsigned char **nvs, unsigned long *nvs_len)
+{
+	wl1251_cal_read(c, address, fcc, nvs, nvs_len);
+	wl1251_timing_mark("cal");
+	if (*nvs)
+		return 0;
+
+	wl1251_vfs_read_nvs(nvs, nvs_len);
+	wl1251_timing_mark("firmware");
+	if (*nvs)
+		return 1;
+
+	*nvs_len = 0;
+	return 0;
+}
+
+#ifndef WITH_LIBCAL
+
+/* Drop stale section versions from CAL, for --compact-cal */
+static int wl1251_cal_compact(const char *image)
+{
+	struct cal_compact_stats stats;
+	struct cal *c;
+	int ret;
+
+	if (wl1251_real_cal_open(image, &c) < 0) {
+		fprintf(stderr, "wl1251-cal: cal_init failed\n");
+		return 1;
+	}
+
+	ret = cal_compact(c, &stats);
+	cal_finish(c);
+
+	if (ret < 0) {
+		fprintf(stderr, "wl1251-cal: CAL compaction failed\n");
+		return 1;
+	}
+
+	printf("wl1251-cal: CAL compacted, reclaimed %ld bytes, erased %u and wrote %u blocks\n",
+	       (long)stats.bytes_before - (long)stats.bytes_after, stats.blocks_erased, stats.blocks_written);
+	printf("wl1251-cal: CAL scan took %.3f ms before and %.3f ms after\n",
+	       stats.scan_ns_before / 1e6, stats.scan_ns_after / 1e6);
+	return 0;
+}
+
+struct wl1251_batch_item {
+	char *image;
+	unsigned char address[6];
+	int fcc;
+	const char *source;	/* CAL section the NVS came from */
+	int ok;
+};
+
+struct wl1251_batch {
+	struct wl1251_batch_item *items;
+	unsigned int count;
+	unsigned int size;	/* Allocated items */
+	unsigned int next;	/* Next item to take, accessed atomically */
+	const char *out;
+};
+
+/* The name of an image without its directory */
+static const char *wl1251_batch_name(const char *image)
+{
+	const char *name = strrchr(image, '/');
+
+	return name ? name + 1 : image;
+}
+
+/* Extract one image into <out>/<image name>.nvs, like wl1251-extract-nvs does */
+static void wl1251_batch_process(struct wl1251_batch *batch, struct wl1251_batch_item *item)
+{
+	struct wl1251_nvs layout;
+	struct cal *c;
+	unsigned char *nvs = NULL;
+	const unsigned char *push;
+	unsigned long nvs_len = 0;
+	const char *name;
+	char path[PATH_MAX];
+	int patched;
+	int fd;
+
+	if (cal_init_file(item->image, &c) < 0) {
+		fprintf(stderr, "wl1251-cal: %s: cal_init failed\n", item->image);
+		return;
+	}
+
+	wl1251_cal_read(c, item->address, &item->fcc, &nvs, &nvs_len);
+	cal_finish(c);
+
+	if (nvs && wl1251_nvs_parse(nvs, nvs_len, &layout) < 0) {
+		wl1251_free(nvs);
+		nvs = NULL;
+	}
+	item->source = nvs ? "wlan-tx-cost3_0" : "default";
+
+	push = wl1251_nvs_select(&nvs, &nvs_len, item->fcc ? "US" : "EU", item->address, &patched);
+
+	name = wl1251_batch_name(item->image);
+	if (snprintf(path, sizeof(path), "%s/%s.nvs", batch->out, name) >= (int)sizeof(path)) {
+		fprintf(stderr, "wl1251-cal: %s: output path is too long\n", item->image);
+		wl1251_free(nvs);
+		return;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || wl1251_write_all(fd, push+4, nvs_len-4) < 0)
+		fprintf(stderr, "wl1251-cal: Cannot write %s: %s\n", path, strerror(errno));
+	else
+		item->ok = 1;
+
+	if (fd >= 0)
+		close(fd);
+	wl1251_free(nvs);
+}
+
+static void *wl1251_batch_worker(void *arg)
+{
+	struct wl1251_batch *batch = arg;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+		wl1251_batch_process(batch, &batch->items[i]);
+
+	return NULL;
+}
+
+static int wl1251_batch_add(struct wl1251_batch *batch, const char *dir, const char *name)
+{
+	struct wl1251_batch_item *items;
+	size_t len;
+
+	if (batch->count == batch->size) {
+		items = realloc(batch->items, (batch->size ? batch->size * 2 : 64) * sizeof(*items));
+		if (!items)
+			return -1;
+		batch->items = items;
+		batch->size = batch->size ? batch->size * 2 : 64;
+	}
+
+	len = (dir ? strlen(dir) + 1 : 0) + strlen(name) + 1;
+	memset(&batch->items[batch->count], 0, sizeof(batch->items[0]));
+	batch->items[batch->count].image = malloc(len);
+	if (!batch->items[batch->count].image)
+		return -1;
+	if (dir)
+		snprintf(batch->items[batch->count].image, len, "%s/%s", dir, name);
+	else
+		memcpy(batch->items[batch->count].image, name, len);
+	batch->count++;
+	return 0;
+}
+
+static int wl1251_batch_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct wl1251_batch_item *)a)->image, ((const struct wl1251_batch_item *)b)->image);
+}
+
+static int wl1251_batch_compare_names(const void *a, const void *b)
+{
+	return strcmp(wl1251_batch_name(*(char *const *)a), wl1251_batch_name(*(char *const *)b));
+}
+
+/* Images are written to <out>/<image name>.nvs, so a list must not repeat a name */
+static int wl1251_batch_check_names(struct wl1251_batch *batch)
+{
+	char **images;
+	unsigned int i;
+	int ret = 0;
+
+	if (batch->count < 2)
+		return 0;
+
+	images = malloc(batch->count * sizeof(*images));
+	if (!images)
+		return -1;
+	for (i = 0; i < batch->count; i++)
+		images[i] = batch->items[i].image;
+	qsort(images, batch->count, sizeof(*images), wl1251_batch_compare_names);
+
+	for (i = 1; i < batch->count; i++) {
+		if (wl1251_batch_compare_names(&images[i-1], &images[i]) == 0) {
+			fprintf(stderr, "wl1251-cal: %s and %s would both be written to %s.nvs\n",
+				images[i-1], images[i], wl1251_batch_name(images[i]));
+			ret = -1;
+		}
+	}
+
+	free(images);
+	if (ret)
+		errno = EINVAL;
+	return ret;
+}
+
+/* input is a directory of images or a file listing one image per line */
+static int wl1251_batch_load(struct wl1251_batch *batch, const char *input)
+{
+	struct dirent *entry;
+	struct stat st;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *list;
+	DIR *dir;
+
+	if (stat(input, &st) == 0 && S_ISDIR(st.st_mode)) {
+		dir = opendir(input);
+		if (!dir)
+			return -1;
+		while ((entry = readdir(dir))) {
+			if (entry->d_name[0] == '.')
+				continue;
+			if (wl1251_batch_add(batch, input, entry->d_name) < 0) {
+				closedir(dir);
+				return -1;
+			}
+		}
+		closedir(dir);
+		qsort(batch->items, batch->count, sizeof(batch->items[0]), wl1251_batch_compare);
+		return 0;
+	}
+
+	list = fopen(input, "r");
+	if (!list)
+		return -1;
+	while ((len = getline(&line, &size, list)) >= 0) {
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = 0;
+		if (!len || line[0] == '#')
+			continue;
+		if (wl1251_batch_add(batch, NULL, line) < 0) {
+			free(line);
+			fclose(list);
+			return -1;
+		}
+	}
+	free(line);
+	fclose(list);
+	return wl1251_batch_check_names(batch);
+}
+
+/*
+ * Extract NVS, MAC and fcc from many CAL images on jobs threads. The NVS files
+ * and a summary line per image go to out.
+ */
+static int wl1251_batch(const char *input, const char *out, int jobs)
+{
+	struct wl1251_batch batch;
+	struct timespec start, end;
+	pthread_t *threads;
+	char path[PATH_MAX];
+	unsigned int failed = 0;
+	unsigned int i;
+	int started = 0;
+	double ms;
+	FILE *summary;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.out = out;
+
+	if (wl1251_batch_load(&batch, input) < 0) {
+		fprintf(stderr, "wl1251-cal: Cannot read batch input %s: %s\n", input, strerror(errno));
+		return 1;
+	}
+
+	if (mkdir(out, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "wl1251-cal: Cannot create %s: %s\n", out, strerror(errno));
+		return 1;
+	}
+
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs <= 0)
+		jobs = 1;
+	if ((unsigned int)jobs > batch.count)
+		jobs = batch.count ? batch.count : 1;
+#ifdef WITH_STATIC_ARENA
+	/* Images take turns in the one arena */
+	jobs = 1;
+#endif
+
+	threads = calloc(jobs, sizeof(*threads));
+	if (!threads) {
+		perror("wl1251-cal: calloc failed");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* The first worker is this thread */
+	for (i = 1; i < (unsigned int)jobs; i++) {
+		if (pthread_create(&threads[i], NULL, wl1251_batch_worker, &batch) != 0)
+			break;
+		started++;
+	}
+	wl1251_batch_worker(&batch);
+	for (i = 1; i <= (unsigned int)started; i++)
+		pthread_join(threads[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(threads);
+
+	snprintf(path, sizeof(path), "%s/summary", out);
+	summary = fopen(path, "w");
+	if (!summary)
+		fprintf(stderr, "wl1251-cal: Cannot create %s: %s\n", path, strerror(errno));
+
+	for (i = 0; i < batch.count; i++) {
+		if (!batch.items[i].ok)
+			failed++;
+		if (summary && batch.items[i].ok)
+			fprintf(summary, "%s\t%02x:%02x:%02x:%02x:%02x:%02x\tfcc=%d\t%s\n", batch.items[i].image,
+				batch.items[i].address[5], batch.items[i].address[4], batch.items[i].address[3],
+				batch.items[i].address[2], batch.items[i].address[1], batch.items[i].address[0],
+				batch.items[i].fcc, batch.items[i].source);
+		else if (summary)
+			fprintf(summary, "%s\tfailed\n", batch.items[i].image);
+		free(batch.items[i].image);
+	}
+	free(batch.items);
+
+	if (summary)
+		fclose(summary);
+
+	ms = wl1251_timespec_ms(&start, &end);
+	printf("wl1251-cal: Processed %u images (%u failed) with %d workers in %.1f ms, %.1f images/s\n",
+	       batch.count, failed, started + 1, ms, ms > 0 ? batch.count * 1000.0 / ms : 0.0);
+
+	return failed ? 1 : 0;
+}
+
+#endif
+
+int main(int argc, char *argv[])
+{
+	int i;
+	unsigned char *nvs = NULL;
+	const unsigned char *push;
+	unsigned long nvs_len = 0;
+	char *nvs_loading = NULL;
+	char *nvs_push_data = NULL;
+	unsigned char address[6];
+	int country_code = 0;
+	int fcc;
+	char regdomain[3];
+	struct cal *c;
+	int usage = 0;
+	const char *timings_log = NULL;
+	const char *env;
+#ifdef WL1251_DAEMON
+	int run_daemon = 0;
+#endif
+	int uevent = 0;
+	const char *sysfs = "/sys";
+	int sysfs_push;
+	const char *cal_image = NULL;
+	int have_nl;
+	int nl_mac;
+#ifndef WITH_LIBCAL
+	enum wl1251_cache_mode cache = WL1251_CACHE_ON;
+	int cache_hit = 0;
+	int compact = 0;
+	const char *batch = NULL;
+	const char *batch_out = NULL;
+	int jobs = 0;
+#endif
+	int fw_nvs = 0;
+	int patched;
+
+	struct wl1251_regdomain_query query;
+
+#ifdef WITH_STATIC_ARENA
+	static char stdout_buf[BUFSIZ];
+
+	/* stdio would allocate it on the first printf() */
+	setvbuf(stdout, stdout_buf, _IOLBF, sizeof(stdout_buf));
+#endif
+
+	wl1251_timing_start();
+
+	env = getenv("WL1251_CAL_TIMINGS");
+	if (env && env[0]) {
+		timings.enabled = 1;
+		timings.json = strcmp(env, "json") == 0;
+	}
+
+	for (i = 1; i < argc; ++i) {
+		if (strncmp(argv[i], "--nvs-loading=", strlen("--nvs-loading=")) == 0)
+			nvs_loading = argv[i] + strlen("--nvs-loading=");
+		else if (strncmp(argv[i], "--nvs-push-data=", strlen("--nvs-push-data=")) == 0)
+			nvs_push_data = argv[i] + strlen("--nvs-push-data=");
+		else if (strcmp(argv[i], "--timings") == 0)
+			timings.enabled = 1;
+		else if (strcmp(argv[i], "--timings=json") == 0)
+			timings.enabled = timings.json = 1;
+		else if (strncmp(argv[i], "--timings-log=", strlen("--timings-log=")) == 0 && argv[i][strlen("--timings-log=")])
+			timings_log = argv[i] + strlen("--timings-log=");
+#ifdef WL1251_DAEMON
+		else if (strcmp(argv[i], "--daemon") == 0)
+			run_daemon = 1;
+#endif
+		else if (strcmp(argv[i], "--uevent") == 0)
+			uevent = 1;
+		else if (strncmp(argv[i], "--sysfs-root=", strlen("--sysfs-root=")) == 0 && argv[i][strlen("--sysfs-root=")])
+			sysfs = argv[i] + strlen("--sysfs-root=");
+#ifdef WITH_FAKE
+		else if (strcmp(argv[i], "--fake") == 0)
+			transport = &wl1251_fake_transport;
+		else if (strncmp(argv[i], "--fake=", strlen("--fake=")) == 0 && wl1251_fake_parse(argv[i] + strlen("--fake=")) == 0)
+			transport = &wl1251_fake_transport;
+#endif
+#ifndef WITH_LIBCAL
+		else if (strncmp(argv[i], "--cal-image=", strlen("--cal-image=")) == 0 && argv[i][strlen("--cal-image=")])
+			cal_image = argv[i] + strlen("--cal-image=");
+		else if (strcmp(argv[i], "--no-cache") == 0)
+			cache = WL1251_CACHE_OFF;
+		else if (strcmp(argv[i], "--rebuild-cache") == 0)
+			cache = WL1251_CACHE_REBUILD;
+		else if (strcmp(argv[i], "--compact-cal") == 0)
+			compact = 1;
+		else if (strncmp(argv[i], "--batch=", strlen("--batch=")) == 0 && argv[i][strlen("--batch=")])
+			batch = argv[i] + strlen("--batch=");
+		else if (strncmp(argv[i], "--batch-out=", strlen("--batch-out=")) == 0 && argv[i][strlen("--batch-out=")])
+			batch_out = argv[i] + strlen("--batch-out=");
+		else if (strncmp(argv[i], "--jobs=", strlen("--jobs=")) == 0 && atoi(argv[i] + strlen("--jobs=")) > 0)
+			jobs = atoi(argv[i] + strlen("--jobs="));
+#endif
+		else
+			usage = 1;
+	}
+
+	if ((nvs_loading && !nvs_loading[0]) || (nvs_push_data && !nvs_push_data[0]) || !nvs_loading != !nvs_push_data)
+		usage = 1;
+
+	/* The uevent responder answers requests itself and stays resident */
+	if (uevent && nvs_loading)
+		usage = 1;
+#ifdef WL1251_DAEMON
+	if (uevent && run_daemon)
+		usage = 1;
+	/* Without DBus and libnl only the fakes can follow registration changes */
+	if (run_daemon && !transport->registration_open)
+		usage = 1;
+#endif
+
+	sysfs_push = nvs_push_data || uevent;
+
+#ifndef WITH_LIBCAL
+	if (!batch != !batch_out)
+		usage = 1;
+#endif
+
+	if (timings_log)
+		timings.enabled = 1;
+
+	if (usage) {
+#if 0
+		printf("Usage: %s [--nvs-loading=/sys/class/firmware/ti-connectivity!wl1251-nvs.bin/loading --nvs-push-data=/sys/class/firmware/ti-connectivity!wl1251-nvs.bin/data]\n", argv[0]);
+#endif
+		printf("Usage: %s [--timings[=json]] [--timings-log=FILE]", argv[0]);
+#ifndef WITH_LIBCAL
+		printf(" [--cal-image=FILE] [--no-cache|--rebuild-cache] [--compact-cal] [--batch=DIR|LIST --batch-out=DIR [--jobs=N]]");
+#endif
+#ifdef WL1251_DAEMON
+		printf(" [--daemon]");
+#endif
+		printf(" [--uevent [--sysfs-root=DIR]]");
+#ifdef WITH_FAKE
+		printf(" [--fake[=mcc=N,mcc-delay=MS,nl=ack|fail|missing,nl-delay=MS,sysfs=ok|fail|missing,mac=ok|fail,uevents=N,signals=N,signal-delay=MS]]");
+#endif
+		printf("\n");
+		return 1;
+	}
+
+#ifndef WITH_LIBCAL
+	if (compact)
+		return wl1251_cal_compact(cal_image);
+	if (batch)
+		return wl1251_batch(batch, batch_out, jobs);
+#endif
+
+	if (nvs_loading && transport->sysfs_write(nvs_loading, "1\n") < 0)
+		return 1;
+
+	wl1251_timing_mark("loading");
+
+	wl1251_regdomain_query_start(&query);
+
+	if (transport->cal_open(cal_image, &c) < 0) {
+		fprintf(stderr, "wl1251-cal: cal_init failed\n");
+		c = NULL;
+	}
+
+#ifndef WITH_LIBCAL
+	if (c && cache == WL1251_CACHE_ON) {
+		cache_hit = wl1251_cache_load(c, address, &fcc, &nvs, &nvs_len) == 0;
+		printf("wl1251-cal: NVS cache %s\n", cache_hit ? "hit" : "miss");
+		if (cache_hit)
+			wl1251_timing_mark("cal");
+	}
+
+	if (!cache_hit) {
+		fw_nvs = wl1251_read_nvs_data(c, address, &fcc, &nvs, &nvs_len);
+		if (c && cache != WL1251_CACHE_OFF)
+			wl1251_cache_store(c, address, fcc, nvs, nvs_len, fw_nvs);
+	}
+#else
+	fw_nvs = wl1251_read_nvs_data(c, address, &fcc, &nvs, &nvs_len);
+#endif
+
+	if (c)
+		cal_finish(c);
+
+	wl1251_regdomain_query_join(&query);
+	country_code = query.country_code;
+
+	wl1251_timing_mark("join");
+	wl1251_timing_add("query", query.ms);
+
+	if (country_code || fcc) {
+		wl1251_country_code_to_regdomain(country_code, fcc, regdomain);
+	} else if (wl1251_vfs_read_regdomain(query.crda, query.crda_len, regdomain) < 0) {
+		printf("wl1251-cal: Fallback regulatory domain: EU\n");
+		memcpy(regdomain, "EU", 3);
+	}
+
+	wl1251_timing_mark("regdomain");
+
+	push = wl1251_nvs_select(&nvs, &nvs_len, regdomain, address, &patched);
+
+	if (nvs_push_data)
+		transport->sysfs_push(nvs_push_data, push, nvs_len, fw_nvs && nvs && !patched);
+
+	if (nvs_loading)
+		transport->sysfs_write(nvs_loading, "0\n");
+
+	wl1251_timing_mark("push");
+
+	have_nl = transport->nl_open() == 0;
+	nl_mac = 0;
+
+	if (!sysfs_push) {
+		if (memcmp(address, "\0\0\0\0\0\0", 6) != 0) {
+			if (have_nl && transport->nl_set_mac("wlan0", address) == 0)
+				nl_mac = 1;
+			else
+				transport->set_mac("wlan0", address);
+		}
+		wl1251_timing_mark("mac");
+	}
+
+	if (have_nl) {
+		if (!sysfs_push) {
+			if (transport->nl_push_nvs("wlan0", push+4, nvs_len-4) < 0)
+				fprintf(stderr, "wl1251-cal: Couldnt push NVS\n");
+		}
+		if (transport->nl_push_regdomain(regdomain) < 0)
+			fprintf(stderr, "wl1251-cal: Couldnt push regdomain\n");
+		transport->nl_wait(WL1251_NL_TIMEOUT);
+		/* The link may refuse the address only once the request is acked */
+		if (nl_mac && !transport->nl_acked("RTM_SETLINK")) {
+			fprintf(stderr, "wl1251-cal: falling back to SIOCSIFHWADDR\n");
+			transport->set_mac("wlan0", address);
+		}
+		transport->nl_close();
+	}
+
+	wl1251_timing_mark("netlink");
+
+	WL1251_PROBE(done, regdomain);
+
+	wl1251_timing_print();
+	wl1251_timing_log(timings_log);
+
+	if (uevent)
+		return wl1251_uevent_listen(sysfs, push, nvs_len, fw_nvs && nvs && !patched);
+
+#ifdef WL1251_DAEMON
+	if (run_daemon)
+		return wl1251_daemon(fcc, regdomain);
 #endif
 
 	return 0;